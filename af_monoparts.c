@@ -10,59 +10,119 @@
 #include "libavutil/channel_layout.h"
 #include "avfilter.h"
 #include "audio.h"
+#include "filters.h"
 #include "internal.h"
 
-static void stereo2mono_fltp(AVFrame *frame)
+/* the i-th sample of channel c, interleaved or planar, float or double */
+static av_always_inline double get_sample(AVFrame *frame, int c, int i,
+	const enum AVSampleFormat fmt)
 {
-    float **data = (float **) frame->extended_data;
-    for (int i = 0; i < frame->nb_samples; i++) {
-	double c0 = data[0][i];
-	double c1 = data[1][i];
-	double step = 0.5 / (frame->nb_samples + 1);
-	double attack = (i + 1) * step; // from 0 to 0.5
+    uint8_t **data = frame->extended_data;
+    switch (fmt) {
+    case AV_SAMPLE_FMT_FLT: return ((float *) data[0])[2 * i + c];
+    case AV_SAMPLE_FMT_DBL: return ((double *) data[0])[2 * i + c];
+    case AV_SAMPLE_FMT_DBLP: return ((double *) data[c])[i];
+    default: return ((float *) data[c])[i];
+    }
+}
+
+static av_always_inline void set_sample(AVFrame *frame, int c, int i,
+	double x, const enum AVSampleFormat fmt)
+{
+    uint8_t **data = frame->extended_data;
+    switch (fmt) {
+    case AV_SAMPLE_FMT_FLT: ((float *) data[0])[2 * i + c] = x; break;
+    case AV_SAMPLE_FMT_DBL: ((double *) data[0])[2 * i + c] = x; break;
+    case AV_SAMPLE_FMT_DBLP: ((double *) data[c])[i] = x; break;
+    default: ((float *) data[c])[i] = x; break;
+    }
+}
+
+/*
+ * The ramps run over a part of len samples; each function processes
+ * n samples of the frame at offset off, which are pos samples into the part.
+ */
+static av_always_inline void stereo2mono(AVFrame *frame, int off, int n,
+	int pos, int len, const enum AVSampleFormat fmt)
+{
+    for (int i = off; i < off + n; i++) {
+	double c0 = get_sample(frame, 0, i, fmt);
+	double c1 = get_sample(frame, 1, i, fmt);
+	double step = 0.5 / (len + 1);
+	double attack = (pos + i - off + 1) * step; // from 0 to 0.5
 	double release = 1 - attack; // from 1 down to 0.5
-	data[0][i] = c0 * release + c1 * attack;
-	data[1][i] = c1 * release + c0 * attack;
+	set_sample(frame, 0, i, c0 * release + c1 * attack, fmt);
+	set_sample(frame, 1, i, c1 * release + c0 * attack, fmt);
     }
 }
 
-static void mono2stereo_fltp(AVFrame *frame)
+static av_always_inline void mono2stereo(AVFrame *frame, int off, int n,
+	int pos, int len, const enum AVSampleFormat fmt)
 {
-    float **data = (float **) frame->extended_data;
-    for (int i = 0; i < frame->nb_samples; i++) {
-	double c0 = data[0][i];
-	double c1 = data[1][i];
-	double step = 0.5 / (frame->nb_samples + 1);
-	double attack = 0.5 + (i + 1) * step; // from 0.5 to 1
+    for (int i = off; i < off + n; i++) {
+	double c0 = get_sample(frame, 0, i, fmt);
+	double c1 = get_sample(frame, 1, i, fmt);
+	double step = 0.5 / (len + 1);
+	double attack = 0.5 + (pos + i - off + 1) * step; // from 0.5 to 1
 	double release = 1 - attack; // from 0.5 down to 0
-	data[0][i] = c0 * attack + c1 * release;
-	data[1][i] = c1 * attack + c0 * release;
+	set_sample(frame, 0, i, c0 * attack + c1 * release, fmt);
+	set_sample(frame, 1, i, c1 * attack + c0 * release, fmt);
     }
 }
 
-static void full_mono_fltp(AVFrame *frame)
+static av_always_inline void full_mono(AVFrame *frame, int off, int n,
+	int pos, int len, const enum AVSampleFormat fmt)
 {
-    float **data = (float **) frame->extended_data;
-    for (int i = 0; i < frame->nb_samples; i++) {
-	double c0 = data[0][i];
-	double c1 = data[1][i];
+    for (int i = off; i < off + n; i++) {
+	double c0 = get_sample(frame, 0, i, fmt);
+	double c1 = get_sample(frame, 1, i, fmt);
 	double avg = (c0 + c1) / 2;
-	data[0][i] = avg;
-	data[1][i] = avg;
+	set_sample(frame, 0, i, avg, fmt);
+	set_sample(frame, 1, i, avg, fmt);
     }
 }
 
+/* the above, specialized for each sample format */
+#define ARGS AVFrame *frame, int off, int n, int pos, int len
+#define DEFINE_FMT(name, fmt) \
+static void stereo2mono_##name(ARGS) { stereo2mono(frame, off, n, pos, len, fmt); } \
+static void mono2stereo_##name(ARGS) { mono2stereo(frame, off, n, pos, len, fmt); } \
+static void full_mono_##name(ARGS) { full_mono(frame, off, n, pos, len, fmt); }
+
+DEFINE_FMT(flt, AV_SAMPLE_FMT_FLT)
+DEFINE_FMT(fltp, AV_SAMPLE_FMT_FLTP)
+DEFINE_FMT(dbl, AV_SAMPLE_FMT_DBL)
+DEFINE_FMT(dblp, AV_SAMPLE_FMT_DBLP)
+
+/* a frame in the last part, whose ramp waits for the end; a part is one
+ * segment of the frame at most */
+struct held {
+    AVFrame *frame;
+    int off, n, pos;
+};
+
 typedef struct MonoPartsContext {
     const AVClass *class;
     const char *parts0;
     const char *parts;
     int part1, part2;
+    /* the parts are of part_len samples, 100 ms, whatever the size
+     * of the frames; the current one is part_pos samples in */
     int current_part;
-    void (*stereo2mono)(AVFrame *frame);
-    void (*mono2stereo)(AVFrame *frame);
-    void (*full_mono)(AVFrame *frame);
+    int part_len;
+    int part_pos;
+    /* The last part is held until it is known whether the stream goes
+     * on past it: the ramp back to stereo then runs as usual, otherwise
+     * the part is made fully mono. */
+    struct held *held;
+    int nheld, held_size;
+    void (*stereo2mono)(ARGS);
+    void (*mono2stereo)(ARGS);
+    void (*full_mono)(ARGS);
 } MonoPartsContext;
 
+#undef ARGS
+
 #define OFFSET(x) offsetof(MonoPartsContext, x)
 #define FLAGS AV_OPT_FLAG_AUDIO_PARAM|AV_OPT_FLAG_FILTERING_PARAM
 static const AVOption monoparts_options[] = {
@@ -106,9 +166,6 @@ error:
 static int init(AVFilterContext *ctx)
 {
     MonoPartsContext *s = ctx->priv;
-    s->mono2stereo = mono2stereo_fltp;
-    s->stereo2mono = stereo2mono_fltp;
-    s->full_mono = full_mono_fltp;
     if (!scan_part(ctx))
         return AVERROR(EINVAL);
     return 0;
@@ -123,9 +180,20 @@ static int config_input(AVFilterLink *inlink)
         av_log(ctx, AV_LOG_ERROR, "weird sample rate: %d\n", inlink->sample_rate);
         return AVERROR(EINVAL);
     }
-    inlink->min_samples =
-    inlink->max_samples =
-    inlink->partial_buf_size = inlink->sample_rate / 10;
+    s->part_len = inlink->sample_rate / 10;
+
+#define SET_FMT(name) \
+	s->stereo2mono = stereo2mono_##name, \
+	s->mono2stereo = mono2stereo_##name, \
+	s->full_mono = full_mono_##name
+    switch (inlink->format) {
+    case AV_SAMPLE_FMT_FLT: SET_FMT(flt); break;
+    case AV_SAMPLE_FMT_FLTP: SET_FMT(fltp); break;
+    case AV_SAMPLE_FMT_DBL: SET_FMT(dbl); break;
+    case AV_SAMPLE_FMT_DBLP: SET_FMT(dblp); break;
+    default: return AVERROR_BUG;
+    }
+#undef SET_FMT
 
     return 0;
 }
@@ -141,65 +209,167 @@ static int query_formats(AVFilterContext *ctx)
     ret = ff_set_common_channel_layouts(ctx, layouts);
     if (ret < 0) return ret;
 
-#if 0
     ret = ff_add_format(&formats, AV_SAMPLE_FMT_FLT);
     if (ret < 0) return ret;
-#endif
     ret = ff_add_format(&formats, AV_SAMPLE_FMT_FLTP);
     if (ret < 0) return ret;
+    ret = ff_add_format(&formats, AV_SAMPLE_FMT_DBL);
+    if (ret < 0) return ret;
+    ret = ff_add_format(&formats, AV_SAMPLE_FMT_DBLP);
+    if (ret < 0) return ret;
     ret = ff_set_common_formats(ctx, formats);
     if (ret < 0) return ret;
 
     return ff_set_common_samplerates(ctx, ff_all_samplerates());
 }
 
+static int hold(MonoPartsContext *s, AVFrame *frame, int off, int n, int pos)
+{
+    if (s->nheld == s->held_size) {
+	int size = s->held_size ? 2 * s->held_size : 16;
+	struct held *held = av_realloc_array(s->held, size, sizeof *held);
+	if (!held)
+	    return AVERROR(ENOMEM);
+	s->held = held;
+	s->held_size = size;
+    }
+    s->held[s->nheld++] = (struct held) { frame, off, n, pos };
+    return 0;
+}
+
+/* apply the ramp, or make the part mono at the end of the stream, and send
+ * out the held frames, but for the current one, which is last */
+static int release(MonoPartsContext *s, AVFilterLink *outlink, AVFrame *current,
+	bool eof)
+{
+    int ret = 0;
+    for (int i = 0; i < s->nheld; i++) {
+	struct held *h = &s->held[i];
+	if (eof)
+	    s->full_mono(h->frame, h->off, h->n, h->pos, s->part_len);
+	else
+	    s->mono2stereo(h->frame, h->off, h->n, h->pos, s->part_len);
+	if (h->frame != current)
+	    ret |= ff_filter_frame(outlink, h->frame);
+    }
+    s->nheld = 0;
+    return ret;
+}
+
 static int filter_frame(AVFilterLink *inlink, AVFrame *frame)
 {
     AVFilterContext *ctx = inlink->dst;
     MonoPartsContext *s = ctx->priv;
     AVFilterLink *outlink = ctx->outputs[0];
+    int ret = 0;
 
-    int part = s->current_part++;
-    if (part < s->part1) // stereo passthru
-	return ff_filter_frame(outlink, frame);
+    /* the frame goes by the parts it spans */
+    for (int off = 0; off < frame->nb_samples; ) {
+	int part = s->current_part;
+	int pos = s->part_pos;
+	int n = FFMIN(frame->nb_samples - off, s->part_len - pos);
 
-    if (!av_frame_is_writable(frame)) {
-	AVFrame *copy = ff_get_audio_buffer(inlink, frame->nb_samples);
-	av_frame_copy_props(copy, frame);
-	av_frame_copy(copy, frame);
-	av_frame_free(&frame);
-	frame = copy;
+	if (part >= s->part1 && !av_frame_is_writable(frame)) {
+	    AVFrame *copy = ff_get_audio_buffer(inlink, frame->nb_samples);
+	    if (!copy) {
+		av_frame_free(&frame);
+		return AVERROR(ENOMEM);
+	    }
+	    av_frame_copy_props(copy, frame);
+	    av_frame_copy(copy, frame);
+	    av_frame_free(&frame);
+	    frame = copy;
+	}
+
+	if (part < s->part1)
+	    ; // stereo passthru
+	else if (part == s->part1) {
+	    if (part == 0)
+		s->full_mono(frame, off, n, pos, s->part_len);
+	    else
+		s->stereo2mono(frame, off, n, pos, s->part_len);
+	}
+	else if (part < s->part2)
+	    s->full_mono(frame, off, n, pos, s->part_len);
+	else if (part == s->part2 && *s->parts == '\0') {
+	    ret = hold(s, frame, off, n, pos);
+	    if (ret < 0) {
+		av_frame_free(&frame);
+		return ret;
+	    }
+	}
+	else if (part == s->part2)
+	    s->mono2stereo(frame, off, n, pos, s->part_len);
+
+	off += n;
+	s->part_pos += n;
+	if (s->part_pos < s->part_len)
+	    continue;
+	s->part_pos = 0;
+	s->current_part++;
+	if (part == s->part2) {
+	    if (*s->parts == '\0') {
+		ret = release(s, outlink, frame, false);
+		s->part1 = s->part2 = INT_MAX;
+	    }
+	    else if (!scan_part(ctx)) {
+		av_frame_free(&frame);
+		return AVERROR(EINVAL);
+	    }
+	}
     }
 
-    if (part == s->part1) {
-	if (part == 0)
-	    s->full_mono(frame);
-	else
-	    s->stereo2mono(frame);
+    /* the frame waits with the last part */
+    if (s->nheld)
+	return ret;
+    return ret | ff_filter_frame(outlink, frame);
+}
+
+/* The frames are taken as they come, whatever their size; at the end,
+ * the frames held with the last part go out, and then the end with its
+ * timestamp. */
+static int activate(AVFilterContext *ctx)
+{
+    MonoPartsContext *s = ctx->priv;
+    AVFilterLink *inlink = ctx->inputs[0];
+    AVFilterLink *outlink = ctx->outputs[0];
+    AVFrame *frame;
+    int64_t pts;
+    int ret, status;
+
+    FF_FILTER_FORWARD_STATUS_BACK(outlink, inlink);
+
+    ret = ff_inlink_consume_frame(inlink, &frame);
+    if (ret < 0)
+	return ret;
+    if (ret > 0) {
+	ff_filter_set_ready(ctx, 100);
+	return filter_frame(inlink, frame);
     }
-    else if (part < s->part2)
-	s->full_mono(frame);
-    else if (part == s->part2) {
-	bool smallframe = frame->nb_samples < inlink->min_samples;
-	bool lastpart = *s->parts == '\0';
-	if (smallframe && lastpart)
-	    s->full_mono(frame);
-	else
-	    s->mono2stereo(frame);
-	if (lastpart)
-	    s->part1 = s->part2 = INT_MAX;
-	else if (!scan_part(ctx))
-	    return AVERROR(EINVAL);
+
+    if (ff_inlink_acknowledge_status(inlink, &status, &pts)) {
+	ret = release(s, outlink, NULL, true);
+	ff_outlink_set_status(outlink, status, pts);
+	return ret;
     }
 
-    return ff_filter_frame(outlink, frame);
+    FF_FILTER_FORWARD_WANTED(outlink, inlink);
+
+    return FFERROR_NOT_READY;
+}
+
+static av_cold void uninit(AVFilterContext *ctx)
+{
+    MonoPartsContext *s = ctx->priv;
+    for (int i = 0; i < s->nheld; i++)
+	av_frame_free(&s->held[i].frame);
+    av_freep(&s->held);
 }
 
 static const AVFilterPad inputs[] = {
     {
 	.name		= "default",
 	.type		= AVMEDIA_TYPE_AUDIO,
-	.filter_frame	= filter_frame,
 	.config_props	= config_input,
     },
     { NULL }
@@ -219,6 +389,8 @@ AVFilter ff_af_monoparts = {
     .query_formats = query_formats,
     .priv_size     = sizeof(MonoPartsContext),
     .init          = init,
+    .uninit        = uninit,
+    .activate      = activate,
     .inputs        = inputs,
     .outputs       = outputs,
     .priv_class    = &monoparts_class,
@@ -10,79 +10,84 @@
  * version 2.1 of the License, or (at your option) any later version.
  */
 
-#include <float.h>
 #include <stdbool.h>
 
 #include "libavutil/avassert.h"
 #include "libavutil/opt.h"
 
-#define FF_BUFQUEUE_SIZE 1005 // assume filter size=999 delays by 500
-#include "libavfilter/bufferqueue.h"
-
 #include "audio.h"
 #include "avfilter.h"
+#include "filters.h"
 #include "internal.h"
-
-typedef struct cqueue {
-    double *elements;
-    int size;
-    int nb_elements;
-    int first;
-} cqueue;
+#include "libqadrc.h"
 
 typedef struct MyDRCContext {
     const AVClass *class;
 
-    struct FFBufQueue queue;
+    // the frames held for the lookahead, a ring of frames_size slots;
+    // the first one is amplified up to fpos
+    AVFrame **frames;
+    size_t frames_size;
+    size_t fhead;
+    size_t nframes;
+    size_t fpos;
 
-    int frame_len;
     int min_size;
     int filter_size;
-
-    double prev_rms_sum;
-    double prev_amplification_factor;
-    double *fade_factors[2];
-    double *weights;
-
-    // For each 100 ms input frame, its (partial) RMS sum is first computed.
-    // It then undergoes the three stages of filtering, until the final gain
-    // is known and applied to the frame:
-    // 1) 400 ms RMS out of 4 partial sums is computed; these 400 ms intervals
-    // are overlapping, as per EBU R128 (and so the data from 4 frames should
-    // take its full effect at the end of the second frame).
-    // 2) For each RMS value, the gain is computed, and the minimum is taken
-    // among a few adjacent gain values. (This is to cope better with short and
-    // sudden bursts.)
-    // 3) The resulting gain curve is smoothed with the Gaussian filter.
-    cqueue *gain_rms;
-    cqueue *gain_min;
-    cqueue *gain_smooth;
-
-    int flush_state;
-    double *flush_buf;
+    int hop;
 
     // gain computer
     double thresh;
     double ratio;
     double knee;
 
-    double Tlo;
-    double Thi;
+    // parallel qadrc
+    double mix;
+    double qthresh;
+    double qratio;
+    double qknee;
+    double attack;
+    double release;
+    double delay;
 
-    double slope;
-    double knee_factor;
+    mydrc *m;
 
-    // highpass filter
-    double hi_a;
-    double hi_x[8];
-    double hi_y[8];
-    bool hi_once;
+    // gain file
+    const char *gain_fname;
+    int gain_mode;
+    FILE *gain_fp;
 
     // waveform
     const char *wf_fname;
     FILE *wf_fp;
 } MyDRCContext;
 
+enum { GAIN_READ, GAIN_WRITE };
+
+// the i-th queued frame
+#define FRAME(s, i) ((s)->frames[((s)->fhead + (i)) & ((s)->frames_size - 1)])
+
+// The ring only grows, to the size that the stream needs; its size
+// is a power of two.
+static int reserve_frames(MyDRCContext *s, size_t n)
+{
+    if (n <= s->frames_size)
+	return 0;
+    size_t size = s->frames_size ? s->frames_size : 16;
+    while (size < n)
+	size *= 2;
+    AVFrame **frames = av_malloc_array(size, sizeof(AVFrame *));
+    if (!frames)
+	return AVERROR(ENOMEM);
+    for (size_t i = 0; i < s->nframes; i++)
+	frames[i] = FRAME(s, i);
+    av_free(s->frames);
+    s->frames = frames;
+    s->frames_size = size;
+    s->fhead = 0;
+    return 0;
+}
+
 #define OFFSET(x) offsetof(MyDRCContext, x)
 #define FLAGS AV_OPT_FLAG_AUDIO_PARAM|AV_OPT_FLAG_FILTERING_PARAM
 
@@ -92,6 +97,18 @@ static const AVOption mydrc_options[] = {
     { "knee", "knee width", OFFSET(knee), AV_OPT_TYPE_DOUBLE, {.dbl = 20}, 0, 70, FLAGS },
     { "g", "set the gaussian filter size",     OFFSET(filter_size),       AV_OPT_TYPE_INT,    {.i64 = 131},    3,   999, FLAGS },
     { "min", "set the min filter size",        OFFSET(min_size),          AV_OPT_TYPE_INT,    {.i64 =  11},    3,   999, FLAGS },
+    { "hop", "set the analysis hop, ms",       OFFSET(hop),               AV_OPT_TYPE_INT,    {.i64 = 100},   10,   100, FLAGS },
+    { "mix", "weight of the parallel qadrc",   OFFSET(mix),               AV_OPT_TYPE_DOUBLE, {.dbl = 0},      0,     1, FLAGS },
+    { "qthresh", "qadrc threshold",            OFFSET(qthresh),           AV_OPT_TYPE_DOUBLE, {.dbl = -35},  -70,     0, FLAGS },
+    { "qratio", "qadrc compression ratio",     OFFSET(qratio),            AV_OPT_TYPE_DOUBLE, {.dbl = 1.5},    1,   100, FLAGS },
+    { "qknee", "qadrc knee width",             OFFSET(qknee),             AV_OPT_TYPE_DOUBLE, {.dbl = 20},     0,    70, FLAGS },
+    { "attack", "qadrc attack time",           OFFSET(attack),            AV_OPT_TYPE_DOUBLE, {.dbl = 20},     0,  1000, FLAGS },
+    { "release", "qadrc release time",         OFFSET(release),           AV_OPT_TYPE_DOUBLE, {.dbl = 800},    0,  9000, FLAGS },
+    { "delay", "qadrc delay time",             OFFSET(delay),             AV_OPT_TYPE_DOUBLE, {.dbl = 10},     0,  1000, FLAGS },
+    { "gainfile", "read or write a gain file", OFFSET(gain_fname),        AV_OPT_TYPE_STRING, {.str = NULL},   0,     0, FLAGS },
+    { "gainmode", "set the gain file mode",    OFFSET(gain_mode),         AV_OPT_TYPE_INT,    {.i64 = GAIN_READ}, 0, 1, FLAGS, "gainmode" },
+    {   "read", "apply the gains, no lookahead", 0,                       AV_OPT_TYPE_CONST,  {.i64 = GAIN_READ},  0, 0, FLAGS, "gainmode" },
+    {   "write", "analyze, and write the gains", 0,                       AV_OPT_TYPE_CONST,  {.i64 = GAIN_WRITE}, 0, 0, FLAGS, "gainmode" },
     { "wf", "write a waveform file",           OFFSET(wf_fname),          AV_OPT_TYPE_STRING, {.str = NULL},   0,     0, FLAGS },
     { NULL }
 };
@@ -112,6 +129,11 @@ static av_cold int init(AVFilterContext *ctx)
         return AVERROR(EINVAL);
     }
 
+    if (s->hop % 10 || 100 % s->hop) {
+        av_log(ctx, AV_LOG_ERROR, "hop %d is invalid. Must be 10, 20, 50 or 100.\n", s->hop);
+        return AVERROR(EINVAL);
+    }
+
     if (s->wf_fname) {
 	s->wf_fp = fopen(s->wf_fname, "w");
 	if (!s->wf_fp) {
@@ -122,14 +144,32 @@ static av_cold int init(AVFilterContext *ctx)
 	fwrite("\0\0\0", 4, 1, s->wf_fp);
     }
 
+    if (s->gain_fname) {
+	s->gain_fp = fopen(s->gain_fname, s->gain_mode == GAIN_WRITE ? "wb" : "rb");
+	if (!s->gain_fp) {
+	    av_log(ctx, AV_LOG_ERROR, "cannot open %s\n", s->gain_fname);
+	    return AVERROR(EINVAL);
+	}
+    }
+
     return 0;
 }
 
 static int query_formats(AVFilterContext *ctx)
 {
+    MyDRCContext *s = ctx->priv;
     AVFilterFormats *formats;
     AVFilterChannelLayouts *layouts;
+    // the parallel qadrc takes floats only
     static const enum AVSampleFormat sample_fmts[] = {
+        AV_SAMPLE_FMT_FLT,
+        AV_SAMPLE_FMT_FLTP,
+        AV_SAMPLE_FMT_DBL,
+        AV_SAMPLE_FMT_DBLP,
+        AV_SAMPLE_FMT_NONE
+    };
+    static const enum AVSampleFormat float_fmts[] = {
+        AV_SAMPLE_FMT_FLT,
         AV_SAMPLE_FMT_FLTP,
         AV_SAMPLE_FMT_NONE
     };
@@ -142,7 +182,7 @@ static int query_formats(AVFilterContext *ctx)
     if (ret < 0)
         return ret;
 
-    formats = ff_make_format_list(sample_fmts);
+    formats = ff_make_format_list(s->mix > 0 ? float_fmts : sample_fmts);
     if (!formats)
         return AVERROR(ENOMEM);
     ret = ff_set_common_formats(ctx, formats);
@@ -155,134 +195,35 @@ static int query_formats(AVFilterContext *ctx)
     return ff_set_common_samplerates(ctx, formats);
 }
 
-static inline int frame_size(int sample_rate)
+/* the libqadrc layout of the sample format */
+static int qadrc_fmt(enum AVSampleFormat format)
 {
-    return sample_rate / 10.0 + 0.5; // 100 msec
-}
-
-static void precalculate_fade_factors(double *fade_factors[2], int frame_len)
-{
-    const double step_size = 1.0 / frame_len;
-    int pos;
-
-    for (pos = 0; pos < frame_len; pos++) {
-        fade_factors[0][pos] = 1.0 - (step_size * (pos + 0.5));
-	av_assert0(fade_factors[0][pos] > 0.0);
-	av_assert0(fade_factors[0][pos] < 1.0);
-        fade_factors[1][pos] = 1.0 - fade_factors[0][pos];
-	av_assert0(fade_factors[1][pos] > 0.0);
-	av_assert0(fade_factors[1][pos] < 1.0);
-    }
-}
-
-static cqueue *cqueue_create(int size)
-{
-    cqueue *q;
-
-    q = av_malloc(sizeof(cqueue));
-    if (!q)
-        return NULL;
-
-    q->size = size;
-    q->nb_elements = 0;
-    q->first = 0;
-
-    q->elements = av_malloc(sizeof(double) * size);
-    if (!q->elements) {
-        av_free(q);
-        return NULL;
+    switch (format) {
+    case AV_SAMPLE_FMT_FLT: return QADRC_FLT;
+    case AV_SAMPLE_FMT_DBL: return QADRC_DBL;
+    case AV_SAMPLE_FMT_DBLP: return QADRC_DBLP;
+    default: return QADRC_FLTP;
     }
-
-    return q;
-}
-
-static void cqueue_free(cqueue *q)
-{
-    av_free(q->elements);
-    av_free(q);
-}
-
-static int cqueue_size(cqueue *q)
-{
-    return q->nb_elements;
-}
-
-static int cqueue_empty(cqueue *q)
-{
-    return !q->nb_elements;
 }
 
-static int cqueue_enqueue(cqueue *q, double element)
-{
-    int i;
-
-    av_assert2(q->nb_elements != q->size);
-
-    i = (q->first + q->nb_elements) % q->size;
-    q->elements[i] = element;
-    q->nb_elements++;
-
-    return 0;
-}
-
-static double cqueue_peek(cqueue *q, int index)
-{
-    av_assert2(index < q->nb_elements);
-    return q->elements[(q->first + index) % q->size];
-}
-
-static double *cqueue_peekp(cqueue *q, int index)
-{
-    av_assert2(index < q->nb_elements);
-    return &q->elements[(q->first + index) % q->size];
-}
-
-static int cqueue_dequeue(cqueue *q, double *element)
-{
-    av_assert2(!cqueue_empty(q));
-
-    *element = q->elements[q->first];
-    q->first = (q->first + 1) % q->size;
-    q->nb_elements--;
-
-    return 0;
-}
+// the engine's jobs run on the slice threads
+struct job {
+    qadrc_job_fn fn;
+    void *arg;
+};
 
-static int cqueue_pop(cqueue *q)
+static int run_job(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
 {
-    av_assert2(!cqueue_empty(q));
-
-    q->first = (q->first + 1) % q->size;
-    q->nb_elements--;
-
+    struct job *job = arg;
+    job->fn(job->arg, jobnr, nb_jobs);
     return 0;
 }
 
-static void init_gaussian_filter(MyDRCContext *s)
+static void execute(void *arg, qadrc_job_fn fn, void *fn_arg, unsigned nb_jobs)
 {
-    double total_weight = 0.0;
-    const double sigma = (((s->filter_size / 2.0) - 1.0) / 3.0) + (1.0 / 3.0);
-    double adjust;
-    int i;
-
-    // Pre-compute constants
-    const int offset = s->filter_size / 2;
-    const double c1 = 1.0 / (sigma * sqrt(2.0 * M_PI));
-    const double c2 = 2.0 * pow(sigma, 2.0);
-
-    // Compute weights
-    for (i = 0; i < s->filter_size; i++) {
-        const int x = i - offset;
-
-        s->weights[i] = c1 * exp(-(pow(x, 2.0) / c2));
-        total_weight += s->weights[i];
-    }
-
-    // Adjust weights
-    adjust = 1.0 / total_weight;
-    for (i = 0; i < s->filter_size; i++) {
-        s->weights[i] *= adjust;
-    }
+    AVFilterContext *ctx = arg;
+    struct job job = { fn, fn_arg };
+    ctx->internal->execute(ctx, run_job, &job, NULL, nb_jobs);
 }
 
 static int config_input(AVFilterLink *inlink)
@@ -290,395 +231,187 @@ static int config_input(AVFilterLink *inlink)
     AVFilterContext *ctx = inlink->dst;
     MyDRCContext *s = ctx->priv;
 
-    int hz = 100;
-    double RC = 1 / (2 * M_PI * hz);
-    s->hi_a = RC / (RC + 1.0 / inlink->sample_rate);
-
-    s->frame_len =
-    inlink->min_samples =
-    inlink->max_samples =
-    inlink->partial_buf_size = frame_size(inlink->sample_rate);
-    av_log(ctx, AV_LOG_DEBUG, "frame len %d\n", s->frame_len);
-
-    s->prev_rms_sum = -1;
-
-    s->fade_factors[0] = av_malloc(s->frame_len * sizeof(*s->fade_factors[0]));
-    s->fade_factors[1] = av_malloc(s->frame_len * sizeof(*s->fade_factors[1]));
-    s->weights = av_malloc(s->filter_size * sizeof(*s->weights));
-    if (!s->fade_factors[0] || !s->fade_factors[1] || !s->weights)
-        return AVERROR(ENOMEM);
-
-    s->gain_rms = cqueue_create(4); // 400 ms
-    if (!s->gain_rms)
-	return AVERROR(ENOMEM);
-
-    s->gain_min = cqueue_create(s->min_size);
-    if (!s->gain_min)
-	return AVERROR(ENOMEM);
-
-    s->gain_smooth = cqueue_create(s->filter_size);
-    if (!s->gain_smooth)
+    struct mydrc_params p = {
+	.thresh = s->thresh,
+	.ratio = s->ratio,
+	.knee = s->knee,
+	.filter_size = s->filter_size,
+	.min_size = s->min_size,
+	.hop = s->hop,
+	.mix = s->mix,
+	.qadrc = QADRC_PARAMS_DEFAULT,
+    };
+    p.qadrc.thresh = s->qthresh;
+    p.qadrc.ratio = s->qratio;
+    p.qadrc.knee = s->qknee;
+    p.qadrc.attack = s->attack;
+    p.qadrc.release = s->release;
+    p.qadrc.delay = s->delay;
+
+    mydrc_destroy(s->m);
+    s->m = mydrc_create(&p, inlink->sample_rate, inlink->channels,
+	    qadrc_fmt(inlink->format));
+    if (!s->m)
 	return AVERROR(ENOMEM);
-
-    precalculate_fade_factors(s->fade_factors, s->frame_len);
-    init_gaussian_filter(s);
-
-    return 0;
-}
-
-static inline double fade(double prev, double next, int pos,
-                          double *fade_factors[2])
-{
-    return fade_factors[0][pos] * prev + fade_factors[1][pos] * next;
-}
-
-static double rms_sum(MyDRCContext *s, float *data, int c, int ns)
-{
-    double sum = 0;
-    double x0 = s->hi_x[c];
-    double y0 = s->hi_y[c];
-
-    for (int i = 0; i < ns; i++) {
-	double x1 = data[i];
-	double y1 = s->hi_a * (y0 + x1 - x0);
-	sum += y1 * y1;
-	x0 = x1;
-	y0 = y1;
-    }
-
-    s->hi_x[c] = x0;
-    s->hi_y[c] = y0;
-
-    return sum;
-}
-
-static double get_frame_rms_sum(MyDRCContext *s, AVFrame *frame)
-{
-    int nc = av_frame_get_channels(frame);
-
-    if (!s->hi_once) {
-	for (int c = 0; c < nc; c++)
-	    s->hi_x[c] = s->hi_y[c] = *(float *) frame->extended_data[c];
-	s->hi_once = true;
-    }
-
-    double sum = 0;
-    for (int c = 0; c < nc; c++)
-	sum += rms_sum(s, frame->extended_data[c], c, frame->nb_samples);
-
-    if (frame->nb_samples == s->frame_len)
-	s->prev_rms_sum = sum;
-    else {
-	// resacle the last small frame
-	sum = sum * s->frame_len / frame->nb_samples;
-	// average with the previous frame
-	int missing = s->frame_len - frame->nb_samples;
-	av_assert0(missing > 0);
-	if (s->prev_rms_sum >= 0)
-	    sum = (frame->nb_samples * sum + missing * s->prev_rms_sum) / s->frame_len;
-    }
-    return sum;
-}
-
-static double rms_filter(cqueue *q, int frame_len)
-{
-    double sum = 0.0;
-    int qn = cqueue_size(q);
-    for (int i = 0; i < qn; i++)
-        sum += cqueue_peek(q, i);
-    double mean = FFMAX(sum / (qn * frame_len), DBL_EPSILON);
-    // 10*log10 instead of 20*log10 amounts for sqrt
-    return 10 * log10(mean);
-}
-
-static double min_filter(cqueue *q)
-{
-#if 0
-    return cqueue_peek(q, cqueue_size(q) / 2);
-#endif
-    double min = DBL_MAX;
-    int i;
-
-    for (i = 0; i < cqueue_size(q); i++) {
-        min = FFMIN(min, cqueue_peek(q, i));
+    mydrc_waveform(s->m, s->wf_fp);
+    mydrc_set_threads(s->m, execute, ctx, ff_filter_get_nb_threads(ctx));
+
+    if (s->gain_fp) {
+	bool ok = s->gain_mode == GAIN_WRITE ? mydrc_write_gains(s->m, s->gain_fp)
+					     : mydrc_read_gains(s->m, s->gain_fp);
+	if (!ok) {
+	    av_log(ctx, AV_LOG_ERROR, "%s: %s\n", s->gain_fname,
+		    s->gain_mode == GAIN_WRITE ? "write error" : "not a gain file for this sample rate");
+	    return AVERROR(EINVAL);
+	}
     }
 
-    return min;
-}
-
-static double smooth_filter(MyDRCContext *s, cqueue *q)
-{
-#if 0
-    return cqueue_peek(q, cqueue_size(q) / 2);
-#endif
-    double result = 0.0;
-    int i;
-
-    for (i = 0; i < cqueue_size(q); i++) {
-        result += cqueue_peek(q, i) * s->weights[i];
-    }
+    // the input frames can be of any size, the engine keeps its own frames
+    // of the hop; the ring is set up for the lookahead in frames of 1024
+    // samples, the common size
+    size_t frame_len = mydrc_frame_len(s->m);
+    av_log(ctx, AV_LOG_DEBUG, "frame len %zu\n", frame_len);
+    av_log(ctx, AV_LOG_VERBOSE, "latency up to %zu samples\n",
+	    (mydrc_lookahead(s->m) + 1) * frame_len);
 
-    return result;
+    return reserve_frames(s, (mydrc_lookahead(s->m) + 2) * frame_len / 1024 + 2);
 }
 
-static bool update_cqueue(cqueue *q, double val)
+// amplify the ready samples of the queued frames, and send out
+// the frames which are done
+static int amplify_frames(MyDRCContext *s, AVFilterLink *outlink)
 {
-    int qn = cqueue_size(q);
-    int filter_size = q->size;
-    // Normally, we just pop the oldest element and push the new one.
-    if (qn == filter_size) {
-	cqueue_pop(q);
-	cqueue_enqueue(q, val);
-	return true;
-    }
-
-    av_assert0(qn < filter_size);
-
-    // First-time push: pad with the preceding virtual elements,
-    // e.g. [0] and [1] for n=5, before adding the middle element [2].
-    //
-    // The even case (e.g. n=4) is special, and is designed to assist 400 ms
-    // RMS averaging.  When the 4th 100 ms element is queued, it should produce
-    // the second RMS element.  This requires one preceding virtual element.
-    //
-    //     100 ms input      [0]        [1]           [2]           [3]
-    //     queue          [0][0]  [0][0][1]  [2][0][1][2]  [3][0][1][2]
-    //     400 ms RMS      ^                 [0]           [1]
-    //                     |
-    //                     `- this will be mirrored with [2], see below
-    //
-    // This makes sense, because the RMS level of [0][1][2][3] should take
-    // its full effect at the end of the [1] input frame.
-    if (qn == 0) {
-	for (int i = 0; i < (filter_size - 1) / 2 + 1; i++)
-	    cqueue_enqueue(q, val);
-	return false;
+    int ret = 0;
+    size_t n = mydrc_ready(s->m);
+    while (n) {
+	AVFrame *f0 = FRAME(s, 0);
+	size_t m = FFMIN(n, f0->nb_samples - s->fpos);
+	mydrc_amplify(s->m, (float **) f0->extended_data, s->fpos, m);
+	n -= m;
+	s->fpos += m;
+	if (s->fpos < f0->nb_samples)
+	    break;
+	ret |= ff_filter_frame(outlink, f0);
+	s->fhead = (s->fhead + 1) & (s->frames_size - 1);
+	s->nframes--;
+	s->fpos = 0;
     }
-
-    // More elements until the queue is full.
-    cqueue_enqueue(q, val);
-    if (++qn < filter_size)
-	return false;
-
-    // The queue is full for the first time.
-    // Mirror elements, e.g. [4] and [3] into [0] and [1].
-    for (int i = 0; i < (filter_size - 1) / 2; i++)
-	*cqueue_peekp(q, i) = cqueue_peek(q, filter_size - i - 1);
-    return true;
-}
-
-static inline double dB_to_scale(double dB)
-{
-    return pow(10, 0.05 * dB);
-}
-
-static inline double scale_to_dB(double scale)
-{
-    return 20 * log10(scale);
+    return ret;
 }
 
-static double compute_gain(MyDRCContext *s, double x)
+// the frame is analyzed by frame_len samples at most; the ready samples,
+// which may be in this very frame, are amplified as they come
+static int filter_frame(AVFilterLink *inlink, AVFrame *in)
 {
-    s->slope = (1.0 - s->ratio) / s->ratio;
-    s->Tlo = s->thresh - s->knee / 2.0;
-    s->Thi = s->thresh + s->knee / 2.0;
-    s->knee_factor = s->slope / (s->knee * 2.0);
-
-    if (x < s->Tlo)
-        return 0.0;
-    else if (x > s->Thi)
-        return s->slope * (x - s->thresh);
-    else {
-        double delta = x - s->Tlo;
-        return delta * delta * s->knee_factor;
-    }
-}
+    AVFilterContext *ctx = inlink->dst;
+    MyDRCContext *s = ctx->priv;
+    AVFilterLink *outlink = ctx->outputs[0];
 
-static bool push_to_min(MyDRCContext *s, double gain_dB)
-{
-    bool ret = update_cqueue(s->gain_min, gain_dB);
-    if (ret) {
-	double min = min_filter(s->gain_min);
-	ret = update_cqueue(s->gain_smooth, min);
+    int ret = reserve_frames(s, s->nframes + 1);
+    if (ret < 0) {
+	av_frame_free(&in);
+	return ret;
     }
-    return ret;
-}
-
-static bool push_rms_sum(MyDRCContext *s, double sum)
-{
-    bool ret = update_cqueue(s->gain_rms, sum);
-    if (ret) {
-	double vol_dB = rms_filter(s->gain_rms, s->frame_len);
-	double gain_dB = compute_gain(s, vol_dB);
-	ret = push_to_min(s, gain_dB);
+    FRAME(s, s->nframes) = in;
+    s->nframes++;
+
+    // the frame can go out with its last chunk
+    float **data = (float **) in->extended_data;
+    size_t nb_samples = in->nb_samples;
+    size_t frame_len = mydrc_frame_len(s->m);
+    for (size_t off = 0; off < nb_samples; off += frame_len) {
+	size_t n = FFMIN(frame_len, nb_samples - off);
+	mydrc_analyze(s->m, data, off, n);
+	ret = amplify_frames(s, outlink);
+	if (ret < 0)
+	    return ret;
     }
-    return ret;
-}
-
-static bool analyze_frame(MyDRCContext *s, AVFrame *frame)
-{
-    const double rms_sum = get_frame_rms_sum(s, frame);
-    return push_rms_sum(s, rms_sum);
+    return 0;
 }
 
-static void amplify_frame_by_factor(MyDRCContext *s, AVFrame *frame,
-				    double current_amplification_factor)
+// the gain file must have a gain for each frame of the input
+static int check_gains(AVFilterContext *ctx, MyDRCContext *s)
 {
-    int nc = av_frame_get_channels(frame);
-    if (s->prev_amplification_factor == 0)
-	s->prev_amplification_factor = current_amplification_factor;
-
-    int cnt = 0;
-    int cnt_max = 0;
-    double sum = 0;
-    if (s->wf_fp) {
-	// apicker waveform uses 10 ms intervals
-	cnt_max = s->frame_len / 10;
-	// need a whole number of 10 ms intervals in a frame
-	av_assert0(cnt_max * 10 == s->frame_len);
-    }
-
-    for (int i = 0; i < frame->nb_samples; i++) {
-	double amplification_factor = fade(s->prev_amplification_factor,
-					   current_amplification_factor, i,
-					   s->fade_factors);
-	for (int c = 0; c < nc; c++) {
-            float *dst_ptr = (float *)frame->extended_data[c];
-            dst_ptr[i] *= amplification_factor;
-        }
-
-	if (s->wf_fp) {
-	    sum += amplification_factor;
-	    if (++cnt == cnt_max) {
-		unsigned char c = sum / cnt * 255 + 0.5;
-		putc_unlocked(c, s->wf_fp);
-		sum = 0;
-		cnt = 0;
-	    }
-	}
+    size_t frames, gains;
+    if (!s->gain_fp || mydrc_gains_match(s->m, &frames, &gains))
+	return 0;
+    if (s->gain_mode == GAIN_WRITE) {
+	av_log(ctx, AV_LOG_ERROR, "%s: write error\n", s->gain_fname);
+	return AVERROR(EIO);
     }
-
-    s->prev_amplification_factor = current_amplification_factor;
+    av_log(ctx, AV_LOG_WARNING, "%s: %zu gains for %zu frames, the file "
+	    "is not for this input\n", s->gain_fname, gains, frames);
+    return 0;
 }
 
-static void amplify_frame(MyDRCContext *s, AVFrame *frame)
+static int flush_buffer(AVFilterContext *ctx, MyDRCContext *s, AVFilterLink *outlink)
 {
-    double factor = dB_to_scale(smooth_filter(s, s->gain_smooth));
-    amplify_frame_by_factor(s, frame, factor);
+    mydrc_finish(s->m);
+    int ret = check_gains(ctx, s);
+    if (ret < 0)
+	return ret;
+    if (s->nframes == 0)
+	return 0;
+    return amplify_frames(s, outlink);
 }
 
-static int filter_frame(AVFilterLink *inlink, AVFrame *in)
+// The input frames are taken as they come, whatever their size; at the end,
+// the lookahead is flushed, and then the end goes out with its timestamp.
+static int activate(AVFilterContext *ctx)
 {
-    AVFilterContext *ctx = inlink->dst;
     MyDRCContext *s = ctx->priv;
-    AVFilterLink *outlink = inlink->dst->outputs[0];
-    int ret = 0;
-
-    bool ready = analyze_frame(s, in);
-    ff_bufqueue_add(ctx, &s->queue, in);
+    AVFilterLink *inlink = ctx->inputs[0];
+    AVFilterLink *outlink = ctx->outputs[0];
+    AVFrame *in;
+    int64_t pts;
+    int ret, status;
 
-    if (ready) {
-        AVFrame *out = ff_bufqueue_get(&s->queue);
-        amplify_frame(s, out);
-        ret = ff_filter_frame(outlink, out);
-    }
-    return ret;
-}
+    FF_FILTER_FORWARD_STATUS_BACK(outlink, inlink);
 
-static int flush_buffer(MyDRCContext *s, AVFilterLink *inlink,
-                        AVFilterLink *outlink)
-{
-    if (ff_bufqueue_peek(&s->queue, 0) == NULL)
-	return AVERROR_EOF;
-
-    // The idea is to apply the exact same mirroring technique as was used
-    // at the beginning.  Thus the result should be completely symmetrical,
-    // as if the audio were played backwards and then reversed.
-    int flush_state = s->flush_state++;
-    if (flush_state == 0) {
-	// Add one more element to rms filter.
-	// E.g. it was 6789 to be applied at the end of 7,
-	// now it has to be 7789 to applied at the end of 8.
-	double rms_sum = cqueue_peek(s->gain_rms, 1);
-	push_rms_sum(s, rms_sum);
-    }
-    else if (flush_state <= s->min_size / 2) {
-	// flush the min filter
-	if (flush_state == 1) {
-	    int alloc_size = FFMAX(s->min_size, s->filter_size) / 2;
-	    s->flush_buf = av_malloc(alloc_size * sizeof(double));
-	    if (!s->flush_buf)
-		return AVERROR(ENOMEM);
-	    // copy last filter elements, to be applied backwards
-	    int off = s->min_size / 2 + 1;
-	    for (int i = 0; i < s->min_size / 2; i++)
-		s->flush_buf[i] = cqueue_peek(s->gain_min, i + off);
-	}
-	int i = s->min_size / 2 - flush_state;
-	double gain_dB = s->flush_buf[i];
-	push_to_min(s, gain_dB);
-    }
-    else if (flush_state <= s->min_size / 2 + s->filter_size / 2) {
-	// flush the smoothing filter
-	if (flush_state == s->min_size / 2 + 1) {
-	    int off = s->filter_size / 2 + 1;
-	    for (int i = 0; i < s->filter_size / 2; i++)
-		s->flush_buf[i] = cqueue_peek(s->gain_smooth, i + off);
+    ret = ff_inlink_consume_frame(inlink, &in);
+    if (ret < 0)
+	return ret;
+    if (ret > 0) {
+	ret = ff_inlink_make_frame_writable(inlink, &in);
+	if (ret < 0) {
+	    av_frame_free(&in);
+	    return ret;
 	}
-	int i = s->min_size / 2 + s->filter_size / 2 - flush_state;
-	double to_smooth = s->flush_buf[i];
-	update_cqueue(s->gain_smooth, to_smooth);
+	ff_filter_set_ready(ctx, 100);
+	return filter_frame(inlink, in);
     }
-    else {
-	// This should be the last frame.  Much like the first frame sets
-	// prev_amplification_factor to its current_amplification_factor,
-	// the last frame uses constant amplification for its samples
-	// by simply not updating s->gain_smooth.
-	av_assert0(flush_state == 1 + s->min_size / 2 + s->filter_size / 2);
-    }
-
-    AVFrame *frame = ff_bufqueue_get(&s->queue);
-    amplify_frame(s, frame);
-    return ff_filter_frame(outlink, frame);
-}
-
-static int request_frame(AVFilterLink *outlink)
-{
-    AVFilterContext *ctx = outlink->src;
-    MyDRCContext *s = ctx->priv;
 
-    int ret = ff_request_frame(ctx->inputs[0]);
+    if (ff_inlink_acknowledge_status(inlink, &status, &pts)) {
+	ret = flush_buffer(ctx, s, outlink);
+	ff_outlink_set_status(outlink, status, pts);
+	return ret;
+    }
 
-    if (ret == AVERROR_EOF && !ctx->is_disabled)
-        ret = flush_buffer(s, ctx->inputs[0], outlink);
+    FF_FILTER_FORWARD_WANTED(outlink, inlink);
 
-    return ret;
+    return FFERROR_NOT_READY;
 }
 
 static av_cold void uninit(AVFilterContext *ctx)
 {
     MyDRCContext *s = ctx->priv;
 
-    av_freep(&s->fade_factors[0]);
-    av_freep(&s->fade_factors[1]);
-
-    cqueue_free(s->gain_rms);
-    cqueue_free(s->gain_min);
-    cqueue_free(s->gain_smooth);
-
-    av_freep(&s->weights);
-    av_freep(&s->flush_buf);
+    mydrc_destroy(s->m);
+    if (s->wf_fp)
+	fclose(s->wf_fp);
+    if (s->gain_fp && fclose(s->gain_fp) != 0 && s->gain_mode == GAIN_WRITE)
+	av_log(ctx, AV_LOG_ERROR, "%s: write error\n", s->gain_fname);
 
-    ff_bufqueue_discard_all(&s->queue);
+    for (size_t i = 0; i < s->nframes; i++)
+	av_frame_free(&FRAME(s, i));
+    av_freep(&s->frames);
 }
 
 static const AVFilterPad avfilter_af_mydrc_inputs[] = {
     {
         .name           = "default",
         .type           = AVMEDIA_TYPE_AUDIO,
-        .filter_frame   = filter_frame,
         .config_props   = config_input,
-        .needs_writable = 1,
     },
     { NULL }
 };
@@ -687,7 +420,6 @@ static const AVFilterPad avfilter_af_mydrc_outputs[] = {
     {
         .name          = "default",
         .type          = AVMEDIA_TYPE_AUDIO,
-        .request_frame = request_frame,
     },
     { NULL }
 };
@@ -699,7 +431,9 @@ AVFilter ff_af_mydrc = {
     .priv_size     = sizeof(MyDRCContext),
     .init          = init,
     .uninit        = uninit,
+    .activate      = activate,
     .inputs        = avfilter_af_mydrc_inputs,
     .outputs       = avfilter_af_mydrc_outputs,
     .priv_class    = &mydrc_class,
+    .flags         = AVFILTER_FLAG_SLICE_THREADS,
 };
@@ -10,12 +10,15 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include "libavutil/avassert.h"
 #include "libavutil/opt.h"
 #include "libavutil/channel_layout.h"
 #include "avfilter.h"
+#include "filters.h"
 #include "internal.h"
+#include "libqadrc.h"
 
 typedef struct QADRCContext {
     const AVClass *class;
@@ -27,275 +30,226 @@ typedef struct QADRCContext {
     double release;
     double delay;
     double gain0;
-
-    double slope;
-    double Tlo;
-    double Thi;
-    double knee_factor;
+    int precision;
+    int scan;
+    int envelope_step;
+    int unlinked;
+    int sidechain;
+
+    /* q analyzes the input, or the sidechain; qa applies the coefficients
+     * to the input, and is q itself unless there is a sidechain */
+    qadrc *q;
+    qadrc *qa;
     size_t delay_samples;
     size_t total_samples;
 
-    double alphaA;
-    double alphaR;
-
-    double yR;
-    double yA;
-
+    /* the frames held for the delay, a ring of frames_size slots */
     AVFrame **frames;
+    size_t frames_size;
+    size_t fhead;
     size_t nframes;
     size_t fpos;
+    size_t queued;
 
+    /* the coefficients, width per sample; with the sidechain, alen of them,
+     * starting at ahead, wait for the input to catch up */
     float *abuf;
-    float lasta;
+    size_t abuf_size;
+    size_t ahead;
+    size_t alen;
+    unsigned width;
+    /* with the sidechain, the status of the input once it ends,
+     * which is passed on when its frames are out */
+    int input_eof;
+    int64_t eof_pts;
+    int key_eof;
 
     const char *wf_fname;
+    FILE *wf_fp;
 } QADRCContext;
 
 #ifndef QADRC_WF
 #define QADRC_WF 0
 #endif
-#if QADRC_WF
-static FILE *wf_fp;
-#endif
 
-#if 1
-#include "simd_math_prims.h"
-static inline float dB_to_scale(float dB)
-{
-    return expapprox(2.302585093f*0.05f*dB);
-}
+/* the i-th queued frame */
+#define FRAME(s, i) ((s)->frames[((s)->fhead + (i)) & ((s)->frames_size - 1)])
 
-static inline float scale_to_dB(float x)
+/* The ring and abuf only grow, to the size that the stream needs, so that
+ * in the steady state there are no allocations.  The ring size is a power
+ * of two. */
+static int reserve_frames(QADRCContext *s, size_t n)
 {
-    if (x < 1e-6f)
-	return -120;
-    return 20.0f*0.4342944819f*logapprox(x);
+    if (n <= s->frames_size)
+	return 0;
+    size_t size = s->frames_size ? s->frames_size : 16;
+    while (size < n)
+	size *= 2;
+    AVFrame **frames = av_malloc_array(size, sizeof(AVFrame *));
+    if (!frames)
+	return AVERROR(ENOMEM);
+    for (size_t i = 0; i < s->nframes; i++)
+	frames[i] = FRAME(s, i);
+    av_free(s->frames);
+    s->frames = frames;
+    s->frames_size = size;
+    s->fhead = 0;
+    return 0;
 }
-#else
-static inline double dB_to_scale(double dB)
+
+/* make room for n more floats after the queued coefficients,
+ * which are moved to the front if need be */
+static int reserve_abuf(QADRCContext *s, size_t n)
 {
-    return pow(10, 0.05 * dB);
+    size_t queued = s->alen * s->width;
+    if (s->ahead * s->width + queued + n <= s->abuf_size)
+	return 0;
+    float *abuf = s->abuf;
+    if (queued + n > s->abuf_size) {
+	abuf = av_malloc_array(queued + n, sizeof(float));
+	if (!abuf)
+	    return AVERROR(ENOMEM);
+    }
+    if (queued)
+	memmove(abuf, s->abuf + s->ahead * s->width, queued * sizeof(float));
+    if (abuf != s->abuf) {
+	av_free(s->abuf);
+	s->abuf = abuf;
+	s->abuf_size = queued + n;
+    }
+    s->ahead = 0;
+    return 0;
 }
 
-static inline double scale_to_dB(double scale)
+/* the engine's jobs run on the slice threads */
+struct job {
+    qadrc_job_fn fn;
+    void *arg;
+};
+
+static int run_job(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
 {
-    return 20 * log10(scale);
+    struct job *job = arg;
+    job->fn(job->arg, jobnr, nb_jobs);
+    return 0;
 }
-#endif
 
-/*
- * gain computer, works on log domain
- */
-static double computeGain(QADRCContext *s, double x)
+static void execute(void *arg, qadrc_job_fn fn, void *fn_arg, unsigned nb_jobs)
 {
-    if (x < s->Tlo)
-	return 0.0;
-    else if (x > s->Thi)
-	return s->slope * (x - s->thresh);
-    else {
-	double delta = x - s->Tlo;
-	return delta * delta * s->knee_factor;
-    }
+    AVFilterContext *ctx = arg;
+    struct job job = { fn, fn_arg };
+    ctx->internal->execute(ctx, run_job, &job, NULL, nb_jobs);
 }
 
-/*
- * smooth, level corrected decoupled peak detector
- * works on log domain
- */
-static double smoothAverage(QADRCContext *s, double x)
+static struct qadrc_params params(const QADRCContext *s)
 {
-    const double eps = 1e-120;
-    s->yR = fmin(x, s->alphaR * s->yR + (1.0 - s->alphaR) * x + eps - eps);
-    s->yA = s->alphaA * s->yA + (1.0 - s->alphaA) * s->yR + eps - eps;
-    return s->yA;
+    return (struct qadrc_params) {
+	.thresh = s->thresh,
+	.ratio = s->ratio,
+	.knee = s->knee,
+	.attack = s->attack,
+	.release = s->release,
+	.delay = s->delay,
+	.gain0 = s->gain0,
+	.precision = s->precision,
+	.scan = s->scan,
+	.envelope_step = s->envelope_step,
+	.unlinked = s->unlinked,
+    };
 }
 
-static int config_input(AVFilterLink *inlink)
+static int config_output(AVFilterLink *outlink)
 {
-    AVFilterContext *ctx = inlink->dst;
+    AVFilterContext *ctx = outlink->src;
     QADRCContext *s = ctx->priv;
+    AVFilterLink *inlink = ctx->inputs[0];
+    AVFilterLink *keylink = ctx->inputs[s->sidechain ? 1 : 0];
 
-    s->slope = (1.0 - s->ratio) / s->ratio;
-    s->attack = s->attack / 1000.0;
-    s->release = s->release / 1000.0;
-    s->Tlo = s->thresh - s->knee / 2.0;
-    s->Thi = s->thresh + s->knee / 2.0;
-    s->knee_factor = s->slope / (s->knee * 2.0);
-    s->yR = s->gain0;
-    s->yA = s->gain0;
+    struct qadrc_params p = params(s);
+    int fmt = inlink->format == AV_SAMPLE_FMT_FLTP ? QADRC_FLTP : QADRC_FLT;
 
-    const double Fs = inlink->sample_rate;
-    s->delay_samples = s->delay * Fs / 1000;
-    av_log(ctx, AV_LOG_DEBUG, "delay samples = %zu\n", s->delay_samples);
-
-    s->alphaA = s->attack > 0.0 ? exp(-1.0 / (s->attack * Fs)) : 0.0;
-    s->alphaR = s->release > 0.0 ? exp(-1.0 / (s->release * Fs)) : 0.0;
-
-    return 0;
-}
+    if (s->qa != s->q)
+	qadrc_destroy(s->qa);
+    qadrc_destroy(s->q);
+    s->q = s->qa = qadrc_create(&p, keylink->sample_rate, keylink->channels, fmt);
+    if (!s->q)
+	return AVERROR(ENOMEM);
+    qadrc_set_threads(s->q, execute, ctx, ff_filter_get_nb_threads(ctx));
 
-/* process input samples and fill a[] coefficients */
-static void chew(QADRCContext *s, AVFrame *frame, int fmt, unsigned nc, float *a)
-{
-    float **data = (float **) frame->extended_data;
-    size_t nsamples = frame->nb_samples;
-    /* We need to calculate peak level (xL, max among channels) and turn it
-     * into dB (xG).  Unless the whole loop is vectorizable, the last step,
-     * xL -> xG conversion, will be executed in a separate pass. */
-    switch (fmt) {
-    case AV_SAMPLE_FMT_FLT  | 1 << 8:
-    case AV_SAMPLE_FMT_FLTP | 1 << 8:
-	for (size_t i = 0; i < nsamples; i++) {
-	    float xL = fabsf(data[0][i]);
-	    float xG = scale_to_dB(xL);
-	    a[i] = xG;
-	}
-	break;
-    case AV_SAMPLE_FMT_FLTP | 2 << 8:
-	for (size_t i = 0; i < nsamples; i++) {
-	    float xL = fabsf(data[0][i]);
-	    float xM = fabsf(data[1][i]);
-	    if (xM > xL)
-		xL = xM;
-	    float xG = scale_to_dB(xL);
-	    a[i] = xG;
-	}
-	break;
-    case AV_SAMPLE_FMT_FLTP:
-	for (size_t i = 0; i < nsamples; i++) {
-	    float xL = fabsf(data[0][i]);
-	    for (unsigned j = 1; j < nc; j++) {
-		float xM = fabsf(data[j][i]);
-		if (xM > xL)
-		    xL = xM;
-	    }
-	    a[i] = xL;
-	}
-	break;
-    case AV_SAMPLE_FMT_FLT | 2 << 8:
-	for (size_t j = 0; j < 2 * nsamples; j += 2) {
-	    float xL = fabsf(data[0][j+0]);
-	    float xM = fabsf(data[0][j+1]);
-	    if (xM > xL)
-		xL = xM;
-	    a[j/2] = xL;
-	}
-	break;
-    default:
-	av_assert0(fmt == AV_SAMPLE_FMT_FLT);
-	for (size_t i = 0, j = 0; i < nsamples; i++, j += nc) {
-	    float xL = fabsf(data[0][j]);
-	    for (unsigned k = 1; k < nc; k++) {
-		float xM = fabsf(data[0][j+k]);
-		if (xM > xL)
-		    xL = xM;
-	    }
-	    a[i] = xL;
-	}
-    }
+    s->delay_samples = qadrc_latency(s->q);
+    s->width = qadrc_width(s->q);
 
-    switch (fmt) {
-    case AV_SAMPLE_FMT_FLT  | 1 << 8:
-    case AV_SAMPLE_FMT_FLTP | 1 << 8:
-    case AV_SAMPLE_FMT_FLTP | 2 << 8:
-	break;
-    default:
-	for (size_t i = 0; i < nsamples; i++) {
-	    float xL = a[i];
-	    float xG = scale_to_dB(xL);
-	    a[i] = xG;
+    if (s->sidechain) {
+	/* A mono key drives all channels; an unlinked key drives
+	 * the channels one to one. */
+	if (s->width > 1 && s->width != inlink->channels) {
+	    av_log(ctx, AV_LOG_ERROR, "unlinked sidechain has %u channels, "
+		    "the input has %d\n", s->width, inlink->channels);
+	    return AVERROR(EINVAL);
 	}
+	/* no ring, the input is delayed by holding its frames */
+	p.delay = 0;
+	p.unlinked = s->width > 1;
+	s->qa = qadrc_create(&p, inlink->sample_rate, inlink->channels, fmt);
+	if (!s->qa)
+	    return AVERROR(ENOMEM);
+	qadrc_set_threads(s->qa, execute, ctx, ff_filter_get_nb_threads(ctx));
     }
+    /* the waveform is written as the gain is applied */
+    qadrc_waveform(s->qa, s->wf_fp);
+    av_log(ctx, AV_LOG_VERBOSE, "latency %zu samples\n", s->delay_samples);
 
-    /* As we apply downward compression to xG and smooth the result, we get cG,
-     * a coefficient (though in dB just yet) which will be applied to an earlier
-     * sample, because of the delay.  This part is not vectorizable. */
-    for (size_t i = 0; i < nsamples; ++i) {
-	double xG = a[i];
-	double yG = computeGain(s, xG);
-	double cG = smoothAverage(s, yG);
-	a[i] = cG;
-    }
+    /* enough for the delay in frames of 1024 samples, the common size */
+    int ret = reserve_frames(s, s->delay_samples / 1024 + 2);
+    if (ret < 0)
+	return ret;
+    return reserve_abuf(s, 1024 * s->width);
 }
 
-/* apply a[] coefficients to samples */
-static void apply1(float **data, size_t off, int fmt, unsigned nc, float *a, size_t n)
+/* apply a[] coefficients to the queued frames, from the first one on */
+static int apply_frames(QADRCContext *s, AVFilterLink *outlink,
+	float *a, size_t nsamples)
 {
-    /* We now have dB coefficients which we need to convert to linear domain,
-     * cG -> cL, and apply to the data.  Again, both steps are combined
-     * in a single loop if the whole loop is vectorizable. */
-    switch (fmt) {
-    case AV_SAMPLE_FMT_FLT  | 1 << 8:
-    case AV_SAMPLE_FMT_FLTP | 1 << 8:
-	for (size_t i = 0; i < n; i++) {
-	    float cG = a[i];
-	    float cL = dB_to_scale(cG);
-	    data[0][off+i] *= cL;
-	}
-	break;
-    case AV_SAMPLE_FMT_FLTP | 2 << 8:
-	for (size_t i = 0; i < n; i++) {
-	    float cG = a[i];
-	    float cL = dB_to_scale(cG);
-	    data[0][off+i] *= cL;
-	    data[1][off+i] *= cL;
-#if QADRC_WF
-	    if (wf_fp) {
-		static int cnt;
-		static double sum;
-		sum += cL;
-		if (++cnt == 480) {
-		    unsigned char c = sum / cnt * 255 + 0.5;
-		    putc_unlocked(c, wf_fp);
-		    sum = 0;
-		    cnt = 0;
-		}
-	    }
-#endif
-	}
-	break;
-    default:
-	for (size_t i = 0; i < n; i++) {
-	    float cG = a[i];
-	    float cL = dB_to_scale(cG);
-	    a[i] = cL;
-	}
-    }
+    s->queued -= nsamples;
 
-    switch (fmt) {
-    case AV_SAMPLE_FMT_FLT  | 1 << 8:
-    case AV_SAMPLE_FMT_FLTP | 1 << 8:
-    case AV_SAMPLE_FMT_FLTP | 2 << 8:
-	break;
-    case AV_SAMPLE_FMT_FLTP:
-	for (size_t i = 0; i < n; i++) {
-	    float cL = a[i];
-	    for (unsigned j = 0; j < nc; j++)
-	        data[j][off+i] *= cL;
-	}
-	break;
-    case AV_SAMPLE_FMT_FLT | 2 << 8:
-	off *= 2;
-	for (size_t j = 0; j < 2 * n; j += 2) {
-	    float cL = a[j/2];
-	    data[0][off+j+0] *= cL;
-	    data[0][off+j+1] *= cL;
-	}
-	break;
-    default:
-	av_assert0(fmt == AV_SAMPLE_FMT_FLT);
-	off *= nc;
-	for (size_t i = 0, j = 0; i < n; i++, j += nc) {
-	    float cL = a[i];
-	    for (unsigned k = 1; k < nc; k++)
-		data[0][off+j+k] *= cL;
+    int ret = 0;
+    while (1) {
+	AVFrame *f0 = FRAME(s, 0);
+	size_t f0samples = f0->nb_samples - s->fpos;
+	size_t apply_samples = FFMIN(nsamples, f0samples);
+	/* The frame may be shared, e.g. behind asplit; it is only copied
+	 * if some of the coefficients are not unity gain. */
+	if (!qadrc_unity(s->qa, a, apply_samples)) {
+	    int err = av_frame_make_writable(f0);
+	    if (err < 0)
+		return err;
+	    float **data0 = (float **) f0->extended_data;
+	    qadrc_apply(s->qa, data0, s->fpos, a, apply_samples);
 	}
+	if (f0samples > nsamples) {
+	    /* all a[] coefficients applied, frame incomplete */
+	    s->fpos += nsamples;
+	    break;
+        }
+	/* flush the frame */
+	ret |= ff_filter_frame(outlink, f0);
+	s->fhead = (s->fhead + 1) & (s->frames_size - 1);
+	s->nframes--;
+	s->fpos = 0;
+	/* another iteration? */
+	nsamples -= apply_samples;
+	if (nsamples == 0)
+	    break;
+	av_assert0(s->nframes > 0);
+	a += apply_samples * s->width;
     }
+
+    return ret;
 }
 
 /* apply a[] coefficients to the delayed samples */
 static int apply(QADRCContext *s, AVFilterLink *outlink,
-	int fmt, unsigned nc, float *a, size_t nsamples)
+	float *a, size_t nsamples)
 {
     if (s->total_samples >= s->delay_samples)
 	s->total_samples += nsamples;
@@ -308,35 +262,39 @@ static int apply(QADRCContext *s, AVFilterLink *outlink,
 	if (s->total_samples <= s->delay_samples)
 	    return 0;
 	av_assert0(off < nsamples);
-	a += off;
+	a += off * s->width;
 	nsamples -= off;
     }
 
-    int ret = 0;
-    while (1) {
-	AVFrame *f0 = s->frames[0];
-	size_t f0samples = f0->nb_samples - s->fpos;
-	size_t apply_samples = FFMIN(nsamples, f0samples);
-	float **data0 = (float **) f0->extended_data;
-	apply1(data0, s->fpos, fmt, nc, a, apply_samples);
-	if (f0samples > nsamples) {
-	    /* all a[] coefficients applied, frame incomplete */
-	    s->fpos += nsamples;
-	    break;
-        }
-	/* flush the frame */
-	ret |= ff_filter_frame(outlink, f0);
-	s->nframes--;
-	memmove(s->frames, s->frames + 1, s->nframes * sizeof(AVFrame *));
-	s->fpos = 0;
-	/* another iteration? */
-	nsamples -= apply_samples;
-	if (nsamples == 0)
-	    break;
-	av_assert0(s->nframes > 0);
-	a += apply_samples;
-    }
+    return apply_frames(s, outlink, a, nsamples);
+}
+
+/* with the sidechain, apply the coefficients that the input has caught up with */
+static int drain(QADRCContext *s, AVFilterLink *outlink)
+{
+    size_t n = FFMIN(s->alen, s->queued);
+    if (n == 0)
+	return 0;
+    float *a = s->abuf + s->ahead * s->width;
+    s->alen -= n;
+    s->ahead = s->alen ? s->ahead + n : 0;
+    return apply_frames(s, outlink, a, n);
+}
 
+static int final_flush(AVFilterContext *ctx, QADRCContext *s)
+{
+    AVFilterLink *outlink = ctx->outputs[0];
+
+    size_t nsamples = s->abuf_size / s->width;
+    float *a = s->abuf;
+
+    int ret = 0;
+    do {
+	/* qadrc_apply() clobbers a[] */
+	qadrc_fill_lasta(s->q, a, nsamples);
+	size_t f0samples = FRAME(s, 0)->nb_samples - s->fpos;
+	ret |= apply_frames(s, outlink, a, FFMIN(nsamples, f0samples));
+    } while (s->nframes);
     return ret;
 }
 
@@ -347,65 +305,195 @@ static int filter_frame(AVFilterLink *inlink, AVFrame *frame)
     AVFilterLink *outlink = ctx->outputs[0];
 
     size_t nsamples = frame->nb_samples;
-    unsigned nc = inlink->channels;
 
-    float *a = s->abuf = av_realloc_f(s->abuf, nsamples, sizeof(float));
-    int fmt = outlink->format | (nc <= 2 ? nc << 8 : 0);
+    int ret = s->sidechain ? 0 : reserve_abuf(s, nsamples * s->width);
+    if (ret >= 0 && s->delay_samples == 0 && !s->sidechain) {
+	/* no delay, no queue: the frame goes out as soon as it is processed */
+	float *a = s->abuf;
+	qadrc_chew(s->q, (float **) frame->extended_data, 0, nsamples, a);
+	if (!qadrc_unity(s->q, a, nsamples)) {
+	    ret = av_frame_make_writable(frame);
+	    if (ret >= 0)
+		qadrc_apply(s->q, (float **) frame->extended_data, 0, a, nsamples);
+	}
+	if (ret >= 0)
+	    return ff_filter_frame(outlink, frame);
+    }
+    if (ret >= 0)
+	ret = reserve_frames(s, s->nframes + 1);
+    if (ret < 0) {
+	av_frame_free(&frame);
+	return ret;
+    }
 
-    chew(s, frame, fmt, nc, a);
-    s->lasta = a[nsamples - 1];
+    FRAME(s, s->nframes) = frame;
+    s->nframes++;
+    s->queued += nsamples;
 
-    s->frames = av_realloc_f(s->frames, s->nframes + 1, sizeof(AVFrame *));
-    s->frames[s->nframes++] = frame;
+    if (s->sidechain) {
+	ret = drain(s, outlink);
+	/* past the end of the key, the rest gets the last gain */
+	if (s->key_eof && s->nframes)
+	    ret |= final_flush(ctx, s);
+	return ret;
+    }
+
+    float *a = s->abuf;
+    qadrc_chew(s->q, (float **) frame->extended_data, 0, nsamples, a);
 
-    return apply(s, outlink, fmt, nc, a, nsamples);
+    return apply(s, outlink, a, nsamples);
 }
 
-static int final_flush(AVFilterLink *inlink, AVFilterContext *ctx, QADRCContext *s)
+/* the key frames are only analyzed, and their coefficients queued */
+static int filter_key(AVFilterLink *inlink, AVFrame *frame)
 {
-    AVFilterLink *outlink = ctx->outputs[0];
-    unsigned nc = inlink->channels;
+    AVFilterContext *ctx = inlink->dst;
+    QADRCContext *s = ctx->priv;
 
-    size_t nsamples = 1024;
-    float *a = s->abuf = av_realloc_f(s->abuf, nsamples, sizeof(float));
-    int fmt = outlink->format | (nc <= 2 ? nc << 8 : 0);
+    size_t nsamples = frame->nb_samples;
 
-    for (size_t i = 0; i < nsamples; i++)
-	a[i] = s->lasta;
+    int ret = reserve_abuf(s, nsamples * s->width);
+    if (ret < 0) {
+	av_frame_free(&frame);
+	return ret;
+    }
 
-    int ret = 0;
-    do {
-	size_t f0samples = s->frames[0]->nb_samples - s->fpos;
-	ret |= apply(s, outlink, fmt, nc, a, FFMIN(nsamples, f0samples));
-    } while (s->nframes);
-    return ret;
+    float *a = s->abuf + (s->ahead + s->alen) * s->width;
+    qadrc_chew(s->q, (float **) frame->extended_data, 0, nsamples, a);
+    av_frame_free(&frame);
+    s->alen += nsamples;
+
+    /* throw away the coefficients for "pre-input", as apply() does */
+    if (s->total_samples < s->delay_samples) {
+	size_t off = FFMIN(s->delay_samples - s->total_samples, nsamples);
+	s->ahead += off;
+	s->alen -= off;
+    }
+    s->total_samples += nsamples;
+
+    return drain(s, ctx->outputs[0]);
 }
 
-static int request_frame(AVFilterLink *outlink)
+/* Take the input while it has no samples waiting for the coefficients,
+ * then the key until they get them; so neither queue grows by more than
+ * a frame over the delay.  Past the end of the key, the rest of the input
+ * gets the last gain; past the end of the input, the key is dropped. */
+static int activate_sidechain(AVFilterContext *ctx, QADRCContext *s)
+{
+    AVFilterLink *inlink = ctx->inputs[0];
+    AVFilterLink *keylink = ctx->inputs[1];
+    AVFilterLink *outlink = ctx->outputs[0];
+    AVFrame *frame;
+    int64_t pts;
+    int ret, status;
+
+    if (!s->input_eof && (s->key_eof || s->queued <= s->alen)) {
+	ret = ff_inlink_consume_frame(inlink, &frame);
+	if (ret < 0)
+	    return ret;
+	if (ret > 0) {
+	    ff_filter_set_ready(ctx, 100);
+	    return filter_frame(inlink, frame);
+	}
+	if (!ff_inlink_acknowledge_status(inlink, &status, &pts)) {
+	    FF_FILTER_FORWARD_WANTED(outlink, inlink);
+	    return FFERROR_NOT_READY;
+	}
+	s->input_eof = status;
+	s->eof_pts = pts;
+    }
+
+    if (s->queued && !s->key_eof) {
+	ret = ff_inlink_consume_frame(keylink, &frame);
+	if (ret < 0)
+	    return ret;
+	if (ret > 0) {
+	    ff_filter_set_ready(ctx, 100);
+	    return filter_key(keylink, frame);
+	}
+	if (!ff_inlink_acknowledge_status(keylink, &status, &pts)) {
+	    FF_FILTER_FORWARD_WANTED(outlink, keylink);
+	    return FFERROR_NOT_READY;
+	}
+	s->key_eof = 1;
+	ff_filter_set_ready(ctx, 100);
+	return final_flush(ctx, s);
+    }
+
+    if (s->input_eof) {
+	ff_inlink_set_status(keylink, AVERROR_EOF);
+	ff_outlink_set_status(outlink, s->input_eof, s->eof_pts);
+	return 0;
+    }
+    return FFERROR_NOT_READY;
+}
+
+/* The frames are taken as they come; at the end of the input, the queued
+ * ones go out with the last gain, and then the end with its timestamp. */
+static int activate(AVFilterContext *ctx)
 {
-    AVFilterContext *ctx = outlink->src;
     QADRCContext *s = ctx->priv;
+    AVFilterLink *inlink = ctx->inputs[0];
+    AVFilterLink *outlink = ctx->outputs[0];
+    AVFrame *frame;
+    int64_t pts;
+    int ret, status;
 
-    int ret = ff_request_frame(ctx->inputs[0]);
-    if (ret == AVERROR_EOF && !ctx->is_disabled && s->nframes)
-	ret = final_flush(outlink, ctx, s);
+    FF_FILTER_FORWARD_STATUS_BACK_ALL(outlink, ctx);
 
-    return ret;
+    if (s->sidechain)
+	return activate_sidechain(ctx, s);
+
+    ret = ff_inlink_consume_frame(inlink, &frame);
+    if (ret < 0)
+	return ret;
+    if (ret > 0) {
+	ff_filter_set_ready(ctx, 100);
+	return filter_frame(inlink, frame);
+    }
+
+    if (ff_inlink_acknowledge_status(inlink, &status, &pts)) {
+	ret = s->nframes ? final_flush(ctx, s) : 0;
+	ff_outlink_set_status(outlink, status, pts);
+	return ret;
+    }
+
+    FF_FILTER_FORWARD_WANTED(outlink, inlink);
+
+    return FFERROR_NOT_READY;
 }
 
+static const AVFilterPad inputs[] = {
+    {
+	.name	   = "default",
+	.type	   = AVMEDIA_TYPE_AUDIO,
+    },
+    {
+	.name	   = "sidechain",
+	.type	   = AVMEDIA_TYPE_AUDIO,
+    },
+};
+
 static av_cold int init(AVFilterContext *ctx)
 {
     QADRCContext *s = ctx->priv;
 
+    for (unsigned i = 0; i < (s->sidechain ? 2 : 1); i++) {
+	AVFilterPad pad = inputs[i];
+	int ret = ff_insert_inpad(ctx, i, &pad);
+	if (ret < 0)
+	    return ret;
+    }
+
     if (s->wf_fname) {
 #if QADRC_WF
-	wf_fp = fopen(s->wf_fname, "w");
-	if (!wf_fp) {
+	s->wf_fp = fopen(s->wf_fname, "w");
+	if (!s->wf_fp) {
 	    av_log(ctx, AV_LOG_ERROR, "cannot open %s\n", s->wf_fname);
 	    return AVERROR(EINVAL);
 	}
-	fwrite("WF1", 4, 1, wf_fp);
-	fwrite("\0\0\0", 4, 1, wf_fp);
+	fwrite("WF1", 4, 1, s->wf_fp);
+	fwrite("\0\0\0", 4, 1, s->wf_fp);
 #else
 	av_log(ctx, AV_LOG_WARNING, "waveform not enabled\n");
 #endif
@@ -417,10 +505,39 @@ static av_cold int init(AVFilterContext *ctx)
 static av_cold void uninit(AVFilterContext *ctx)
 {
     QADRCContext *s = ctx->priv;
-    for (int i = 0; i < s->nframes; i++)
-	av_frame_free(&s->frames[i]);
+    for (size_t i = 0; i < s->nframes; i++)
+	av_frame_free(&FRAME(s, i));
     av_freep(&s->frames);
     av_freep(&s->abuf);
+    if (s->qa != s->q)
+	qadrc_destroy(s->qa);
+    qadrc_destroy(s->q);
+    if (s->wf_fp)
+	fclose(s->wf_fp);
+}
+
+/* The parameters of the gain computer and the smoother can be changed
+ * on the fly; the engine picks them up with the next frame. */
+static int process_command(AVFilterContext *ctx, const char *cmd, const char *args,
+	char *res, int res_len, int flags)
+{
+    QADRCContext *s = ctx->priv;
+
+    static const char *const live[] = { "thresh", "ratio", "knee", "attack", "release" };
+    size_t i = 0;
+    while (i < FF_ARRAY_ELEMS(live) && strcmp(cmd, live[i]))
+	i++;
+    if (i == FF_ARRAY_ELEMS(live))
+	return AVERROR(ENOSYS);
+
+    int ret = av_opt_set(s, cmd, args, 0);
+    if (ret < 0)
+	return ret;
+    if (s->q) {
+	const struct qadrc_params p = params(s);
+	qadrc_update(s->q, &p);
+    }
+    return 0;
 }
 
 static int query_formats(AVFilterContext *ctx)
@@ -440,7 +557,21 @@ static int query_formats(AVFilterContext *ctx)
     ret = ff_set_common_formats(ctx, formats);
     if (ret < 0)
 	return ret;
-    ret = ff_set_common_channel_layouts(ctx, layouts);
+    if (ctx->nb_inputs > 1) {
+	/* the input and the output share the layout, the key has its own */
+	ret = ff_channel_layouts_ref(layouts, &ctx->inputs[0]->out_channel_layouts);
+	if (ret < 0)
+	    return ret;
+	ret = ff_channel_layouts_ref(layouts, &ctx->outputs[0]->in_channel_layouts);
+	if (ret < 0)
+	    return ret;
+	layouts = ff_all_channel_layouts();
+	if (!layouts)
+	    return AVERROR(ENOMEM);
+	ret = ff_channel_layouts_ref(layouts, &ctx->inputs[1]->out_channel_layouts);
+    }
+    else
+	ret = ff_set_common_channel_layouts(ctx, layouts);
     if (ret < 0)
 	return ret;
     return ff_set_common_samplerates(ctx, ff_all_samplerates());
@@ -456,28 +587,25 @@ static const AVOption qadrc_options[] = {
     { "release", "release time", OFFSET(release), AV_OPT_TYPE_DOUBLE, {.dbl = 800}, 0, 9000, FLAGS },
     { "delay", "delay (lookahead) time", OFFSET(delay), AV_OPT_TYPE_DOUBLE, {.dbl = 10}, 0, 1000, FLAGS },
     { "gain0", "initial gain", OFFSET(gain0), AV_OPT_TYPE_DOUBLE, {.dbl = -3}, -20, 0, FLAGS },
+    { "precision", "precision of dB conversions", OFFSET(precision), AV_OPT_TYPE_INT, {.i64 = QADRC_PRECISION_BALANCED}, 0, 2, FLAGS, "precision" },
+    {   "balanced", "approximations, 0.0001 dB", 0, AV_OPT_TYPE_CONST, {.i64 = QADRC_PRECISION_BALANCED}, 0, 0, FLAGS, "precision" },
+    {   "fast", "lower-order approximations, 0.003 dB", 0, AV_OPT_TYPE_CONST, {.i64 = QADRC_PRECISION_FAST}, 0, 0, FLAGS, "precision" },
+    {   "exact", "libm, no vector kernels", 0, AV_OPT_TYPE_CONST, {.i64 = QADRC_PRECISION_EXACT}, 0, 0, FLAGS, "precision" },
+    { "scan", "smoothing as parallel scans", OFFSET(scan), AV_OPT_TYPE_BOOL, {.i64 = 0}, 0, 1, FLAGS },
+    { "envelope_step", "smooth the gain every so many samples", OFFSET(envelope_step), AV_OPT_TYPE_INT, {.i64 = 0}, 0, 1024, FLAGS },
+    { "unlinked", "a detector and a gain per channel", OFFSET(unlinked), AV_OPT_TYPE_BOOL, {.i64 = 0}, 0, 1, FLAGS },
+    { "sidechain", "analyze the second input, compress the first", OFFSET(sidechain), AV_OPT_TYPE_BOOL, {.i64 = 0}, 0, 1, FLAGS },
     { "wf", "write a waveform file", OFFSET(wf_fname), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, FLAGS },
     { NULL }
 };
 
 AVFILTER_DEFINE_CLASS(qadrc);
 
-static const AVFilterPad inputs[] = {
-    {
-	.name	   = "default",
-	.type	   = AVMEDIA_TYPE_AUDIO,
-	.filter_frame   = filter_frame,
-	.config_props   = config_input,
-	.needs_writable = 1,
-    },
-    { NULL }
-};
-
 static const AVFilterPad outputs[] = {
     {
 	.name = "default",
 	.type = AVMEDIA_TYPE_AUDIO,
-	.request_frame = request_frame,
+	.config_props = config_output,
     },
     { NULL }
 };
@@ -488,8 +616,11 @@ AVFilter ff_af_qadrc = {
     .init          = init,
     .uninit        = uninit,
     .query_formats = query_formats,
-    .inputs	= inputs,
+    .activate      = activate,
+    .inputs	= NULL,
     .outputs       = outputs,
     .priv_size     = sizeof(QADRCContext),
     .priv_class    = &qadrc_class,
+    .process_command = process_command,
+    .flags         = AVFILTER_FLAG_DYNAMIC_INPUTS | AVFILTER_FLAG_SLICE_THREADS,
 };
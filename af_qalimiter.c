@@ -18,278 +18,148 @@
 #include <math.h>
 #include "libavutil/channel_layout.h"
 #include "libavutil/avassert.h"
+#include "libavutil/opt.h"
 #include "avfilter.h"
 #include "audio.h"
+#include "filters.h"
 #include "internal.h"
+#include "libqadrc.h"
 
-#define m_thresh 0.8912509f /* -1 dBFS */
+typedef struct QALimiterContext {
+    const AVClass *class;
+    double max_latency;
+    double gain;
+    int out_fmt;
+    qalimiter *l;
+} QALimiterContext;
+
+#define OFFSET(x) offsetof(QALimiterContext, x)
+#define FLAGS AV_OPT_FLAG_AUDIO_PARAM|AV_OPT_FLAG_FILTERING_PARAM
 
-/* fix a single spike between frames[fi1][f1_pos] and frames[fi2][f2_end] */
-static void fix_spike1(AVFilterLink *inlink, AVFrame **frames, int ch,
-	int fi1, size_t f1_pos, int fi2, size_t f2_end, float peak)
+static const AVOption qalimiter_options[] = {
+    { "max_latency", "cut the channels which do not cross zero for so long, ms", OFFSET(max_latency), AV_OPT_TYPE_DOUBLE, {.dbl = 0}, 0, 60000, FLAGS },
+    { "gain", "apply the gain before limiting, dB", OFFSET(gain), AV_OPT_TYPE_DOUBLE, {.dbl = 0}, -60, 60, FLAGS },
+    { "out_fmt", "set the output sample format", OFFSET(out_fmt), AV_OPT_TYPE_INT, {.i64 = 0}, 0, 32, FLAGS, "out_fmt" },
+    {   "float", "same as the input", 0, AV_OPT_TYPE_CONST, {.i64 = 0}, 0, 0, FLAGS, "out_fmt" },
+    {   "s16", "16-bit, with dither", 0, AV_OPT_TYPE_CONST, {.i64 = 16}, 0, 0, FLAGS, "out_fmt" },
+    {   "s32", "32-bit, with dither", 0, AV_OPT_TYPE_CONST, {.i64 = 32}, 0, 0, FLAGS, "out_fmt" },
+    { NULL }
+};
+
+AVFILTER_DEFINE_CLASS(qalimiter);
+
+/* make a frame writable before a spike is fixed */
+static float *const *make_writable(void *arg, void **opaque)
 {
-    float xpeak = peak;
-    peak = fabsf(peak);
-
-    for (int fi = fi1; fi <= fi2; fi++) {
-	AVFrame *frame = frames[fi];
-	if (!av_frame_is_writable(frame)) {
-	    AVFrame *copy = ff_get_audio_buffer(inlink, frame->nb_samples);
-	    av_frame_copy_props(copy, frame);
-	    av_frame_copy(copy, frame);
-	    av_frame_free(&frame);
-	    frame = frames[fi] = copy;
-        }
-
-	size_t begin = (fi == fi1) ? f1_pos : 0;
-	size_t end = (fi == fi2) ? f2_end : frame->nb_samples;
-	float *x = (float *) frame->extended_data[ch];
-
-	if (peak < m_thresh * 2.0) {
-	    float a = (peak - m_thresh) / (peak * peak);
-	    if (xpeak > 0) a = -a;
-	    for (size_t i = begin; i < end; ++i)
-		x[i] = x[i] + a * x[i] * x[i];
-	}
-	else {
-	    float u = peak, v = m_thresh;
-	    float a = (u - 2 * v) / (u * u * u);
-	    float b = (3 * v - 2 * u) / (u * u);
-	    if (xpeak < 0) b = -b;
-	    for (size_t i = begin; i < end; ++i)
-		x[i] = x[i] + b * x[i] * x[i] + a * x[i] * x[i] * x[i];
-	}
+    AVFilterLink *inlink = arg;
+    AVFrame *frame = *opaque;
+    if (!av_frame_is_writable(frame)) {
+	AVFrame *copy = ff_get_audio_buffer(inlink, frame->nb_samples);
+	if (!copy)
+	    return NULL;
+	av_frame_copy_props(copy, frame);
+	av_frame_copy(copy, frame);
+	av_frame_free(&frame);
+	frame = *opaque = copy;
     }
+    return (float *const *) frame->extended_data;
 }
 
-/* search for a peak (any value above the threshold) */
-static void find_peak(AVFrame **frames, int ch,
-	int fi1, size_t f1_pos, int fi2, size_t f2_end,
-	int *peak_fi, size_t *peak_pos, float *peak_val)
+/* the libqadrc layout of the sample format */
+static int qadrc_fmt(enum AVSampleFormat format)
 {
-    for (int fi = fi1; fi <= fi2; fi++) {
-	AVFrame *frame = frames[fi];
-
-	size_t begin = (fi == fi1) ? f1_pos : 0;
-	size_t end = (fi == fi2) ? f2_end : frame->nb_samples;
-	float *x = (float *) frame->extended_data[ch];
-
-	size_t i;
-	for (i = begin; i < end; i++)
-	    if (x[i] > m_thresh || x[i] < -m_thresh)
-		break;
-	if (i == end)
-	    continue;
-
-	/* found a peak */
-	*peak_fi = fi;
-	*peak_pos = i;
-	*peak_val = x[i];
-	return;
+    switch (format) {
+    case AV_SAMPLE_FMT_FLT: return QADRC_FLT;
+    case AV_SAMPLE_FMT_DBL: return QADRC_DBL;
+    case AV_SAMPLE_FMT_DBLP: return QADRC_DBLP;
+    case AV_SAMPLE_FMT_S16: return QADRC_S16;
+    case AV_SAMPLE_FMT_S16P: return QADRC_S16P;
+    case AV_SAMPLE_FMT_S32: return QADRC_S32;
+    case AV_SAMPLE_FMT_S32P: return QADRC_S32P;
+    default: return QADRC_FLTP;
     }
 }
 
-/* when a peak is found, search backwards where the spike starts */
-static void find_spike_start(AVFrame **frames, int ch,
-	int peak_fi, size_t peak_pos,
-	int *start_fi, size_t *start_pos,
-	float peak_val)
+/* the engine's jobs run on the slice threads */
+struct job {
+    qadrc_job_fn fn;
+    void *arg;
+};
+
+static int run_job(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
 {
-    for (int fi = peak_fi; fi >= 0; fi--) {
-	AVFrame *frame = frames[fi];
-
-	ssize_t pos = (fi == peak_fi) ? peak_pos : frame->nb_samples;
-	float *x = (float *) frame->extended_data[ch];
-
-	if (peak_val < 0) {
-	    if (x[0] < 0)
-		do
-		    pos--;
-		while (pos >= 0 && x[pos] < 0);
-	    else
-		do
-		    pos--;
-		while (x[pos] < 0);
-	}
-	else {
-	    if (x[0] > 0)
-		do
-		    pos--;
-		while (pos >= 0 && x[pos] > 0);
-	    else
-		do
-		    pos--;
-		while (x[pos] > 0);
-	}
-	if (pos < 0)
-	    continue;
-	/* found an intersection with the x-axis */
-	pos++;
-	if (pos < frames[fi]->nb_samples) {
-	    *start_fi = fi;
-	    *start_pos = pos;
-	}
-	else {
-	    av_assert0(pos == frames[fi]->nb_samples);
-	    av_assert0(fi < peak_fi);
-	    *start_fi = fi + 1;
-	    *start_pos = 0;
-	}
-	return;
-    }
-    /* assume the leftmost */
-    *start_fi = 0;
-    *start_pos = 0;
+    struct job *job = arg;
+    job->fn(job->arg, jobnr, nb_jobs);
+    return 0;
 }
 
-/* search for the end of the spike and update the peak value */
-static void find_spike_end(AVFrame **frames, int ch,
-	int peak_fi, size_t peak_pos, int fi2,
-	int *end_fi, size_t *end_end,
-	float *peak_val)
+static void execute(void *arg, qadrc_job_fn fn, void *fn_arg, unsigned nb_jobs)
 {
-    for (int fi = peak_fi; fi <= fi2; fi++) {
-	AVFrame *frame = frames[fi];
-
-	size_t pos = (fi == peak_fi) ? peak_pos + 1 : 0;
-	size_t end = frame->nb_samples;
-	float *x = (float *) frame->extended_data[ch];
-
-	float p = *peak_val;
-	if (p < 0) {
-	    /* the spike is below the x-axis */
-	    if (x[end-1] < 0) {
-		for (; pos < end && x[pos] < 0; pos++)
-		    if (p > x[pos])
-			p = x[pos];
-	    }
-	    else {
-		for (; x[pos] < 0; pos++)
-		    if (p > x[pos])
-			p = x[pos];
-	    }
-	}
-	else {
-	    /* the spike is above the x-axis */
-	    if (x[end-1] > 0) {
-		for (; pos < end && x[pos] > 0; pos++)
-		    if (p < x[pos])
-			p = x[pos];
-	    }
-	    else {
-		for (; x[pos] > 0; pos++)
-		    if (p < x[pos])
-			p = x[pos];
-	    }
-	}
-	*peak_val = p;
-
-	if (pos == end)
-	    continue;
-	/* found an intersection with the x-axis */
-	*end_fi = fi;
-	*end_end = pos;
-	return;
-    }
-    /* assume the rightmost */
-    *end_fi = fi2;
-    *end_end = frames[fi2]->nb_samples;
+    AVFilterContext *ctx = arg;
+    struct job job = { fn, fn_arg };
+    ctx->internal->execute(ctx, run_job, &job, NULL, nb_jobs);
 }
 
-static void fix_spikes(AVFilterLink *inlink, AVFrame **frames, int ch,
-	int fi1, size_t f1_pos, int fi2, size_t f2_end)
+static int config_input(AVFilterLink *inlink)
 {
-    while (1) {
-	/* find a peak */
-	int peak_fi;
-	size_t peak_pos;
-	float peak_val = 0;
-	find_peak(frames, ch, fi1, f1_pos, fi2, f2_end,
-		&peak_fi, &peak_pos, &peak_val);
-	if (peak_val == 0)
-	    return;
-
-	/* find the start of the spike */
-	int start_fi;
-	size_t start_pos;
-	find_spike_start(frames, ch, peak_fi, peak_pos,
-		&start_fi, &start_pos, peak_val);
-	av_assert0(start_fi > fi1 || (start_fi == fi1 && start_pos >= f1_pos));
-
-	/* find the end of the spike and uptdate the peak value */
-	int end_fi;
-	size_t end_end;
-	find_spike_end(frames, ch, peak_fi, peak_pos, fi2,
-		&end_fi, &end_end, &peak_val);
-	av_assert0(end_fi < fi2 || (end_fi == fi2 && end_end <= f2_end));
-
-	/* fix the spike */
-	fix_spike1(inlink, frames, ch,
-		start_fi, start_pos, end_fi, end_end, peak_val);
-
-	if (end_fi == fi2 && end_end == f2_end)
-	    break;
-	fi1 = end_fi;
-	f1_pos = end_end;
+    AVFilterContext *ctx = inlink->dst;
+    QALimiterContext *s = ctx->priv;
+
+    qalimiter_destroy(s->l);
+    s->l = qalimiter_create(inlink->channels, qadrc_fmt(inlink->format),
+	    make_writable, inlink);
+    if (!s->l)
+	return AVERROR(ENOMEM);
+    qalimiter_set_threads(s->l, execute, ctx, ff_filter_get_nb_threads(ctx));
+    if (s->gain)
+	qalimiter_set_gain(s->l, pow(10, s->gain / 20));
+
+    /* the frames are released as soon as they are done, and so the queue
+     * holds up to the limit, plus the frame in which it starts; the frames
+     * can be of any size, the ring grows to as many as it takes */
+    if (s->max_latency > 0) {
+	size_t samples = s->max_latency * inlink->sample_rate / 1000;
+	if (!qalimiter_set_max_latency(s->l, samples, 0))
+	    return AVERROR(ENOMEM);
+	av_log(ctx, AV_LOG_VERBOSE, "latency up to %zu samples\n", samples);
     }
+
+    return 0;
 }
 
-/* find the end limit up to which the buffer can be processed;
- * that is, up to the last intersection with the x-axis */
-static size_t find_channel_end(AVFrame *frame, int ch)
+/* with an integer output format, the frames are converted on the way out */
+static AVFrame *quantize(AVFilterLink *outlink, QALimiterContext *s, AVFrame *frame)
 {
-    float *x = (float *) frame->extended_data[ch];
-    ssize_t pos = frame->nb_samples - 1;
-    if (x[pos] < 0) {
-	if (x[0] < 0)
-	    do
-		pos--;
-	    while (pos >= 0 && x[pos] < 0);
-	else
-	    do
-		pos--;
-	    while (x[pos] < 0);
+    AVFrame *out = ff_get_audio_buffer(outlink, frame->nb_samples);
+    if (out) {
+	av_frame_copy_props(out, frame);
+	qalimiter_quantize(s->l, (void *const *) out->extended_data,
+		qadrc_fmt(outlink->format),
+		(float *const *) frame->extended_data, frame->nb_samples);
     }
-    else if (x[pos] > 0) {
-	if (x[0] > 0)
-	    do
-		pos--;
-	    while (pos >= 0 && x[pos] > 0);
-	else
-	    do
-		pos--;
-	    while (x[pos] > 0);
-    }
-    return pos + 1;
+    av_frame_free(&frame);
+    return out;
 }
 
-typedef struct QALimiterContext {
-    AVFrame **frames;
-    size_t nframes;
-    int fi[8]; /* frame index, per channel */
-    size_t fpos[8]; /* position in the frame up to which the input has been processed */
-} QALimiterContext;
-
-static int flush_frames(AVFilterContext *ctx, QALimiterContext *s, int nch)
+static int flush_frames(AVFilterContext *ctx, QALimiterContext *s, int fiend)
 {
-    int fiend = s->fi[0];
-    for (int ch = 1; ch < nch; ch++)
-	if (s->fi[ch] < fiend)
-	    fiend = s->fi[ch];
-
-    if (fiend == 0)
-	return 0;
-
-    for (int fi = 0; fi < fiend; fi++)
-	ff_filter_frame(ctx->outputs[0], s->frames[fi]);
-
-    s->nframes -= fiend;
-    memmove(s->frames, s->frames + fiend, s->nframes * sizeof(AVFrame *));
+    if (fiend < 0)
+	return AVERROR(ENOMEM);
+
+    AVFilterLink *outlink = ctx->outputs[0];
+    int ret = 0;
+    for (int fi = 0; fi < fiend; fi++) {
+	AVFrame *frame = qalimiter_opaque(s->l, fi);
+	if (s->out_fmt && !(frame = quantize(outlink, s, frame))) {
+	    ret = AVERROR(ENOMEM);
+	    continue;
+	}
+	ret |= ff_filter_frame(outlink, frame);
+    }
 
-    for (int ch = 0; ch < nch; ch++)
-	s->fi[ch] -= fiend;
+    qalimiter_release(s->l, fiend);
 
-    return 0;
+    return ret;
 }
 
 static int filter_frame(AVFilterLink *inlink, AVFrame *frame)
@@ -297,75 +167,93 @@ static int filter_frame(AVFilterLink *inlink, AVFrame *frame)
     AVFilterContext *ctx = inlink->dst;
     QALimiterContext *s = ctx->priv;
 
-    s->frames = av_realloc_f(s->frames, s->nframes + 1, sizeof(AVFrame *));
-    s->frames[s->nframes++] = frame;
-
-    int nch = inlink->channels;
-    for (int ch = 0; ch < nch; ch++) {
-	size_t end = find_channel_end(frame, ch);
-	if (end == 0) // no intersection with the x-axis
-	    continue;
-	int full = (end == frame->nb_samples);
-	fix_spikes(inlink, s->frames, ch,
-		s->fi[ch], s->fpos[ch], s->nframes - 1, end);
-	if (full) {
-	    s->fi[ch] = s->nframes;
-	    s->fpos[ch] = 0;
-	}
-	else {
-	    s->fi[ch] = s->nframes - 1;
-	    s->fpos[ch] = end;
-	}
-    }
-
-    return flush_frames(ctx, s, nch);
+    int fiend = qalimiter_push(s->l, (float **) frame->extended_data,
+	    frame->nb_samples, frame);
+    if (fiend < 0)
+	av_frame_free(&frame);
+    return flush_frames(ctx, s, fiend);
 }
 
-static int final_flush(AVFilterLink *inlink, AVFilterContext *ctx, QALimiterContext *s)
+/* The frames are taken as they come, and go out up to the last zero
+ * crossing; at the end, the rest goes out, and then the end with its
+ * timestamp. */
+static int activate(AVFilterContext *ctx)
 {
-    int nch = inlink->channels;
-    for (int ch = 0; ch < nch; ch++) {
-	if (s->fi[ch] == s->nframes)
-	    continue;
-	fix_spikes(inlink, s->frames, ch,
-		s->fi[ch], s->fpos[ch], s->nframes - 1,
-		s->frames[s->nframes-1]->nb_samples);
-	s->fi[ch] = s->nframes;
-	s->fpos[ch] = 0;
+    QALimiterContext *s = ctx->priv;
+    AVFilterLink *inlink = ctx->inputs[0];
+    AVFilterLink *outlink = ctx->outputs[0];
+    AVFrame *frame;
+    int64_t pts;
+    int ret, status;
+
+    FF_FILTER_FORWARD_STATUS_BACK(outlink, inlink);
+
+    ret = ff_inlink_consume_frame(inlink, &frame);
+    if (ret < 0)
+	return ret;
+    if (ret > 0) {
+	ff_filter_set_ready(ctx, 100);
+	return filter_frame(inlink, frame);
     }
-    return flush_frames(ctx, s, nch);
-}
 
-static int request_frame(AVFilterLink *outlink)
-{
-    AVFilterContext *ctx = outlink->src;
-    QALimiterContext *s = ctx->priv;
+    if (ff_inlink_acknowledge_status(inlink, &status, &pts)) {
+	ret = qalimiter_queued(s->l) ? flush_frames(ctx, s, qalimiter_finish(s->l)) : 0;
+	ff_outlink_set_status(outlink, status, pts);
+	return ret;
+    }
 
-    int ret = ff_request_frame(ctx->inputs[0]);
-    if (ret == AVERROR_EOF && !ctx->is_disabled && s->nframes)
-	ret = final_flush(outlink, ctx, s);
+    FF_FILTER_FORWARD_WANTED(outlink, inlink);
 
-    return ret;
+    return FFERROR_NOT_READY;
 }
 
 static av_cold void uninit(AVFilterContext *ctx)
 {
     QALimiterContext *s = ctx->priv;
-    for (int i = 0; i < s->nframes; i++)
-	av_frame_free(&s->frames[i]);
-    av_freep(&s->frames);
+    if (!s->l)
+	return;
+    for (size_t i = 0; i < qalimiter_queued(s->l); i++) {
+	AVFrame *frame = qalimiter_opaque(s->l, i);
+	av_frame_free(&frame);
+    }
+    qalimiter_destroy(s->l);
 }
 
 static int query_formats(AVFilterContext *ctx)
 {
+    QALimiterContext *s = ctx->priv;
     AVFilterFormats *formats = NULL;
     AVFilterChannelLayouts *layouts;
 
     int ret;
+    ret = ff_add_format(&formats, AV_SAMPLE_FMT_FLT);
+    if (ret < 0) return ret;
     ret = ff_add_format(&formats, AV_SAMPLE_FMT_FLTP);
     if (ret < 0) return ret;
-    ret = ff_set_common_formats(ctx, formats);
+    ret = ff_add_format(&formats, AV_SAMPLE_FMT_DBL);
     if (ret < 0) return ret;
+    ret = ff_add_format(&formats, AV_SAMPLE_FMT_DBLP);
+    if (ret < 0) return ret;
+    if (s->out_fmt == 0) {
+	ret = ff_set_common_formats(ctx, formats);
+	if (ret < 0) return ret;
+    }
+    else {
+	/* the integer output, packed or planar, is independent of the input */
+	if (s->out_fmt != 16 && s->out_fmt != 32) {
+	    av_log(ctx, AV_LOG_ERROR, "out_fmt must be float, s16 or s32\n");
+	    return AVERROR(EINVAL);
+	}
+	ret = ff_formats_ref(formats, &ctx->inputs[0]->out_formats);
+	if (ret < 0) return ret;
+	formats = NULL;
+	ret = ff_add_format(&formats, s->out_fmt == 16 ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_S32);
+	if (ret < 0) return ret;
+	ret = ff_add_format(&formats, s->out_fmt == 16 ? AV_SAMPLE_FMT_S16P : AV_SAMPLE_FMT_S32P);
+	if (ret < 0) return ret;
+	ret = ff_formats_ref(formats, &ctx->outputs[0]->in_formats);
+	if (ret < 0) return ret;
+    }
 
     layouts = ff_all_channel_layouts();
     if (!layouts) return AVERROR(ENOMEM);
@@ -384,7 +272,7 @@ static const AVFilterPad inputs[] = {
     {
         .name          = "default",
         .type          = AVMEDIA_TYPE_AUDIO,
-        .filter_frame  = filter_frame,
+        .config_props  = config_input,
     },
     { NULL }
 };
@@ -393,7 +281,6 @@ static const AVFilterPad outputs[] = {
     {
         .name          = "default",
         .type          = AVMEDIA_TYPE_AUDIO,
-        .request_frame = request_frame,
     },
     { NULL }
 };
@@ -403,7 +290,10 @@ AVFilter ff_af_qalimiter = {
     .description   = NULL_IF_CONFIG_SMALL("qaac soft limiter"),
     .uninit        = uninit,
     .query_formats = query_formats,
+    .activate      = activate,
     .inputs        = inputs,
     .outputs       = outputs,
     .priv_size     = sizeof(QALimiterContext),
+    .priv_class    = &qalimiter_class,
+    .flags         = AVFILTER_FLAG_SLICE_THREADS,
 };
@@ -0,0 +1,231 @@
+/*
+ * drcbench - benchmark qadrc kernels on every format/channel dispatch path
+ *
+ * Written by Alexey Tourbin.
+ * This file is distributed as Public Domain.
+ *
+ * Usage: ./drcbench [-p fast|balanced|exact] [-s] [-e step] [-u] [seconds]
+ *
+ * For each instruction set supported by the CPU, layout (packed and planar),
+ * channel count and frame size, runs qadrc_chew() and qadrc_apply() over
+ * a second of synthetic audio,
+ * repeated until the given amount of audio (20 seconds by default) has been
+ * processed, and reports the cost in ns per sample (that is, per sample
+ * frame, all channels) and the speed relative to realtime at 48 kHz.
+ * Compare the numbers across compiler versions and CFLAGS to see whether
+ * the C loops (isa "c") are still vectorized.  The dB conversions are done
+ * with the given precision, balanced by default; there are no vector kernels
+ * for the exact one.  With -s, the smoothing is done as parallel scans;
+ * with -e, the gain is smoothed every step samples; with -u, the channels
+ * are unlinked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "libqadrc.h"
+
+#define RATE 48000
+
+static int precision = QADRC_PRECISION_BALANCED;
+static bool scan;
+static unsigned envelope_step;
+static bool unlinked;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* noisy tones, alternating between loud and soft parts every 250 ms,
+ * so that the gain computer goes through all of its branches */
+static void synth(float *x, size_t n, unsigned nc)
+{
+    unsigned seed = 1;
+    for (size_t i = 0; i < n; i++) {
+	double env = (i / (RATE / 4)) % 2 ? 0.8 : 0.02;
+	for (unsigned c = 0; c < nc; c++) {
+	    seed = seed * 1103515245 + 12345;
+	    double noise = (seed >> 16 & 0x7fff) / 32768.0 - 0.5;
+	    double tone = sin(2 * M_PI * (220 + 110 * c) * i / RATE);
+	    x[i*nc+c] = env * (0.7 * tone + 0.3 * noise);
+	}
+    }
+}
+
+struct result {
+    double chew_ns;
+    double apply_ns;
+};
+
+static bool supported(int isa)
+{
+    struct qadrc_params p = QADRC_PARAMS_DEFAULT;
+    p.precision = precision;
+    p.scan = scan;
+    p.envelope_step = envelope_step;
+    p.unlinked = unlinked;
+    qadrc *q = qadrc_create(&p, RATE, 1, QADRC_FLT);
+    if (!q) {
+	fprintf(stderr, "qadrc_create failed\n");
+	exit(1);
+    }
+    bool ret = qadrc_set_isa(q, isa);
+    qadrc_destroy(q);
+    return ret;
+}
+
+static void bench1(int isa, int fmt, unsigned nc, size_t frame, size_t total,
+	const float *src, float *buf, float *a, struct result *r)
+{
+    struct qadrc_params p = QADRC_PARAMS_DEFAULT;
+    p.precision = precision;
+    p.scan = scan;
+    p.envelope_step = envelope_step;
+    p.unlinked = unlinked;
+    qadrc *q = qadrc_create(&p, RATE, nc, fmt);
+    if (!q) {
+	fprintf(stderr, "qadrc_create failed\n");
+	exit(1);
+    }
+    qadrc_set_isa(q, isa);
+    unsigned w = qadrc_width(q);
+
+    /* the packed layout is the synthesized one, planar is transposed */
+    float *data[8];
+    if (fmt == QADRC_FLTP)
+	for (unsigned c = 0; c < nc; c++)
+	    data[c] = buf + c * RATE;
+    else
+	data[0] = buf;
+
+    double chew_t = 0, apply_t = 0;
+    size_t done = 0;
+    while (done < total) {
+	if (fmt == QADRC_FLTP)
+	    for (unsigned c = 0; c < nc; c++)
+		for (size_t i = 0; i < RATE; i++)
+		    data[c][i] = src[i*nc+c];
+	else
+	    memcpy(buf, src, RATE * nc * sizeof(float));
+
+	double t0 = now();
+	for (size_t off = 0; off + frame <= RATE; off += frame)
+	    qadrc_chew(q, data, off, frame, a + off * w);
+	double t1 = now();
+	for (size_t off = 0; off + frame <= RATE; off += frame)
+	    qadrc_apply(q, data, off, a + off * w, frame);
+	double t2 = now();
+
+	chew_t += t1 - t0;
+	apply_t += t2 - t1;
+	done += RATE / frame * frame;
+    }
+
+    r->chew_ns = chew_t * 1e9 / done;
+    r->apply_ns = apply_t * 1e9 / done;
+    qadrc_destroy(q);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *precisions[] = {
+	[QADRC_PRECISION_BALANCED] = "balanced",
+	[QADRC_PRECISION_FAST] = "fast",
+	[QADRC_PRECISION_EXACT] = "exact",
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "p:se:u")) != -1) {
+	if (opt == 's') {
+	    scan = true;
+	    continue;
+	}
+	if (opt == 'u') {
+	    unlinked = true;
+	    continue;
+	}
+	if (opt == 'e') {
+	    envelope_step = atoi(optarg);
+	    continue;
+	}
+	if (opt == 'p') {
+	    for (precision = 0; precision < 3; precision++)
+		if (strcmp(optarg, precisions[precision]) == 0)
+		    break;
+	    if (precision < 3)
+		continue;
+	}
+	fprintf(stderr, "Usage: %s [-p fast|balanced|exact] [-s] [-e step] [-u] [seconds]\n", argv[0]);
+	return 2;
+    }
+    double seconds = optind < argc ? atof(argv[optind]) : 20;
+    if (seconds <= 0) {
+	fprintf(stderr, "Usage: %s [-p fast|balanced|exact] [-s] [-e step] [-u] [seconds]\n", argv[0]);
+	return 2;
+    }
+    size_t total = seconds * RATE;
+
+    static const unsigned ncs[] = { 1, 2, 6, 8 };
+    static const size_t frames[] = { 64, 256, 1024, 4096 };
+    static const struct { int fmt; const char *name; } fmts[] = {
+	{ QADRC_FLT, "flt" },
+	{ QADRC_FLTP, "fltp" },
+    };
+    static const struct { int isa; const char *name; } isas[] = {
+	{ QADRC_ISA_C, "c" },
+	{ QADRC_ISA_SSE2, "sse2" },
+	{ QADRC_ISA_AVX2, "avx2" },
+	{ QADRC_ISA_AVX512, "avx512" },
+    };
+
+    float *src = malloc(RATE * 8 * sizeof(float));
+    float *buf = malloc(RATE * 8 * sizeof(float));
+    float *a = malloc(RATE * 8 * sizeof(float));
+    if (!src || !buf || !a) {
+	fprintf(stderr, "malloc failed\n");
+	return 1;
+    }
+
+#ifdef __VERSION__
+    printf("# compiler: %s\n", __VERSION__);
+#endif
+    printf("# %.0f s of audio per case, %d Hz, %s precision%s", seconds, RATE,
+	    precisions[precision], scan ? ", scan" : "");
+    if (envelope_step > 1)
+	printf(", envelope step %u", envelope_step);
+    if (unlinked)
+	printf(", unlinked");
+    putchar('\n');
+    printf("%-6s %-6s %3s %6s %10s %10s %10s %10s\n", "isa", "fmt", "nc",
+	    "frame", "chew ns", "apply ns", "chew xRT", "apply xRT");
+
+    for (size_t m = 0; m < sizeof isas / sizeof *isas; m++) {
+	if (!supported(isas[m].isa))
+	    continue;
+	for (size_t k = 0; k < sizeof fmts / sizeof *fmts; k++)
+	    for (size_t j = 0; j < sizeof ncs / sizeof *ncs; j++) {
+		unsigned nc = ncs[j];
+		synth(src, RATE, nc);
+		for (size_t i = 0; i < sizeof frames / sizeof *frames; i++) {
+		    struct result r;
+		    bench1(isas[m].isa, fmts[k].fmt, nc, frames[i], total,
+			    src, buf, a, &r);
+		    printf("%-6s %-6s %3u %6zu %10.2f %10.2f %10.0f %10.0f\n",
+			    isas[m].name, fmts[k].name, nc, frames[i],
+			    r.chew_ns, r.apply_ns,
+			    1e9 / (r.chew_ns * RATE), 1e9 / (r.apply_ns * RATE));
+		}
+	    }
+    }
+
+    free(src);
+    free(buf);
+    free(a);
+    return 0;
+}
@@ -0,0 +1,862 @@
+/*
+ * drccheck - compare the fast and the reference builds of libqadrc
+ *
+ * Written by Alexey Tourbin.
+ * This file is distributed as Public Domain.
+ *
+ * Usage: ./drccheck-ref -w | ./drccheck
+ *
+ * The program is linked twice: drccheck-ref against the reference build
+ * of the engines (libm instead of the approximations, no -ffast-math),
+ * and drccheck against the regular build.  Both run qadrc (with the default
+ * settings, the fast precision, the smoothing scans, the decimated envelope,
+ * and unlinked channels; the reference build is always exact, serial and
+ * full-rate), mydrc (alone, with qadrc in parallel, with a 20 ms hop, and
+ * on interleaved doubles) and qalimiter (also on interleaved floats, on
+ * planar doubles, with a 20 ms latency limit, with a 6 dB gain, and quantized
+ * to 16 bits) over the same built-in corpus of synthetic program material.
+ * The -jobs engines split their work into jobs, which are run one after
+ * another in reverse order; the reference runs them as one.  With -w, the
+ * output is written to stdout; otherwise, the reference output is read from
+ * stdin and compared to the output of this build.  For each engine and corpus
+ * item, the maximum sample error and the maximum error of the gain curve
+ * (out/in, in dB) are reported.  A few checks of the behavior follow, which
+ * the reference cannot catch, being built from the same code: qadrc with a
+ * sidechain leaves a loud input alone under a silent key, and compresses a
+ * quiet input under a loud key as much as the key itself; qadrc with no delay
+ * switches from one set of parameters to another, as updated, at the next
+ * block, and never tears between them while another thread keeps updating
+ * them; mydrc gives the same output, sample for sample, with the gains it has
+ * written to a gain file read back; mydrc on a tone shorter than its
+ * lookahead gives it the gain of a full run; qalimiter with max_latency keeps
+ * within the limit and under the threshold on a signal which does not cross
+ * zero.  The exit status is 1 if any of the errors exceeds the tolerance for
+ * the engine, or if any of the checks fails.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "libqadrc.h"
+
+#define RATE 48000
+#define NC 2
+#define SECONDS 12
+#define N (SECONDS * RATE)
+#define CHUNK 1024
+
+/* the gain curve is only defined where the input is above -60 dBFS */
+#define GAIN_FLOOR 1e-3
+
+static unsigned seed;
+
+static double noise(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16 & 0x7fff) / 16384.0 - 1;
+}
+
+static double dB_to_scale(double x)
+{
+    return pow(10, x / 20);
+}
+
+/* syllable-like noise bursts with short pauses, at varying levels */
+static void speech(float *x[NC])
+{
+    double level = 0, f = 0;
+    for (size_t i = 0; i < N; i++) {
+	if (i % (RATE / 5) == 0) {
+	    /* a new syllable every 200 ms, every fifth one is a pause */
+	    level = (i / (RATE / 5)) % 5 == 4 ? 0 :
+		    dB_to_scale(-30 + 25 * (noise() + 1) / 2);
+	    f = 150 + 100 * (noise() + 1);
+	}
+	double t = (double) (i % (RATE / 5)) / (RATE / 5);
+	double env = level * sin(M_PI * t);
+	double v = env * (0.6 * sin(2 * M_PI * f * i / RATE) + 0.4 * noise());
+	for (int c = 0; c < NC; c++)
+	    x[c][i] = v;
+    }
+}
+
+/* a chord swelling from -50 to -3 dBFS and back, over the whole item */
+static void music(float *x[NC])
+{
+    static const double freqs[] = { 220, 277.2, 329.6, 440 };
+    for (size_t i = 0; i < N; i++) {
+	double t = (double) i / N;
+	double level = dB_to_scale(-50 + 47 * sin(M_PI * t));
+	for (int c = 0; c < NC; c++) {
+	    double v = 0;
+	    for (int k = 0; k < 4; k++)
+		v += sin(2 * M_PI * freqs[k] * (1 + 0.002 * c) * i / RATE + k);
+	    x[c][i] = level * v / 4;
+	}
+    }
+}
+
+/* a quiet bed with sharp decaying hits, some of them above -1 dBFS */
+static void transients(float *x[NC])
+{
+    double env = 0, peak = 0;
+    for (size_t i = 0; i < N; i++) {
+	if (i % (RATE * 3 / 4) == 0)
+	    peak = 0.5 + 0.25 * (noise() + 1);
+	env = i % (RATE * 3 / 4) == 0 ? peak : env * 0.9995;
+	double bed = dB_to_scale(-40) * sin(2 * M_PI * 110 * i / RATE);
+	double hit = env * sin(2 * M_PI * 60 * i / RATE);
+	for (int c = 0; c < NC; c++)
+	    x[c][i] = bed + hit * (c ? 0.9 : 1);
+    }
+}
+
+/* a logarithmic sine sweep, 20 Hz to 20 kHz, with a level ramp */
+static void sweep(float *x[NC])
+{
+    const double f0 = 20, f1 = 20000, T = SECONDS;
+    const double k = log(f1 / f0);
+    for (size_t i = 0; i < N; i++) {
+	double t = (double) i / RATE;
+	double phase = 2 * M_PI * f0 * T / k * (exp(t / T * k) - 1);
+	double level = dB_to_scale(-40 + 39.5 * t / T);
+	for (int c = 0; c < NC; c++)
+	    x[c][i] = level * sin(phase + c);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*synth)(float *x[NC]);
+} corpus[] = {
+    { "speech", speech },
+    { "music", music },
+    { "transients", transients },
+    { "sweep", sweep },
+};
+
+enum { QADRC, QADRC_FAST, QADRC_SCAN, QADRC_STEP, QADRC_UNLINKED, QADRC_JOBS,
+       MYDRC, MYDRC_PARALLEL, MYDRC_HOP, MYDRC_DBL, MYDRC_JOBS,
+       QALIMITER, QALIMITER_FLT, QALIMITER_DBLP, QALIMITER_JOBS,
+       QALIMITER_LATENCY, QALIMITER_GAIN, QALIMITER_S16 };
+
+static const struct {
+    const char *name;
+    double sample_tol; /* max abs sample error */
+    double gain_tol; /* max gain curve error, dB */
+    int fmt; /* the layout the engine runs on, FLTP if 0 */
+} engines[] = {
+    { "qadrc", 1e-4, 0.01 },
+    { "qadrc-fast", 1e-3, 0.01 },
+    { "qadrc-scan", 1e-4, 0.01 },
+    /* the smoothing runs by the block of 32 samples */
+    { "qadrc-step", 1e-3, 0.1 },
+    { "qadrc-unlinked", 1e-4, 0.01 },
+    { "qadrc-jobs", 1e-4, 0.01 },
+    { "mydrc", 1e-5, 0.001 },
+    { "mydrc-parallel", 1e-4, 0.01 },
+    { "mydrc-hop", 1e-5, 0.001 },
+    { "mydrc-dbl", 1e-5, 0.001, QADRC_DBL },
+    { "mydrc-jobs", 1e-5, 0.001, QADRC_FLT },
+    { "qalimiter", 1e-5, 0.001 },
+    { "qalimiter-flt", 1e-5, 0.001, QADRC_FLT },
+    { "qalimiter-dblp", 1e-5, 0.001, QADRC_DBLP },
+    { "qalimiter-jobs", 1e-5, 0.001 },
+    { "qalimiter-latency", 1e-5, 0.001 },
+    { "qalimiter-gain", 1e-5, 0.001 },
+    { "qalimiter-s16", 1e-5, 0.001 },
+};
+
+/* the behavior checks print one line each */
+static bool report(const char *name, bool ok, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    printf("%-17s ", name);
+    vprintf(fmt, ap);
+    printf("%s\n", ok ? "" : "  FAIL");
+    va_end(ap);
+    return ok;
+}
+
+/* the gain file of mydrc, written or read, see check_gainfile() */
+static FILE *gain_fp;
+static bool gain_read, gains_ok;
+
+/* the jobs engines run as one job in the reference */
+static bool serial;
+#define JOBS 4
+
+/* the jobs must not depend on the order */
+static void execute(void *arg, qadrc_job_fn job, void *job_arg, unsigned nb_jobs)
+{
+    (void) arg;
+    for (unsigned i = nb_jobs; i-- > 0; )
+	job(job_arg, i, nb_jobs);
+}
+
+#define PACKED(fmt) ((fmt) == QADRC_FLT || (fmt) == QADRC_DBL)
+#define DOUBLE(fmt) ((fmt) == QADRC_DBL || (fmt) == QADRC_DBLP)
+
+/* convert the samples between x[] and buf, in the layout fmt */
+static void convert(float *x[NC], char *buf, int fmt, bool to_buf)
+{
+    for (int c = 0; c < NC; c++)
+	for (size_t i = 0; i < N; i++) {
+	    size_t k = PACKED(fmt) ? i * NC + c : c * N + i;
+	    if (DOUBLE(fmt)) {
+		double *y = (double *) buf + k;
+		if (to_buf) *y = x[c][i]; else x[c][i] = *y;
+	    }
+	    else {
+		float *y = (float *) buf + k;
+		if (to_buf) *y = x[c][i]; else x[c][i] = *y;
+	    }
+	}
+}
+
+/* the output to interleaved 16-bit samples, and back */
+static void requantize(qalimiter *l, float *x[NC])
+{
+    short s16[CHUNK * NC];
+    for (size_t i = 0; i < N; i += CHUNK) {
+	size_t n = N - i < CHUNK ? N - i : CHUNK;
+	float *p[NC];
+	for (int c = 0; c < NC; c++)
+	    p[c] = x[c] + i;
+	void *out = s16;
+	qalimiter_quantize(l, &out, QADRC_S16, p, n);
+	for (int c = 0; c < NC; c++)
+	    for (size_t j = 0; j < n; j++)
+		x[c][i + j] = s16[j * NC + c] / 32768.0f;
+    }
+}
+
+/* run an engine with the streaming interface, x[] is processed in place */
+static void run(int engine, float *x[NC])
+{
+    int fmt = engines[engine].fmt ? engines[engine].fmt : QADRC_FLTP;
+    struct qadrc_params qp = QADRC_PARAMS_DEFAULT;
+    struct mydrc_params mp = MYDRC_PARAMS_DEFAULT;
+    qadrc *q = NULL;
+    mydrc *m = NULL;
+    qalimiter *l = NULL;
+    switch (engine) {
+    case QADRC_FAST:
+	qp.precision = QADRC_PRECISION_FAST;
+	/* fall through */
+    case QADRC_SCAN:
+	qp.scan = engine == QADRC_SCAN;
+	/* fall through */
+    case QADRC_STEP:
+	qp.envelope_step = engine == QADRC_STEP ? 32 : 0;
+	/* fall through */
+    case QADRC_UNLINKED:
+	qp.unlinked = engine == QADRC_UNLINKED;
+	/* fall through */
+    case QADRC:
+    case QADRC_JOBS: q = qadrc_create(&qp, RATE, NC, QADRC_FLTP); break;
+    case MYDRC_HOP:
+	mp.hop = 20;
+	/* fall through */
+    case MYDRC_PARALLEL:
+	mp.mix = engine == MYDRC_PARALLEL ? 0.5 : 0;
+	/* fall through */
+    case MYDRC:
+    case MYDRC_DBL:
+    case MYDRC_JOBS: m = mydrc_create(&mp, RATE, NC, fmt); break;
+    case QALIMITER:
+    case QALIMITER_FLT:
+    case QALIMITER_DBLP:
+    case QALIMITER_JOBS:
+    case QALIMITER_LATENCY:
+    case QALIMITER_GAIN:
+    case QALIMITER_S16: l = qalimiter_create(NC, fmt, NULL, NULL); break;
+    }
+    if (!q && !m && !l) {
+	fprintf(stderr, "cannot create %s\n", engines[engine].name);
+	exit(2);
+    }
+    if (engine == QALIMITER_LATENCY && !qalimiter_set_max_latency(l, RATE / 50, 4)) {
+	fprintf(stderr, "malloc failed\n");
+	exit(2);
+    }
+    if (engine == QALIMITER_GAIN)
+	qalimiter_set_gain(l, 2);
+    if (m && gain_fp &&
+	    !(gain_read ? mydrc_read_gains(m, gain_fp) : mydrc_write_gains(m, gain_fp))) {
+	fprintf(stderr, "cannot %s the gain file\n", gain_read ? "read" : "write");
+	exit(2);
+    }
+    if (!serial)
+	switch (engine) {
+	case QADRC_JOBS: qadrc_set_threads(q, execute, NULL, JOBS); break;
+	case MYDRC_JOBS: mydrc_set_threads(m, execute, NULL, JOBS); break;
+	case QALIMITER_JOBS: qalimiter_set_threads(l, execute, NULL, JOBS); break;
+	}
+
+    /* the samples in the engine's layout, nbufs buffers */
+    int nbufs = PACKED(fmt) ? 1 : NC;
+    size_t width = (PACKED(fmt) ? NC : 1) * (DOUBLE(fmt) ? sizeof(double) : sizeof(float));
+    char *buf = NULL, *b[NC];
+    if (fmt == QADRC_FLTP)
+	for (int c = 0; c < NC; c++)
+	    b[c] = (char *) x[c];
+    else {
+	buf = malloc(NC * N * sizeof(double));
+	if (!buf) {
+	    fprintf(stderr, "malloc failed\n");
+	    exit(2);
+	}
+	convert(x, buf, fmt, true);
+	for (int k = 0; k < nbufs; k++)
+	    b[k] = buf + k * N * width;
+    }
+
+    /* the output lags behind and is written over the consumed input */
+    size_t in = 0, out = 0;
+    while (1) {
+	size_t n = N - in < CHUNK ? N - in : CHUNK;
+	float *p[NC];
+	for (int k = 0; k < nbufs; k++) {
+	    p[k] = (float *) (b[k] + out * width);
+	    memmove(p[k], b[k] + in * width, n * width);
+	}
+	if (n) {
+	    in += n;
+	    switch (engine) {
+	    case QADRC:
+	    case QADRC_FAST:
+	    case QADRC_SCAN:
+	    case QADRC_STEP:
+	    case QADRC_UNLINKED:
+	    case QADRC_JOBS: n = qadrc_process(q, p, n); break;
+	    case MYDRC:
+	    case MYDRC_PARALLEL:
+	    case MYDRC_HOP:
+	    case MYDRC_DBL:
+	    case MYDRC_JOBS: n = mydrc_process(m, p, n); break;
+	    case QALIMITER:
+	    case QALIMITER_FLT:
+	    case QALIMITER_DBLP:
+	    case QALIMITER_JOBS:
+	    case QALIMITER_LATENCY:
+	    case QALIMITER_GAIN:
+	    case QALIMITER_S16: n = qalimiter_process(l, p, n); break;
+	    }
+	}
+	else {
+	    n = N - out < CHUNK ? N - out : CHUNK;
+	    switch (engine) {
+	    case QADRC:
+	    case QADRC_FAST:
+	    case QADRC_SCAN:
+	    case QADRC_STEP:
+	    case QADRC_UNLINKED:
+	    case QADRC_JOBS: n = qadrc_flush(q, p, n); break;
+	    case MYDRC:
+	    case MYDRC_PARALLEL:
+	    case MYDRC_HOP:
+	    case MYDRC_DBL:
+	    case MYDRC_JOBS: n = mydrc_flush(m, p, n); break;
+	    case QALIMITER:
+	    case QALIMITER_FLT:
+	    case QALIMITER_DBLP:
+	    case QALIMITER_JOBS:
+	    case QALIMITER_LATENCY:
+	    case QALIMITER_GAIN:
+	    case QALIMITER_S16: n = qalimiter_flush(l, p, n); break;
+	    }
+	    if (n == 0)
+		break;
+	}
+	out += n;
+    }
+    if (out != N) {
+	fprintf(stderr, "%s: %zu samples in, %zu out\n", engines[engine].name,
+		(size_t) N, out);
+	exit(2);
+    }
+
+    if (buf) {
+	convert(x, buf, fmt, false);
+	free(buf);
+    }
+    if (engine == QALIMITER_S16)
+	requantize(l, x);
+    if (m && gain_fp) {
+	size_t frames, gains;
+	gains_ok = mydrc_gains_match(m, &frames, &gains);
+    }
+
+    qadrc_destroy(q);
+    mydrc_destroy(m);
+    qalimiter_destroy(l);
+}
+
+/* the gain of x[] over in[] at sample i of channel c, in dB, or NAN if in[]
+ * is too quiet for it */
+static double gain_at(float *in[NC], float *x[NC], int c, size_t i)
+{
+    if (fabs(in[c][i]) < GAIN_FLOOR)
+	return NAN;
+    return 20 * log10(fabs(x[c][i]) / fabs(in[c][i]));
+}
+
+/* qadrc analyzes the key, and the coefficients are applied to x[] by
+ * another qadrc with no delay, as the filter does with a sidechain */
+static void sidechain(float *key[NC], float *x[NC], float *a)
+{
+    struct qadrc_params p = QADRC_PARAMS_DEFAULT;
+    qadrc *q = qadrc_create(&p, RATE, NC, QADRC_FLTP);
+    p.delay = 0;
+    qadrc *qa = qadrc_create(&p, RATE, NC, QADRC_FLTP);
+    if (!q || !qa) {
+	fprintf(stderr, "cannot create qadrc\n");
+	exit(2);
+    }
+    /* the coefficient of key sample i goes to sample i - delay */
+    size_t delay = qadrc_latency(q);
+    for (size_t i = 0; i < N; i += CHUNK) {
+	size_t n = N - i < CHUNK ? N - i : CHUNK;
+	qadrc_chew(q, key, i, n, a + i);
+    }
+    memmove(a, a + delay, (N - delay) * sizeof *a);
+    qadrc_fill_lasta(q, a + N - delay, delay);
+    for (size_t i = 0; i < N; i += CHUNK) {
+	size_t n = N - i < CHUNK ? N - i : CHUNK;
+	qadrc_apply(qa, x, i, a + i, n);
+    }
+    qadrc_destroy(q);
+    qadrc_destroy(qa);
+}
+
+/* a key which is silent, or which steps from -40 to -6 dBFS and back */
+static void key_tone(float *key[NC], bool loud)
+{
+    for (int c = 0; c < NC; c++)
+	for (size_t i = 0; i < N; i++) {
+	    bool step = loud && i >= N / 3 && i < 2 * N / 3;
+	    double level = loud ? dB_to_scale(step ? -6 : -40) : 0;
+	    key[c][i] = level * sin(2 * M_PI * 440 * i / RATE + c);
+	}
+}
+
+static bool check_sidechain(float *key[NC], float *in[NC], float *x[NC])
+{
+    float *a = malloc(N * sizeof *a);
+    float *self = malloc(NC * N * sizeof *self);
+    if (!a || !self) {
+	fprintf(stderr, "malloc failed\n");
+	exit(2);
+    }
+
+    /* a silent key: unity gain, once the initial gain is released */
+    key_tone(key, false);
+    for (int c = 0; c < NC; c++)
+	for (size_t i = 0; i < N; i++)
+	    in[c][i] = x[c][i] = dB_to_scale(-6) * sin(2 * M_PI * 440 * i / RATE + c);
+    sidechain(key, x, a);
+    double max = 0;
+    for (int c = 0; c < NC; c++)
+	for (size_t i = N / 2; i < N; i++) {
+	    double g = gain_at(in, x, c, i);
+	    if (fabs(g) > max)
+		max = fabs(g);
+	}
+    bool ok = report("qadrc-sidechain", max <= 0.01,
+	    "%-11s gain within %.3g dB", "silent key", max);
+
+    /* a loud key: the quiet input gets the same gain, sample for sample,
+     * as the key compressed by itself */
+    key_tone(key, true);
+    float *y[NC];
+    for (int c = 0; c < NC; c++) {
+	y[c] = self + c * N;
+	memcpy(y[c], key[c], N * sizeof(float));
+    }
+    run(QADRC, y);
+    for (int c = 0; c < NC; c++)
+	for (size_t i = 0; i < N; i++)
+	    in[c][i] = x[c][i] = dB_to_scale(-50) * sin(2 * M_PI * 1000 * i / RATE + c);
+    sidechain(key, x, a);
+    double err = 0, min = 0;
+    for (int c = 0; c < NC; c++)
+	for (size_t i = 0; i < N; i++) {
+	    double g = gain_at(in, x, c, i), g_self = gain_at(key, y, c, i);
+	    if (isnan(g) || isnan(g_self))
+		continue;
+	    if (fabs(g - g_self) > err)
+		err = fabs(g - g_self);
+	    if (g < min)
+		min = g;
+	}
+    ok &= report("qadrc-sidechain", err <= 0.01 && min < -6,
+	    "%-11s gain down to %.3g dB, %.3g dB off the key's own", "loud key",
+	    min, err);
+
+    free(self);
+    free(a);
+    return ok;
+}
+
+/* the thread which updates qadrc concurrently */
+struct updater {
+    qadrc *q;
+    const struct qadrc_params *p[2];
+    atomic_bool stop;
+};
+
+/* the parameters flip between the two sets, as fast as they can */
+static void *updater(void *arg)
+{
+    struct updater *u = arg;
+    for (unsigned k = 0; !atomic_load(&u->stop); k++)
+	qadrc_update(u->q, u->p[k & 1]);
+    return NULL;
+}
+
+/* qadrc, with no delay and instant attack and release, on a square wave;
+ * the parameters are updated from p to p2 at sample at, or flip between
+ * them in another thread */
+static void square_drc(const struct qadrc_params *p, const struct qadrc_params *p2,
+	size_t at, float *in[NC], float *x[NC], bool flip)
+{
+    qadrc *q = qadrc_create(p, RATE, NC, QADRC_FLTP);
+    if (!q) {
+	fprintf(stderr, "cannot create qadrc\n");
+	exit(2);
+    }
+    struct updater u = { q, { p, p2 } };
+    atomic_init(&u.stop, false);
+    pthread_t thread;
+    if (flip && pthread_create(&thread, NULL, updater, &u)) {
+	fprintf(stderr, "cannot create a thread\n");
+	exit(2);
+    }
+    for (int c = 0; c < NC; c++)
+	for (size_t i = 0; i < N; i++)
+	    in[c][i] = x[c][i] = (i / 50 + c) % 2 ? -0.5 : 0.5;
+    for (size_t i = 0; i < N; i += CHUNK) {
+	if (p2 && !flip && i == at)
+	    qadrc_update(q, p2);
+	/* the updates are picked up by the block, once per call */
+	if (flip)
+	    sched_yield();
+	size_t n = N - i < CHUNK ? N - i : CHUNK;
+	float *b[NC];
+	for (int c = 0; c < NC; c++)
+	    b[c] = x[c] + i;
+	if (qadrc_process(q, b, n) != n) {
+	    fprintf(stderr, "qadrc with no delay held samples back\n");
+	    exit(2);
+	}
+    }
+    if (flip) {
+	atomic_store(&u.stop, true);
+	pthread_join(thread, NULL);
+    }
+    qadrc_destroy(q);
+}
+
+/* the gain is that of the first parameters, then, from the block after
+ * the update on, that of the second ones, and never a mix of them */
+static bool check_update(float *in[NC], float *x[NC], float *y[NC])
+{
+    struct qadrc_params p1 = QADRC_PARAMS_DEFAULT, p2;
+    p1.attack = p1.release = p1.delay = 0;
+    p2 = p1;
+    p2.thresh = -10;
+    p2.ratio = 4;
+    p2.knee = 6;
+    const size_t at = 100 * CHUNK;
+
+    /* the gains of each set of parameters alone */
+    square_drc(&p1, NULL, 0, in, x, false);
+    double g1 = gain_at(in, x, 0, N - 1);
+    square_drc(&p2, NULL, 0, in, x, false);
+    double g2 = gain_at(in, x, 0, N - 1);
+
+    square_drc(&p1, &p2, at, in, y, false);
+    size_t wrong = 0;
+    for (int c = 0; c < NC; c++)
+	for (size_t i = 0; i < N; i++)
+	    wrong += fabs(gain_at(in, y, c, i) - (i < at ? g1 : g2)) > 1e-4;
+    bool ok = report("qadrc-update", wrong == 0 && fabs(g1 - g2) > 1,
+	    "%-11s gain %.3g, then %.3g dB; %zu samples off", "once",
+	    g1, g2, wrong);
+
+    /* each block gets one set or the other, whole */
+    square_drc(&p1, &p2, 0, in, y, true);
+    size_t flips = 0;
+    wrong = 0;
+    for (size_t i = 0; i < N; i += CHUNK) {
+	double g = gain_at(in, y, 0, i);
+	if (i && fabs(g - gain_at(in, y, 0, i - CHUNK)) > 1e-4)
+	    flips++;
+	for (int c = 0; c < NC; c++)
+	    for (size_t j = i; j < i + CHUNK && j < N; j++)
+		wrong += fabs(gain_at(in, y, c, j) - g) > 1e-4 ||
+			 (fabs(g - g1) > 1e-4 && fabs(g - g2) > 1e-4);
+    }
+    ok &= report("qadrc-update", wrong == 0,
+	    "%-11s %zu flips; %zu samples off", "concurrent", flips, wrong);
+    return ok;
+}
+
+/* mydrc, with the gains written out, and then read back */
+static bool check_gainfile(float *in[NC], float *a[NC], float *b[NC])
+{
+    bool ok = true;
+    for (size_t k = 0; k < sizeof corpus / sizeof *corpus; k++) {
+	seed = 1;
+	corpus[k].synth(in);
+	for (int c = 0; c < NC; c++) {
+	    memcpy(a[c], in[c], N * sizeof(float));
+	    memcpy(b[c], in[c], N * sizeof(float));
+	}
+	gain_fp = tmpfile();
+	if (!gain_fp) {
+	    fprintf(stderr, "cannot create the gain file\n");
+	    exit(2);
+	}
+	gain_read = false;
+	run(MYDRC, a);
+	bool written = gains_ok;
+	rewind(gain_fp);
+	gain_read = true;
+	run(MYDRC, b);
+	fclose(gain_fp);
+	gain_fp = NULL;
+
+	size_t diff = 0;
+	for (int c = 0; c < NC; c++)
+	    for (size_t i = 0; i < N; i++)
+		diff += a[c][i] != b[c][i];
+	ok &= report("mydrc-gainfile", written && gains_ok && diff == 0,
+		"%-11s %zu samples differ%s", corpus[k].name, diff,
+		written && gains_ok ? "" : ", the gains do not match");
+    }
+    return ok;
+}
+
+/* mydrc on a tone shorter than its lookahead, from one frame to 7 s, with
+ * no hop and with a 10 ms hop: the filters are flushed before they are
+ * filled up, and the gain is that of the tone in the middle of a full run */
+static bool check_short(float *in[NC], float *x[NC])
+{
+    static const size_t lens[] = { RATE / 10, RATE / 5, RATE, 5 * RATE, 7 * RATE };
+    struct mydrc_params mp = MYDRC_PARAMS_DEFAULT;
+    for (int c = 0; c < NC; c++)
+	for (size_t i = 0; i < N; i++)
+	    in[c][i] = x[c][i] = dB_to_scale(-10) * sin(2 * M_PI * 440 * i / RATE + c);
+    run(MYDRC, x);
+    /* at a peak of the tone */
+    double g = gain_at(in, x, 0, N / 2 + RATE / 440 / 4);
+
+    bool ok = true;
+    for (int hop = 100; hop >= 10; hop -= 90)
+	for (size_t k = 0; k < sizeof lens / sizeof *lens; k++) {
+	    size_t len = lens[k], out = 0;
+	    mp.hop = hop;
+	    mydrc *m = mydrc_create(&mp, RATE, NC, QADRC_FLTP);
+	    if (!m) {
+		fprintf(stderr, "cannot create mydrc\n");
+		exit(2);
+	    }
+	    for (int c = 0; c < NC; c++)
+		memcpy(x[c], in[c], len * sizeof(float));
+	    for (size_t i = 0; i < len; i += CHUNK) {
+		size_t n = len - i < CHUNK ? len - i : CHUNK;
+		float *p[NC];
+		for (int c = 0; c < NC; c++) {
+		    p[c] = x[c] + out;
+		    memmove(p[c], x[c] + i, n * sizeof(float));
+		}
+		out += mydrc_process(m, p, n);
+	    }
+	    while (1) {
+		float *p[NC];
+		for (int c = 0; c < NC; c++)
+		    p[c] = x[c] + out;
+		size_t n = mydrc_flush(m, p, len - out < CHUNK ? len - out : CHUNK);
+		if (n == 0)
+		    break;
+		out += n;
+	    }
+	    mydrc_destroy(m);
+
+	    double err = 0;
+	    for (int c = 0; c < NC; c++)
+		for (size_t i = 0; i < out; i++) {
+		    double e = fabs(gain_at(in, x, c, i) - g);
+		    if (e > err)
+			err = e;
+		}
+	    char item[16];
+	    snprintf(item, sizeof item, "%.1f s/%d", (double) len / RATE, hop);
+	    ok &= report("mydrc-short", out == len && err <= 0.01,
+		    "%-11s %zu of %zu samples, %.3g dB off %.3g dB", item,
+		    out, len, err, g);
+	}
+    return ok;
+}
+
+/* qalimiter, 20 ms at most, on a DC offset with spikes, which never crosses
+ * zero, and on a clipped square wave, which crosses it every 2560 samples;
+ * the blocks of 256 samples are released as soon as they are done, and
+ * the cuts are at the block ends, so that no more than 20 ms is held */
+static bool check_latency(void)
+{
+    enum { BLOCK = 256, NB = N / BLOCK };
+    const size_t max = RATE / 50;
+    float *x = malloc(NC * N * sizeof *x);
+    float **p = malloc(NB * NC * sizeof *p);
+    qalimiter *l = qalimiter_create(NC, QADRC_FLTP, NULL, NULL);
+    if (!x || !p || !l || !qalimiter_set_max_latency(l, max, 0)) {
+	fprintf(stderr, "malloc failed\n");
+	exit(2);
+    }
+    for (size_t t = 0; t < N; t++) {
+	x[t] = 0.5 + (t % 1000 < 20 ? 0.04 * (t % 20) : 0);
+	x[N + t] = (t / 2560) % 2 ? -1 : 1;
+    }
+
+    size_t lag = 0, out = 0, held = 0, cut = 0;
+    for (size_t b = 0; b <= NB; b++) {
+	int done;
+	if (b < NB) {
+	    for (int c = 0; c < NC; c++)
+		p[b * NC + c] = x + c * N + b * BLOCK;
+	    done = qalimiter_push(l, p + b * NC, BLOCK, NULL);
+	    held += BLOCK;
+	}
+	else
+	    done = qalimiter_finish(l);
+	if (done < 0) {
+	    fprintf(stderr, "malloc failed\n");
+	    exit(2);
+	}
+	qalimiter_release(l, done);
+	/* the blocks go out before the end only if they are cut */
+	if (b < NB)
+	    cut += done;
+	out += done * BLOCK;
+	held -= done * BLOCK;
+	if (held > lag)
+	    lag = held;
+    }
+
+    double peak = 0;
+    for (size_t i = 0; i < NC * N; i++)
+	if (fabs(x[i]) > peak)
+	    peak = fabs(x[i]);
+    qalimiter_destroy(l);
+    free(p);
+    free(x);
+    bool ok = cut && lag <= max && out == N && peak <= 0.8912509 + 1e-6;
+    return report("qalimiter-latency", ok, "lag %zu of %zu samples, peak %.4g",
+	    lag, max, peak);
+}
+
+static void xfer(float *x[NC], bool write)
+{
+    for (int c = 0; c < NC; c++) {
+	size_t n = write ? fwrite(x[c], sizeof(float), N, stdout)
+			 : fread(x[c], sizeof(float), N, stdin);
+	if (n != N) {
+	    fprintf(stderr, "cannot %s the reference output\n",
+		    write ? "write" : "read");
+	    exit(2);
+	}
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bool write = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "w")) != -1)
+	switch (opt) {
+	case 'w':
+	    write = serial = true;
+	    break;
+	default:
+	    fprintf(stderr, "Usage: %s [-w]\n", argv[0]);
+	    return 2;
+	}
+    if (!write && isatty(0)) {
+	fprintf(stderr, "Usage: drccheck-ref -w | %s\n", argv[0]);
+	return 2;
+    }
+
+    float *buf = malloc(3 * NC * N * sizeof(float));
+    if (!buf) {
+	fprintf(stderr, "malloc failed\n");
+	return 2;
+    }
+    float *in[NC], *out[NC], *ref[NC];
+    for (int c = 0; c < NC; c++) {
+	in[c] = buf + c * N;
+	out[c] = buf + (NC + c) * N;
+	ref[c] = buf + (2 * NC + c) * N;
+    }
+
+    if (!write)
+	printf("%-17s %-11s %12s %12s\n", "engine", "item",
+		"sample err", "gain err dB");
+
+    int fail = 0;
+    for (size_t e = 0; e < sizeof engines / sizeof *engines; e++)
+	for (size_t k = 0; k < sizeof corpus / sizeof *corpus; k++) {
+	    seed = 1;
+	    corpus[k].synth(in);
+	    for (int c = 0; c < NC; c++)
+		memcpy(out[c], in[c], N * sizeof(float));
+	    run(e, out);
+	    if (write) {
+		xfer(out, true);
+		continue;
+	    }
+	    xfer(ref, false);
+
+	    double sample_err = 0, gain_err = 0;
+	    for (int c = 0; c < NC; c++)
+		for (size_t i = 0; i < N; i++) {
+		    double err = fabs((double) out[c][i] - ref[c][i]);
+		    if (err > sample_err)
+			sample_err = err;
+		    double x = fabs(in[c][i]);
+		    if (x < GAIN_FLOOR)
+			continue;
+		    double g1 = 20 * log10(fabs(out[c][i]) / x + 1e-30);
+		    double g2 = 20 * log10(fabs(ref[c][i]) / x + 1e-30);
+		    if (fabs(g1 - g2) > gain_err)
+			gain_err = fabs(g1 - g2);
+		}
+
+	    bool ok = sample_err <= engines[e].sample_tol &&
+		      gain_err <= engines[e].gain_tol;
+	    printf("%-17s %-11s %12.3g %12.3g%s\n", engines[e].name,
+		    corpus[k].name, sample_err, gain_err, ok ? "" : "  FAIL");
+	    fail |= !ok;
+	}
+
+    if (!write) {
+	fail |= !check_sidechain(in, out, ref);
+	fail |= !check_update(in, out, ref);
+	fail |= !check_gainfile(in, out, ref);
+	fail |= !check_short(in, out);
+	fail |= !check_latency();
+    }
+
+    free(buf);
+    return fail;
+}
@@ -0,0 +1,323 @@
+/*
+ * libqadrc - the DSP engines behind qadrc, mydrc and qalimiter
+ *
+ * Written by Alexey Tourbin.
+ * This file is distributed as Public Domain.
+ *
+ * The engines work on raw float samples and do not depend on ffmpeg.
+ * Each engine has a low-level interface, used by the ffmpeg filters which
+ * keep their own frame queues, and a streaming interface which works
+ * in place on caller's buffers:
+ *
+ *     x = xxx_create(...);
+ *     while (n = read(data))
+ *         n = xxx_process(x, data, n), write(data, n);
+ *     while (n = xxx_flush(x, data, bufsize))
+ *         write(data, n);
+ *     xxx_destroy(x);
+ *
+ * The streaming interface delays the output by the engine's latency:
+ * xxx_process() may return fewer samples than it has been given, and
+ * xxx_flush() returns the rest.  The total number of samples written
+ * equals the total number of samples read.
+ */
+
+#ifndef LIBQADRC_H
+#define LIBQADRC_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* sample layouts: data[0] holds interleaved samples, or
+ * data[0..nc-1] hold one channel each; the samples are floats, or doubles
+ * with DBL and DBLP, the data pointers being cast; qadrc takes floats only */
+enum { QADRC_FLT = 1, QADRC_FLTP = 2, QADRC_DBL = 3, QADRC_DBLP = 4 };
+
+/* integer layouts, 16-bit or 32-bit, for the qalimiter output only */
+enum { QADRC_S16 = 5, QADRC_S16P = 6, QADRC_S32 = 7, QADRC_S32P = 8 };
+
+/* The stages which work on each channel, or on each sample, independently
+ * (the gain multiply, the mydrc high-pass and RMS, the qalimiter spike
+ * search) can be split into jobs; the detectors and the gain smoothing
+ * stay serial.  execute() is to run job(job_arg, jobnr, nb_jobs) for each
+ * jobnr < nb_jobs, in any order and possibly in parallel, and to return
+ * when all of them are done; the ffmpeg filters pass the slice threads. */
+typedef void (*qadrc_job_fn)(void *job_arg, unsigned jobnr, unsigned nb_jobs);
+typedef void (*qadrc_execute_fn)(void *arg, qadrc_job_fn job, void *job_arg,
+	unsigned nb_jobs);
+
+/*
+ * qadrc - classic compressor with attack, release and lookahead
+ */
+
+struct qadrc_params {
+    double thresh;	/* threshold, dB */
+    double ratio;	/* compression ratio */
+    double knee;	/* knee width, dB */
+    double attack;	/* attack time, ms */
+    double release;	/* release time, ms */
+    double delay;	/* delay (lookahead) time, ms */
+    double gain0;	/* initial gain, dB */
+    int precision;	/* QADRC_PRECISION_* */
+    bool scan;		/* smoothing as parallel scans */
+    unsigned envelope_step; /* smooth the gain every so many samples */
+    bool unlinked;	/* a detector and a gain per channel */
+};
+
+/*
+ * The precision of the dB conversions, on both sides of the gain computer.
+ * The errors are the bounds of the gain error at any ratio, from those of
+ * the approximations (drccheck measures 0.0001 and 0.003 dB at the default
+ * ratio); the speed is of qadrc_chew() + qadrc_apply() as measured by
+ * drcbench:
+ *
+ *   BALANCED  5th-order logapprox, 4th-order expapprox; 0.0003 dB
+ *   FAST      3rd-order approximations; 0.007 dB; up to 20% faster with
+ *             the C kernels, but the vector kernels are mostly bound by
+ *             loads and stores rather than by the polynomials
+ *   EXACT     libm log10 and pow, the C kernels only; the reference;
+ *             2x as slow, qadrc_apply() alone 4-10x as slow
+ */
+enum { QADRC_PRECISION_BALANCED, QADRC_PRECISION_FAST, QADRC_PRECISION_EXACT };
+
+/*
+ * With envelope_step > 1, the smoothing runs once per block of that many
+ * samples, on the least and the mean gain of the block, and the coefficients
+ * are interpolated between the ends of the blocks; the scan option has no
+ * effect.  The gain stays within 0.03 dB of the full-rate one.  It is only
+ * qadrc_chew() that gets faster, about 3 times at 32: the levels are still
+ * converted to dB and through the gain computer by the sample, and
+ * qadrc_apply() still converts each coefficient back.
+ *
+ * With scan, both stages of the smoothing (the attack, a linear recurrence,
+ * and the release, with min in the recurrence) are computed as blocked scans
+ * instead of a serial loop over the samples.  The result is the same up to
+ * double rounding.
+ *
+ * With unlinked, each channel gets its own gain, computed from its own peak
+ * level, rather than all channels getting the gain computed from the peak
+ * level among them.  The coefficients are then interleaved, nc per sample,
+ * a[i*nc+c]; scan and envelope_step have no effect.
+ */
+
+#define QADRC_PARAMS_DEFAULT { -35, 1.5, 20, 20, 800, 10, -3, QADRC_PRECISION_BALANCED, false, 0, false }
+
+typedef struct qadrc qadrc;
+
+/* returns NULL on malloc failure */
+qadrc *qadrc_create(const struct qadrc_params *p, unsigned sample_rate,
+	unsigned nc, int fmt);
+void qadrc_destroy(qadrc *q);
+
+/* change thresh, ratio, knee, attack and release, the other parameters
+ * are ignored; the change takes effect with the next qadrc_chew(), which
+ * can run in another thread: the update does not lock or allocate */
+void qadrc_update(qadrc *q, const struct qadrc_params *p);
+
+/* the delay in samples */
+size_t qadrc_latency(const qadrc *q);
+
+/* the number of coefficients per sample, 1, or nc if unlinked */
+unsigned qadrc_width(const qadrc *q);
+
+/* process n input samples at offset off and fill a[] coefficients,
+ * n * width of them, which then must be applied to the samples delay
+ * samples earlier */
+void qadrc_chew(qadrc *q, float *const *data, size_t off, size_t n, float *a);
+
+/* apply the coefficients for n samples at offset off; a[] is clobbered;
+ * they can come from another qadrc with the same width, which analyzes
+ * another stream (a sidechain), and this one can then have zero delay */
+void qadrc_apply(qadrc *q, float *const *data, size_t off, float *a, size_t n);
+
+/* turn the coefficients for n samples from dB into linear gains, in place */
+void qadrc_scale(const qadrc *q, float *a, size_t n);
+
+/* true if qadrc_apply() would leave the samples as they are, because each
+ * of the n coefficients is so close to 0 dB that the gain rounds to 1.0f;
+ * the caller can then skip qadrc_apply(), and need not make data writable */
+bool qadrc_unity(const qadrc *q, const float *a, size_t n);
+
+/* the coefficient to be applied to the trailing samples after EOF */
+float qadrc_lasta(const qadrc *q);
+
+/* fill a[] with the coefficients for n trailing samples after EOF,
+ * which are the lasta of each channel if unlinked */
+void qadrc_fill_lasta(const qadrc *q, float *a, size_t n);
+
+/* Instruction sets for the chew/apply kernels.  qadrc_create() picks
+ * the best one the CPU supports; the reference build only has C. */
+enum { QADRC_ISA_C, QADRC_ISA_SSE2, QADRC_ISA_AVX2, QADRC_ISA_AVX512 };
+
+/* returns false if the instruction set is not supported */
+bool qadrc_set_isa(qadrc *q, int isa);
+int qadrc_get_isa(const qadrc *q);
+
+/* split qadrc_apply() into up to nb_threads jobs by the sample, unless
+ * unlinked; by default, or with NULL execute, it runs in the caller */
+void qadrc_set_threads(qadrc *q, qadrc_execute_fn execute, void *arg,
+	unsigned nb_threads);
+
+/* streaming interface */
+size_t qadrc_process(qadrc *q, float *const *data, size_t n);
+size_t qadrc_flush(qadrc *q, float *const *data, size_t n);
+
+/* write an apicker waveform, only with -DQADRC_WF=1 */
+void qadrc_waveform(qadrc *q, FILE *fp);
+
+/*
+ * mydrc - smooth compressor with a Gaussian gain filter;
+ * processes audio in frames of the analysis hop
+ */
+
+struct mydrc_params {
+    double thresh;	/* threshold, dB */
+    double ratio;	/* compression ratio */
+    double knee;	/* knee width, dB */
+    int filter_size;	/* Gaussian filter size, odd, in 100 ms frames */
+    int min_size;	/* min filter size, odd, in 100 ms frames */
+    int hop;		/* analysis hop, ms: 10, 20, 50, or 100 (also 0) */
+    double mix;		/* the weight of the parallel qadrc, 0 for none */
+    struct qadrc_params qadrc; /* the parallel qadrc, linked */
+};
+
+/*
+ * With mix > 0, qadrc runs in parallel, on the same input: its gain, with
+ * the weight mix, and mydrc's gain, with the weight 1 - mix, are added up
+ * and applied at once.  This is the same as splitting the input, running
+ * both compressors, and mixing their outputs (as amix does with mix = 0.5),
+ * but in one pass over the samples.  The qadrc delay is covered by mydrc's
+ * lookahead, unless it is longer.
+ *
+ * With a hop shorter than 100 ms, the gain is found, and ramped between,
+ * more often; the filters span the same time, and so the lookahead is
+ * the same.  Each filter costs the same per hop, whatever its size.
+ *
+ * The parallel qadrc takes floats only, and so mix > 0 is invalid with
+ * the DBL and DBLP layouts.
+ */
+
+#define MYDRC_PARAMS_DEFAULT { -35, 1.5, 20, 131, 11, 100, 0, QADRC_PARAMS_DEFAULT }
+
+typedef struct mydrc mydrc;
+
+/* returns NULL on malloc failure or invalid params */
+mydrc *mydrc_create(const struct mydrc_params *p, unsigned sample_rate,
+	unsigned nc, int fmt);
+void mydrc_destroy(mydrc *m);
+
+/* the frame size, the hop */
+size_t mydrc_frame_len(const mydrc *m);
+
+/* the number of frames held before the first one can be amplified */
+size_t mydrc_lookahead(const mydrc *m);
+
+/* The input is analyzed, and then amplified, in the same order, in chunks
+ * of any size; the frames of the hop are put together across the chunks,
+ * and the gain ramps across them. */
+
+/* analyze the next n <= frame_len samples, at offset off; the samples
+ * which become ready are to be amplified before the next call */
+void mydrc_analyze(mydrc *m, float *const *data, size_t off, size_t n);
+
+/* the number of analyzed samples which can be amplified, the next ones */
+size_t mydrc_ready(const mydrc *m);
+
+/* amplify the next n <= mydrc_ready() samples, at offset off */
+void mydrc_amplify(mydrc *m, float *const *data, size_t off, size_t n);
+
+/* on EOF, finish the analysis: all the samples become ready */
+void mydrc_finish(mydrc *m);
+
+/* split the high-pass and RMS into up to nb_threads jobs by the channel,
+ * in groups of four, and the gain multiply by the sample */
+void mydrc_set_threads(mydrc *m, qadrc_execute_fn execute, void *arg,
+	unsigned nb_threads);
+
+/* streaming interface */
+size_t mydrc_process(mydrc *m, float *const *data, size_t n);
+size_t mydrc_flush(mydrc *m, float *const *data, size_t n);
+
+/* write an apicker waveform */
+void mydrc_waveform(mydrc *m, FILE *fp);
+
+/* Write the gain of each frame to a gain file, as the gains are found.
+ * A later run over the same input can read them back instead of analyzing
+ * the input; it then has no lookahead (but for the parallel qadrc delay),
+ * and holds no frames.  Both are to be called before the first frame, and
+ * return false on a write error, or if the file is not a gain file for
+ * this frame length. */
+bool mydrc_write_gains(mydrc *m, FILE *fp);
+bool mydrc_read_gains(mydrc *m, FILE *fp);
+
+/* After mydrc_finish: the frames of the input, and the gains written to the
+ * gain file, or read from it (all of them, up to its end); false if they
+ * differ, that is, on a write error, or if the file read is truncated, or
+ * is not for this input.  Past the end of a short file, the last gain holds. */
+bool mydrc_gains_match(mydrc *m, size_t *frames, size_t *gains);
+
+/*
+ * qalimiter - stray spike limiter;
+ * holds the blocks of samples until each channel crosses zero
+ */
+
+typedef struct qalimiter qalimiter;
+
+/* Before a block is modified, the callback is given a chance to make
+ * it writable; it can replace the block's opaque pointer and should
+ * return the new data pointers, or NULL on failure. */
+typedef float *const *(*qalimiter_writable_fn)(void *arg, void **opaque);
+
+/* returns NULL on malloc failure or an unknown fmt; writable can be NULL */
+qalimiter *qalimiter_create(unsigned nc, int fmt,
+	qalimiter_writable_fn writable, void *arg);
+void qalimiter_destroy(qalimiter *l);
+
+/* queue a block, returns the number of leading blocks which are done,
+ * or -1 on malloc failure */
+int qalimiter_push(qalimiter *l, float *const *data, size_t n, void *opaque);
+
+/* on EOF, fix the remaining spikes; returns the number of blocks done */
+int qalimiter_finish(qalimiter *l);
+
+/* the number of queued blocks */
+size_t qalimiter_queued(const qalimiter *l);
+
+/* the opaque pointer of the i-th queued block */
+void *qalimiter_opaque(const qalimiter *l, size_t i);
+
+/* dequeue the leading blocks which are done */
+void qalimiter_release(qalimiter *l, size_t n);
+
+/* split the spike search and fix into up to nb_threads jobs by the channel;
+ * the writable callback is then called from the caller's thread only,
+ * for the blocks from the earliest one with a spike, before the jobs */
+void qalimiter_set_threads(qalimiter *l, qadrc_execute_fn execute, void *arg,
+	unsigned nb_threads);
+
+/* Bound the latency: a channel which has not crossed zero for more than
+ * samples, or all channels once blocks are queued, are cut at the end of
+ * the last block as if they crossed zero there.  With a limit on the blocks,
+ * the queue is a ring of fixed size, and push fails if the blocks which are
+ * done are not released; without one, it grows to the blocks the samples
+ * take.  Zero means no limit, which is the default.  To be called before
+ * the first push; returns false on malloc failure. */
+bool qalimiter_set_max_latency(qalimiter *l, size_t samples, size_t blocks);
+
+/* Scale the blocks by gain (1 by default) as they are pushed, in the same
+ * pass as the check for the peaks; with a gain other than 1, the blocks
+ * are made writable first. */
+void qalimiter_set_gain(qalimiter *l, double gain);
+
+/* Convert n samples of a block which is done, in the limiter's layout,
+ * to the integer layout ofmt, with TPDF dither of one LSB and clipping;
+ * returns false if ofmt is not an integer layout. */
+bool qalimiter_quantize(qalimiter *l, void *const *out, int ofmt,
+	float *const *in, size_t n);
+
+/* streaming interface */
+size_t qalimiter_process(qalimiter *l, float *const *data, size_t n);
+size_t qalimiter_flush(qalimiter *l, float *const *data, size_t n);
+
+#endif
@@ -0,0 +1,1271 @@
+/*
+ * mydrc - smooth compressor / dynamic normalizer
+ *
+ * Written by Alexey Tourbin.
+ * Based on Dynamic Audio Normalizer by LoRd_MuldeR.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include "libqadrc.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define PACKED(fmt) ((fmt) == QADRC_FLT || (fmt) == QADRC_DBL)
+#define DOUBLE(fmt) ((fmt) == QADRC_DBL || (fmt) == QADRC_DBLP)
+
+// The sample loops take the layout as a constant, the last argument,
+// and are instantiated for each one.
+#define MYDRC_FMT(f, fmt, ...) \
+    ((fmt) == QADRC_FLT ? f(__VA_ARGS__, QADRC_FLT) : \
+     (fmt) == QADRC_DBL ? f(__VA_ARGS__, QADRC_DBL) : \
+     (fmt) == QADRC_DBLP ? f(__VA_ARGS__, QADRC_DBLP) : f(__VA_ARGS__, QADRC_FLTP))
+
+// The high-pass filter runs on HI_LANES channels at once, as the lanes
+// of a vector; its state is kept for the channels rounded up to that.
+#define HI_LANES 4
+typedef double hi_vec __attribute__((vector_size(HI_LANES * sizeof(double))));
+
+// the least number of samples for which the gain multiply is split
+#define JOB_MIN 512
+
+typedef struct cqueue {
+    double *elements;
+    int size;
+    int nb_elements;
+    int first;
+    double sum;
+} cqueue;
+
+// The running minimum over a sliding window, as a monotonic deque:
+// the values which can yet become the minimum, increasing from the front,
+// each with the number of the push which has brought it in.
+typedef struct minq {
+    double *val;
+    size_t *seq;
+    int size;
+    int first;
+    int n;
+    size_t next;
+} minq;
+
+// A box filter, the running mean of the last w values.
+typedef struct box {
+    double *ring;
+    int w;
+    int pos;
+    double sum;
+} box;
+
+// The gain ramps linearly from the previous factor to the current one
+// over the frame, and is taken in the middle of each sample: the i-th
+// sample gets prev + (i + 0.5) * step.  (The last small frame ramps
+// at the same rate, and stops short of the current factor.)
+struct ramp {
+    double prev, step;
+};
+
+struct mydrc {
+    unsigned nc;
+    int fmt;
+    // the buffers per frame, and the bytes per sample in each
+    unsigned nbufs;
+    size_t width;
+    int frame_len;
+    int wf_len;
+    int rms_size;
+    int min_size;
+    int filter_size;
+
+    double prev_rms_sum;
+    double prev_amplification_factor;
+
+    // For each input frame (100 ms, or the hop), its (partial) RMS sum is
+    // first computed.  It then undergoes the three stages of filtering,
+    // until the final gain is known and applied to the frame:
+    // 1) 400 ms RMS out of 4 partial sums (or more, with a shorter hop)
+    // is computed; these 400 ms intervals are overlapping, as per EBU R128
+    // (and so the data from 4 frames should take its full effect at the end
+    // of the second frame).
+    // 2) For each RMS value, the gain is computed, and the minimum is taken
+    // among a few adjacent gain values. (This is to cope better with short and
+    // sudden bursts.)
+    // 3) The resulting gain curve is smoothed with the Gaussian filter,
+    // approximated by three box filters in a row.
+    // Each stage costs the same per frame, however long its window is.
+    cqueue *gain_rms;
+    cqueue *gain_min;
+    cqueue *gain_smooth;
+    minq min;
+    box boxes[3];
+    int box_len;
+    bool smooth_once;
+    double smooth_dB;
+
+    int flush_state;
+    int flush_fill;
+    double *flush_buf;
+
+    // gain computer
+    double thresh;
+    double Tlo;
+    double Thi;
+    double slope;
+    double knee_factor;
+
+    // highpass filter, and the square sums of the channels over the frame
+    // being analyzed, frame_pos samples into it
+    double hi_a;
+    double *hi_x;
+    double *hi_y;
+    double *hi_sum;
+    bool hi_once;
+    size_t frame_pos;
+
+    // the jobs, one if threads <= 1
+    qadrc_execute_fn execute;
+    void *exec_arg;
+    unsigned threads;
+
+    // The input is analyzed and amplified by the sample, and the frames
+    // of the hop are put together across the calls: the samples [0, analyzed)
+    // have been analyzed, and [0, amplified) amplified, amp_pos samples
+    // into the frame, with the ramp.  The gains have been found for
+    // the first known frames; the pending ones of them are yet to be
+    // amplified, and the gains wait in a ring of psize, from phead.
+    size_t analyzed;
+    size_t amplified;
+    size_t known;
+    size_t amp_pos;
+    struct ramp ramp;
+    double *pfactors;
+    size_t psize;
+    size_t phead;
+    size_t pending;
+    bool finished;
+
+    // parallel qadrc: its coefficients, in dB, by the sample, in a ring
+    // of qsize; the samples [amplified, qready) have them
+    qadrc *q;
+    double mix;
+    float *qring;
+    size_t qsize;
+    size_t qchewed;
+    size_t qready;
+    float *gbuf;
+    double wf_sum;
+
+    // streaming interface: a ring of nblocks frames, of frame_len samples
+    // in the input layout; frames [amp_blk, in_blk) await amplification,
+    // frames [out_blk, amp_blk) are ready for output, and in_blk is being
+    // filled with in_pos samples; the buffer pointers of the block being
+    // filled, and of the other one
+    float *blocks;
+    float **in_ptrs;
+    float **out_ptrs;
+    size_t nblocks;
+    size_t in_blk, in_pos;
+    size_t amp_blk;
+    size_t out_blk, out_pos;
+    size_t last_len;
+    bool eof;
+
+    // gain files: the gains of the frames are written out as they are found,
+    // or read in instead of analyzing the frames; the gains which have been
+    // written or read
+    FILE *gain_out;
+    FILE *gain_in;
+    double last_gain;
+    size_t gains;
+
+    // waveform
+    FILE *wf_fp;
+};
+
+static cqueue *cqueue_create(int size)
+{
+    cqueue *q;
+
+    q = malloc(sizeof(cqueue));
+    if (!q)
+        return NULL;
+
+    q->size = size;
+    q->nb_elements = 0;
+    q->first = 0;
+    q->sum = 0;
+
+    q->elements = malloc(sizeof(double) * size);
+    if (!q->elements) {
+        free(q);
+        return NULL;
+    }
+
+    return q;
+}
+
+static void cqueue_free(cqueue *q)
+{
+    if (!q)
+	return;
+    free(q->elements);
+    free(q);
+}
+
+static int cqueue_size(cqueue *q)
+{
+    return q->nb_elements;
+}
+
+static int cqueue_empty(cqueue *q)
+{
+    return !q->nb_elements;
+}
+
+static int cqueue_enqueue(cqueue *q, double element)
+{
+    int i;
+
+    assert(q->nb_elements != q->size);
+
+    i = (q->first + q->nb_elements) % q->size;
+    q->elements[i] = element;
+    q->nb_elements++;
+    q->sum += element;
+
+    return 0;
+}
+
+static double cqueue_peek(cqueue *q, int index)
+{
+    assert(index < q->nb_elements);
+    return q->elements[(q->first + index) % q->size];
+}
+
+static double *cqueue_peekp(cqueue *q, int index)
+{
+    assert(index < q->nb_elements);
+    return &q->elements[(q->first + index) % q->size];
+}
+
+static int cqueue_pop(cqueue *q)
+{
+    assert(!cqueue_empty(q));
+
+    q->sum -= q->elements[q->first];
+    q->first = (q->first + 1) % q->size;
+    q->nb_elements--;
+
+    // recompute the sum once in a while, lest the rounding errors accumulate
+    if (q->first == 0) {
+	q->sum = 0;
+	for (int i = 0; i < q->nb_elements; i++)
+	    q->sum += q->elements[i];
+    }
+
+    return 0;
+}
+
+static void minq_push(minq *m, double val)
+{
+    // the front leaves the window
+    if (m->n && m->seq[m->first] + m->size <= m->next) {
+	m->first = (m->first + 1) % m->size;
+	m->n--;
+    }
+    // the values not less than the new one can no longer become the minimum
+    while (m->n && m->val[(m->first + m->n - 1) % m->size] >= val)
+	m->n--;
+    int i = (m->first + m->n) % m->size;
+    m->val[i] = val;
+    m->seq[i] = m->next++;
+    m->n++;
+}
+
+static double box_push(box *b, double val)
+{
+    b->sum += val - b->ring[b->pos];
+    b->ring[b->pos] = val;
+    if (++b->pos == b->w) {
+	b->pos = 0;
+	b->sum = 0;
+	for (int i = 0; i < b->w; i++)
+	    b->sum += b->ring[i];
+    }
+    return b->sum / b->w;
+}
+
+// Three box filters in a row make a Gaussian of the same variance, within
+// a few per cent, their widths being the odd numbers around the ideal width
+// (W. Wells, "Efficient synthesis of Gaussian filters by cascaded uniform
+// filters", 1986).  The sigma is the one of the former Gaussian weights,
+// which spanned the filter size as +/- 3 sigma; the boxes span no more.
+static void init_gaussian_filter(mydrc *s)
+{
+    const int n = 3;
+    const double sigma = (((s->filter_size / 2.0) - 1.0) / 3.0) + (1.0 / 3.0);
+    const double var12 = 12 * sigma * sigma;
+    int wl = sqrt(var12 / n + 1);
+    if (!(wl & 1))
+	wl--;
+    int m = lround((var12 - n * wl * wl - 4 * n * wl - 3 * n) / (-4 * wl - 4));
+
+    s->box_len = 1;
+    for (int i = 0; i < n; i++) {
+	s->boxes[i].w = i < m ? wl : wl + 2;
+	s->box_len += s->boxes[i].w - 1;
+    }
+    assert(s->box_len <= s->filter_size);
+}
+
+static inline int frame_size(int sample_rate, int hop)
+{
+    return sample_rate * hop / 1000.0 + 0.5;
+}
+
+mydrc *mydrc_create(const struct mydrc_params *p, unsigned sample_rate,
+	unsigned nc, int fmt)
+{
+    if (!(p->filter_size & 1) || !(p->min_size & 1))
+	return NULL;
+    if (nc == 0)
+	return NULL;
+    if (fmt < QADRC_FLT || fmt > QADRC_DBLP || (DOUBLE(fmt) && p->mix > 0))
+	return NULL;
+    int hop = p->hop ? p->hop : 100;
+    if (hop % 10 || 100 % hop)
+	return NULL;
+
+    mydrc *s = calloc(1, sizeof *s);
+    if (!s)
+	return NULL;
+
+    // the filter sizes are in 100 ms frames, and span the same time
+    // with a shorter hop
+    int k = 100 / hop;
+    s->nc = nc;
+    s->fmt = fmt;
+    s->nbufs = PACKED(fmt) ? 1 : nc;
+    s->width = (PACKED(fmt) ? nc : 1) * (DOUBLE(fmt) ? sizeof(double) : sizeof(float));
+    s->rms_size = 4 * k;
+    s->filter_size = (p->filter_size - 1) * k + 1;
+    s->min_size = (p->min_size - 1) * k + 1;
+
+    s->thresh = p->thresh;
+    s->slope = (1.0 - p->ratio) / p->ratio;
+    s->Tlo = p->thresh - p->knee / 2.0;
+    s->Thi = p->thresh + p->knee / 2.0;
+    s->knee_factor = s->slope / (p->knee * 2.0);
+
+    int hz = 100;
+    double RC = 1 / (2 * M_PI * hz);
+    s->hi_a = RC / (RC + 1.0 / sample_rate);
+
+    s->frame_len = frame_size(sample_rate, hop);
+    // apicker waveform uses 10 ms intervals
+    s->wf_len = s->frame_len / (hop / 10);
+    s->prev_rms_sum = -1;
+    init_gaussian_filter(s);
+
+    size_t hi_nc = (nc + HI_LANES - 1) / HI_LANES * HI_LANES;
+    s->hi_x = calloc(3 * hi_nc, sizeof(double));
+    s->in_ptrs = malloc(2 * nc * sizeof(float *));
+    if (!s->hi_x || !s->in_ptrs) {
+	mydrc_destroy(s);
+	return NULL;
+    }
+    s->hi_y = s->hi_x + hi_nc;
+    s->hi_sum = s->hi_y + hi_nc;
+    s->out_ptrs = s->in_ptrs + nc;
+
+    s->flush_buf = malloc(MAX(s->min_size, s->filter_size) / 2 * sizeof(double));
+    s->gain_rms = cqueue_create(s->rms_size); // 400 ms
+    s->gain_min = cqueue_create(s->min_size);
+    s->gain_smooth = cqueue_create(s->filter_size);
+    s->min.size = s->min_size;
+    s->min.val = malloc(s->min_size * sizeof(double));
+    s->min.seq = malloc(s->min_size * sizeof(size_t));
+    s->boxes[0].ring = calloc(s->box_len + 2, sizeof(double));
+    if (!s->flush_buf || !s->gain_rms || !s->gain_min || !s->gain_smooth ||
+	    !s->min.val || !s->min.seq || !s->boxes[0].ring) {
+	mydrc_destroy(s);
+	return NULL;
+    }
+    s->boxes[1].ring = s->boxes[0].ring + s->boxes[0].w;
+    s->boxes[2].ring = s->boxes[1].ring + s->boxes[1].w;
+
+    if (p->mix > 0) {
+	struct qadrc_params qp = p->qadrc;
+	qp.unlinked = false;
+	s->mix = p->mix;
+	s->q = qadrc_create(&qp, sample_rate, nc, fmt);
+	// from the oldest unamplified frame through the lookahead,
+	// the frame being analyzed, and the last small frame
+	s->qsize = (mydrc_lookahead(s) + 3) * s->frame_len;
+	s->qring = malloc(s->qsize * sizeof(float));
+	s->gbuf = malloc(s->frame_len * sizeof(float));
+	if (!s->q || !s->qring || !s->gbuf) {
+	    mydrc_destroy(s);
+	    return NULL;
+	}
+    }
+
+    // the frames whose gains are found, up to the lookahead,
+    // the frame being amplified, and the frame being analyzed
+    s->psize = mydrc_lookahead(s) + 3;
+    s->pfactors = malloc(s->psize * sizeof(double));
+    if (!s->pfactors) {
+	mydrc_destroy(s);
+	return NULL;
+    }
+
+    return s;
+}
+
+void mydrc_destroy(mydrc *s)
+{
+    if (!s)
+	return;
+
+    cqueue_free(s->gain_rms);
+    cqueue_free(s->gain_min);
+    cqueue_free(s->gain_smooth);
+    free(s->min.val);
+    free(s->min.seq);
+    free(s->boxes[0].ring);
+    free(s->hi_x);
+
+    free(s->flush_buf);
+    free(s->blocks);
+    free(s->in_ptrs);
+    qadrc_destroy(s->q);
+    free(s->qring);
+    free(s->pfactors);
+    free(s->gbuf);
+    free(s);
+}
+
+size_t mydrc_frame_len(const mydrc *s)
+{
+    return s->frame_len;
+}
+
+size_t mydrc_lookahead(const mydrc *s)
+{
+    // the 400 ms RMS filter delays by 200 ms, see update_cqueue();
+    // the gains from the gain file need no lookahead
+    size_t n = s->gain_in ? 0 : s->rms_size / 2 + s->min_size / 2 + s->filter_size / 2;
+    // the parallel qadrc may delay by more
+    if (s->q) {
+	size_t d = (qadrc_latency(s->q) + s->frame_len - 1) / s->frame_len;
+	n = MAX(n, d);
+    }
+    return n;
+}
+
+void mydrc_set_threads(mydrc *s, qadrc_execute_fn execute, void *arg,
+	unsigned nb_threads)
+{
+    s->execute = execute;
+    s->exec_arg = arg;
+    s->threads = execute ? nb_threads : 1;
+}
+
+void mydrc_waveform(mydrc *s, FILE *fp)
+{
+    s->wf_fp = fp;
+}
+
+// the gain file starts with the magic and the frame length, then follow
+// the linear gains of the frames, as doubles, in the host byte order
+#define GAIN_MAGIC "MYG1"
+
+bool mydrc_write_gains(mydrc *s, FILE *fp)
+{
+    uint32_t frame_len = s->frame_len;
+    if (fwrite(GAIN_MAGIC, 4, 1, fp) != 1 ||
+	    fwrite(&frame_len, sizeof frame_len, 1, fp) != 1)
+	return false;
+    s->gain_out = fp;
+    return true;
+}
+
+bool mydrc_read_gains(mydrc *s, FILE *fp)
+{
+    char magic[4];
+    uint32_t frame_len;
+    if (fread(magic, 4, 1, fp) != 1 || memcmp(magic, GAIN_MAGIC, 4) ||
+	    fread(&frame_len, sizeof frame_len, 1, fp) != 1 ||
+	    frame_len != (uint32_t) s->frame_len)
+	return false;
+    s->gain_in = fp;
+    s->last_gain = 1;
+    return true;
+}
+
+bool mydrc_gains_match(mydrc *s, size_t *frames, size_t *gains)
+{
+    assert(s->finished);
+    if (s->gain_in) {
+	// the gains left over
+	double factor;
+	while (fread(&factor, sizeof factor, 1, s->gain_in) == 1)
+	    s->gains++;
+    }
+    if (s->gain_out && fflush(s->gain_out) != 0)
+	s->gains = 0;
+    *frames = s->known;
+    *gains = s->gains;
+    return s->gains == s->known;
+}
+
+// the i-th sample of channel c
+static inline __attribute__((always_inline))
+double sample(float *const *data, unsigned nc, unsigned c, size_t i, const int fmt)
+{
+    const void *x = data[PACKED(fmt) ? 0 : c];
+    size_t k = PACKED(fmt) ? i * nc + c : i;
+    return DOUBLE(fmt) ? ((const double *) x)[k] : ((const float *) x)[k];
+}
+
+// the high-pass filter and the square sums of HI_LANES channels from c0,
+// the lanes past the last channel repeat channel c0 and are ignored
+static inline __attribute__((always_inline))
+void rms_sum_lanes(mydrc *s, float *const *data, size_t off, unsigned c0,
+		   int ns, const int fmt)
+{
+    const unsigned nc = s->nc;
+    unsigned ch[HI_LANES];
+    for (unsigned k = 0; k < HI_LANES; k++)
+	ch[k] = c0 + k < nc ? c0 + k : c0;
+
+    hi_vec x0, y0, sum;
+    memcpy(&x0, s->hi_x + c0, sizeof x0);
+    memcpy(&y0, s->hi_y + c0, sizeof y0);
+    memcpy(&sum, s->hi_sum + c0, sizeof sum);
+    const double a = s->hi_a;
+
+    for (size_t i = off; i < off + ns; i++) {
+	hi_vec x1 = {
+	    sample(data, nc, ch[0], i, fmt), sample(data, nc, ch[1], i, fmt),
+	    sample(data, nc, ch[2], i, fmt), sample(data, nc, ch[3], i, fmt),
+	};
+	hi_vec y1 = a * (y0 + x1 - x0);
+	sum += y1 * y1;
+	x0 = x1;
+	y0 = y1;
+    }
+
+    memcpy(s->hi_x + c0, &x0, sizeof x0);
+    memcpy(s->hi_y + c0, &y0, sizeof y0);
+    memcpy(s->hi_sum + c0, &sum, sizeof sum);
+}
+
+// the groups of HI_LANES channels are independent, each job gets
+// its share of them
+struct rms_job {
+    mydrc *s;
+    float *const *data;
+    size_t off;
+    int ns;
+};
+
+static void rms_job(void *arg, unsigned jobnr, unsigned nb_jobs)
+{
+    struct rms_job *j = arg;
+    mydrc *s = j->s;
+    unsigned groups = (s->nc + HI_LANES - 1) / HI_LANES;
+    unsigned end = groups * (jobnr + 1) / nb_jobs;
+    for (unsigned g = groups * jobnr / nb_jobs; g < end; g++)
+	MYDRC_FMT(rms_sum_lanes, s->fmt, s, j->data, j->off, g * HI_LANES, j->ns);
+}
+
+// add ns samples at offset off to the square sums of the frame
+static void add_rms_sums(mydrc *s, float *const *data, size_t off, int ns)
+{
+    unsigned nc = s->nc;
+
+    if (!s->hi_once) {
+	for (unsigned c = 0; c < nc; c++)
+	    s->hi_x[c] = s->hi_y[c] = MYDRC_FMT(sample, s->fmt, data, nc, c, off);
+	s->hi_once = true;
+    }
+
+    struct rms_job j = { s, data, off, ns };
+    unsigned groups = (nc + HI_LANES - 1) / HI_LANES;
+    if (s->threads > 1 && groups > 1)
+	s->execute(s->exec_arg, rms_job, &j, MIN(groups, s->threads));
+    else
+	rms_job(&j, 0, 1);
+}
+
+// the square sum of the frame of nb_samples, which starts the next one
+static double get_frame_rms_sum(mydrc *s, int nb_samples)
+{
+    double sum = 0;
+    for (unsigned c = 0; c < s->nc; c++) {
+	sum += s->hi_sum[c];
+	s->hi_sum[c] = 0;
+    }
+
+    if (nb_samples == s->frame_len)
+	s->prev_rms_sum = sum;
+    else {
+	// resacle the last small frame
+	sum = sum * s->frame_len / nb_samples;
+	// average with the previous frame
+	int missing = s->frame_len - nb_samples;
+	assert(missing > 0);
+	if (s->prev_rms_sum >= 0)
+	    sum = (nb_samples * sum + missing * s->prev_rms_sum) / s->frame_len;
+    }
+    return sum;
+}
+
+static double rms_filter(cqueue *q, int frame_len)
+{
+    int qn = cqueue_size(q);
+    double mean = MAX(q->sum / (qn * frame_len), DBL_EPSILON);
+    // 10*log10 instead of 20*log10 amounts for sqrt
+    return 10 * log10(mean);
+}
+
+// Both filters are called when the queue is full: the first time, they take
+// the whole queue, mirrored by update_cqueue(); then, only the new element.
+static double min_filter(mydrc *s, cqueue *q)
+{
+    int qn = cqueue_size(q);
+    if (s->min.next == 0) {
+	for (int i = 0; i < qn - 1; i++)
+	    minq_push(&s->min, cqueue_peek(q, i));
+    }
+    minq_push(&s->min, cqueue_peek(q, qn - 1));
+    return s->min.val[s->min.first];
+}
+
+// The boxes, centered on the middle of the queue, take box_len elements
+// of it; the newest of them is box_len / 2 past the middle.
+static double smooth_filter(mydrc *s, cqueue *q)
+{
+    int mid = cqueue_size(q) / 2;
+    int half = s->box_len / 2;
+    double x;
+    if (!s->smooth_once) {
+	for (int i = mid - half; i < mid + half; i++) {
+	    x = cqueue_peek(q, i);
+	    for (int j = 0; j < 3; j++)
+		x = box_push(&s->boxes[j], x);
+	}
+	s->smooth_once = true;
+    }
+    x = cqueue_peek(q, mid + half);
+    for (int j = 0; j < 3; j++)
+	x = box_push(&s->boxes[j], x);
+    return x;
+}
+
+static bool update_cqueue(cqueue *q, double val)
+{
+    int qn = cqueue_size(q);
+    int filter_size = q->size;
+    // Normally, we just pop the oldest element and push the new one.
+    if (qn == filter_size) {
+	cqueue_pop(q);
+	cqueue_enqueue(q, val);
+	return true;
+    }
+
+    assert(qn < filter_size);
+
+    // First-time push: pad with the preceding virtual elements,
+    // e.g. [0] and [1] for n=5, before adding the middle element [2].
+    //
+    // The even case (e.g. n=4) is special, and is designed to assist 400 ms
+    // RMS averaging.  When the 4th 100 ms element is queued, it should produce
+    // the second RMS element.  This requires one preceding virtual element.
+    //
+    //     100 ms input      [0]        [1]           [2]           [3]
+    //     queue          [0][0]  [0][0][1]  [2][0][1][2]  [3][0][1][2]
+    //     400 ms RMS      ^                 [0]           [1]
+    //                     |
+    //                     `- this will be mirrored with [2], see below
+    //
+    // This makes sense, because the RMS level of [0][1][2][3] should take
+    // its full effect at the end of the [1] input frame.
+    if (qn == 0) {
+	for (int i = 0; i < (filter_size - 1) / 2 + 1; i++)
+	    cqueue_enqueue(q, val);
+	return false;
+    }
+
+    // More elements until the queue is full.
+    cqueue_enqueue(q, val);
+    if (++qn < filter_size)
+	return false;
+
+    // The queue is full for the first time.
+    // Mirror elements, e.g. [4] and [3] into [0] and [1].
+    for (int i = 0; i < (filter_size - 1) / 2; i++) {
+	double *p = cqueue_peekp(q, i);
+	double val = cqueue_peek(q, filter_size - i - 1);
+	q->sum += val - *p;
+	*p = val;
+    }
+    return true;
+}
+
+static inline double dB_to_scale(double dB)
+{
+    return pow(10, 0.05 * dB);
+}
+
+static double compute_gain(mydrc *s, double x)
+{
+    if (x < s->Tlo)
+        return 0.0;
+    else if (x > s->Thi)
+        return s->slope * (x - s->thresh);
+    else {
+        double delta = x - s->Tlo;
+        return delta * delta * s->knee_factor;
+    }
+}
+
+static bool push_to_smooth(mydrc *s, double gain_dB)
+{
+    bool ret = update_cqueue(s->gain_smooth, gain_dB);
+    if (ret)
+	s->smooth_dB = smooth_filter(s, s->gain_smooth);
+    return ret;
+}
+
+static bool push_to_min(mydrc *s, double gain_dB)
+{
+    bool ret = update_cqueue(s->gain_min, gain_dB);
+    if (ret) {
+	double min = min_filter(s, s->gain_min);
+	ret = push_to_smooth(s, min);
+    }
+    return ret;
+}
+
+static bool push_rms_sum(mydrc *s, double sum)
+{
+    bool ret = update_cqueue(s->gain_rms, sum);
+    if (ret) {
+	double vol_dB = rms_filter(s->gain_rms, s->frame_len);
+	double gain_dB = compute_gain(s, vol_dB);
+	ret = push_to_min(s, gain_dB);
+    }
+    return ret;
+}
+
+// copy n coefficients between the ring, at sample pos, and a[]
+static void qring_copy(mydrc *s, size_t pos, float *a, size_t n, bool to_ring)
+{
+    size_t i = pos % s->qsize;
+    size_t len = MIN(n, s->qsize - i);
+    float *r = s->qring + i;
+    if (to_ring) {
+	memcpy(r, a, len * sizeof(float));
+	memcpy(s->qring, a + len, (n - len) * sizeof(float));
+    }
+    else {
+	memcpy(a, r, len * sizeof(float));
+	memcpy(a + len, s->qring, (n - len) * sizeof(float));
+    }
+}
+
+// run qadrc over n samples at offset off, n <= frame_len; its coefficients
+// apply to the samples delay samples earlier, and the first delay of them
+// to "pre-input"
+static void chew_parallel(mydrc *s, float *const *data, size_t off, size_t n)
+{
+    float *a = s->gbuf;
+    qadrc_chew(s->q, data, off, n, a);
+    size_t D = qadrc_latency(s->q);
+    size_t skip = s->qchewed < D ? MIN(D - s->qchewed, n) : 0;
+    s->qchewed += n;
+    qring_copy(s, s->qready, a + skip, n - skip, true);
+    s->qready += n - skip;
+}
+
+// the gain for the next frame, found by the filters or read from the gain
+// file; past the end of the file, the last gain holds, see mydrc_gains_match()
+static double frame_factor(mydrc *s)
+{
+    double factor;
+    if (s->gain_in) {
+	if (fread(&factor, sizeof factor, 1, s->gain_in) == 1) {
+	    s->last_gain = factor;
+	    s->gains++;
+	}
+	factor = s->last_gain;
+    }
+    else
+	factor = dB_to_scale(s->smooth_dB);
+    if (s->gain_out && fwrite(&factor, sizeof factor, 1, s->gain_out) == 1)
+	s->gains++;
+    return factor;
+}
+
+// the gain that mydrc has found for the next frame waits for amplification
+static void push_pending(mydrc *s)
+{
+    assert(s->pending < s->psize);
+    double factor = frame_factor(s);
+    s->pfactors[(s->phead + s->pending) % s->psize] = factor;
+    s->pending++;
+    s->known++;
+}
+
+// a frame of nb_samples has been analyzed
+static void end_frame(mydrc *s, int nb_samples)
+{
+    bool ready = true;
+    if (!s->gain_in) {
+	const double rms_sum = get_frame_rms_sum(s, nb_samples);
+	ready = push_rms_sum(s, rms_sum);
+    }
+    if (ready)
+	push_pending(s);
+}
+
+void mydrc_analyze(mydrc *s, float *const *data, size_t off, size_t n)
+{
+    assert(!s->finished && n <= (size_t) s->frame_len);
+    while (n) {
+	size_t m = MIN(n, s->frame_len - s->frame_pos);
+	if (!s->gain_in)
+	    add_rms_sums(s, data, off, m);
+	if (s->q)
+	    chew_parallel(s, data, off, m);
+	s->analyzed += m;
+	s->frame_pos += m;
+	if (s->frame_pos == (size_t) s->frame_len) {
+	    end_frame(s, s->frame_len);
+	    s->frame_pos = 0;
+	}
+	off += m;
+	n -= m;
+    }
+}
+
+size_t mydrc_ready(const mydrc *s)
+{
+    size_t end = MIN(s->known * s->frame_len, s->analyzed);
+    if (s->q)
+	end = MIN(end, s->qready);
+    return end - s->amplified;
+}
+
+static struct ramp frame_ramp(mydrc *s, double current_amplification_factor)
+{
+    if (s->prev_amplification_factor == 0)
+	s->prev_amplification_factor = current_amplification_factor;
+    double prev = s->prev_amplification_factor;
+    s->prev_amplification_factor = current_amplification_factor;
+    return (struct ramp) { prev, (current_amplification_factor - prev) / s->frame_len };
+}
+
+// the mean gain of each 10 ms interval, which is that of its middle,
+// for the intervals which end in (pos, pos + n]
+static void ramp_waveform(mydrc *s, struct ramp r, int pos, int n)
+{
+    int cnt_max = s->wf_len;
+    // need a whole number of 10 ms intervals in a frame
+    assert(s->frame_len % cnt_max == 0);
+    for (int i = pos / cnt_max * cnt_max; i + cnt_max <= pos + n; i += cnt_max) {
+	double mean = r.prev + (i + cnt_max / 2.0) * r.step;
+	unsigned char c = mean * 255 + 0.5;
+	putc_unlocked(c, s->wf_fp);
+    }
+}
+
+// multiply the i-th sample of each channel at offset off by g[i], or,
+// without g, by start + (pos + i) * step; the ramp is computed in the
+// precision of the samples
+static inline __attribute__((always_inline))
+void apply_gain(float *const *data, unsigned nc, size_t off, int n,
+		double start, double step, int pos, const float *g, const int fmt)
+{
+    const float fstart = start, fstep = step;
+#define GAIN(i) (g ? g[i] : fstart + ((i) + pos) * fstep)
+#define GAIN_DBL(i) (g ? g[i] : start + ((i) + pos) * step)
+    if (PACKED(fmt)) {
+	for (int i = 0; i < n; i++) {
+	    if (DOUBLE(fmt)) {
+		const double gi = GAIN_DBL(i);
+		double *x = (double *) data[0] + (off + i) * nc;
+		for (unsigned c = 0; c < nc; c++)
+		    x[c] *= gi;
+	    }
+	    else {
+		const float gi = GAIN(i);
+		float *x = data[0] + (off + i) * nc;
+		for (unsigned c = 0; c < nc; c++)
+		    x[c] *= gi;
+	    }
+	}
+	return;
+    }
+    for (unsigned c = 0; c < nc; c++) {
+	if (DOUBLE(fmt)) {
+	    double *x = (double *) data[c] + off;
+	    for (int i = 0; i < n; i++)
+		x[i] *= GAIN_DBL(i);
+	}
+	else {
+	    float *x = data[c] + off;
+	    for (int i = 0; i < n; i++)
+		x[i] *= GAIN(i);
+	}
+    }
+#undef GAIN
+#undef GAIN_DBL
+}
+
+// the gain multiply, split by the sample
+struct gain_job {
+    mydrc *s;
+    float *const *data;
+    size_t off;
+    int n;
+    double start, step;
+    int pos;
+    const float *g;
+};
+
+static void gain_job(void *arg, unsigned jobnr, unsigned nb_jobs)
+{
+    struct gain_job *j = arg;
+    int i = (size_t) j->n * jobnr / nb_jobs;
+    int end = (size_t) j->n * (jobnr + 1) / nb_jobs;
+    MYDRC_FMT(apply_gain, j->s->fmt, j->data, j->s->nc, j->off + i, end - i,
+	    j->start, j->step, j->pos + i, j->g ? j->g + i : NULL);
+}
+
+static void gain(mydrc *s, float *const *data, size_t off, int n,
+		 double start, double step, int pos, const float *g)
+{
+    struct gain_job j = { s, data, off, n, start, step, pos, g };
+    if (s->threads > 1 && n >= 2 * JOB_MIN)
+	s->execute(s->exec_arg, gain_job, &j, MIN(n / JOB_MIN, s->threads));
+    else
+	gain_job(&j, 0, 1);
+}
+
+// amplify n samples at offset off, pos samples into the frame
+static void amplify_by_ramp(mydrc *s, float *const *data, size_t off, int n, int pos)
+{
+    struct ramp r = s->ramp;
+    const double start = r.prev + 0.5 * r.step;
+    const double step = r.step;
+
+    gain(s, data, off, n, start, step, pos, NULL);
+
+    if (s->wf_fp)
+	ramp_waveform(s, r, pos, n);
+}
+
+// mix the two gains, then apply them to all channels
+static void amplify_parallel(mydrc *s, float *const *data, size_t off, int n, int pos)
+{
+    struct ramp r = s->ramp;
+    float *g = s->gbuf;
+    qring_copy(s, s->amplified, g, n, false);
+    qadrc_scale(s->q, g, n);
+    const float mq = s->mix, mm = 1 - s->mix;
+    const float start = mm * (r.prev + 0.5 * r.step);
+    const float step = mm * r.step;
+    for (int i = 0; i < n; i++)
+	g[i] = mq * g[i] + start + (i + pos) * step;
+
+    gain(s, data, off, n, 0, 0, 0, g);
+
+    if (s->wf_fp) {
+	// the 10 ms intervals are summed up across the calls
+	int cnt_max = s->wf_len;
+	for (int i = 0; i < n; i++) {
+	    s->wf_sum += g[i];
+	    if ((pos + i + 1) % cnt_max == 0) {
+		unsigned char c = s->wf_sum / cnt_max * 255 + 0.5;
+		putc_unlocked(c, s->wf_fp);
+		s->wf_sum = 0;
+	    }
+	}
+    }
+}
+
+void mydrc_amplify(mydrc *s, float *const *data, size_t off, size_t n)
+{
+    assert(n <= mydrc_ready(s));
+    while (n) {
+	if (s->amp_pos == 0) {
+	    // a new frame, its gain has been found
+	    assert(s->pending > 0);
+	    double factor = s->pfactors[s->phead];
+	    s->phead = (s->phead + 1) % s->psize;
+	    s->pending--;
+	    s->ramp = frame_ramp(s, factor);
+	    s->wf_sum = 0;
+	}
+	size_t m = MIN(n, s->frame_len - s->amp_pos);
+	if (s->q)
+	    amplify_parallel(s, data, off, m, s->amp_pos);
+	else
+	    amplify_by_ramp(s, data, off, m, s->amp_pos);
+	s->amplified += m;
+	s->amp_pos += m;
+	if (s->amp_pos == (size_t) s->frame_len)
+	    s->amp_pos = 0;
+	off += m;
+	n -= m;
+    }
+}
+
+// On a short input, a filter may have got too few elements to fill its queue
+// by the time it is flushed.  It is then filled up first with the elements
+// it has got (from the middle of the queue on), back from the last one to
+// the first one, and forth again; returns the index of the next of them,
+// or -1 when the queue is full.
+static int fill_index(mydrc *s, cqueue *q)
+{
+    if (cqueue_size(q) == q->size) {
+	s->flush_fill = 0;
+	return -1;
+    }
+    int first = (q->size - 1) / 2;
+    int last = cqueue_size(q) - 1 - s->flush_fill;
+    int len = last - first + 1;
+    int t = s->flush_fill++ % (2 * len);
+    return t < len ? last - t : first + t - len;
+}
+
+// one more element into the filters; returns true when the smoothing filter
+// has given the gain for the next frame
+static bool drain_step(mydrc *s)
+{
+    // The idea is to apply the exact same mirroring technique as was used
+    // at the beginning.  Thus the result should be completely symmetrical,
+    // as if the audio were played backwards and then reversed.
+    int rms_steps = s->rms_size / 2 - 1;
+    int flush_state = s->flush_state;
+    int fill;
+    if (flush_state < rms_steps) {
+	if ((fill = fill_index(s, s->gain_rms)) >= 0)
+	    return push_rms_sum(s, cqueue_peek(s->gain_rms, fill));
+	s->flush_state++;
+	// Add more elements to rms filter.
+	// E.g. it was 6789 to be applied at the end of 7,
+	// now it has to be 7789 to applied at the end of 8.
+	// With more elements, they go on mirrored, 6 after 7, and so on.
+	double rms_sum = cqueue_peek(s->gain_rms, s->rms_size - 3 - 2 * flush_state);
+	return push_rms_sum(s, rms_sum);
+    }
+    // the rest counts from 1
+    flush_state -= rms_steps - 1;
+    if (flush_state <= s->min_size / 2) {
+	// flush the min filter
+	if ((fill = fill_index(s, s->gain_min)) >= 0)
+	    return push_to_min(s, cqueue_peek(s->gain_min, fill));
+	s->flush_state++;
+	if (flush_state == 1) {
+	    // copy last filter elements, to be applied backwards
+	    int off = s->min_size / 2 + 1;
+	    for (int i = 0; i < s->min_size / 2; i++)
+		s->flush_buf[i] = cqueue_peek(s->gain_min, i + off);
+	}
+	int i = s->min_size / 2 - flush_state;
+	double gain_dB = s->flush_buf[i];
+	return push_to_min(s, gain_dB);
+    }
+    else if (flush_state <= s->min_size / 2 + s->filter_size / 2) {
+	// flush the smoothing filter
+	if ((fill = fill_index(s, s->gain_smooth)) >= 0)
+	    return push_to_smooth(s, cqueue_peek(s->gain_smooth, fill));
+	s->flush_state++;
+	if (flush_state == s->min_size / 2 + 1) {
+	    int off = s->filter_size / 2 + 1;
+	    for (int i = 0; i < s->filter_size / 2; i++)
+		s->flush_buf[i] = cqueue_peek(s->gain_smooth, i + off);
+	}
+	int i = s->min_size / 2 + s->filter_size / 2 - flush_state;
+	double to_smooth = s->flush_buf[i];
+	return push_to_smooth(s, to_smooth);
+    }
+    else {
+	// This should be the last frame.  Much like the first frame sets
+	// prev_amplification_factor to its current_amplification_factor,
+	// the last frame uses constant amplification for its samples
+	// by simply not updating s->gain_smooth.
+	s->flush_state++;
+	assert(flush_state == 1 + s->min_size / 2 + s->filter_size / 2);
+	return true;
+    }
+}
+
+// the gain for the next frame, with the input over; until the filters are
+// filled up, on a short input, they give none
+static void drain_filters(mydrc *s)
+{
+    while (!drain_step(s))
+	;
+}
+
+void mydrc_finish(mydrc *s)
+{
+    if (s->finished)
+	return;
+    s->finished = true;
+
+    // the last small frame
+    if (s->frame_pos) {
+	end_frame(s, s->frame_pos);
+	s->frame_pos = 0;
+    }
+
+    // the frames still waiting for the filters; with the gain file,
+    // no frame waits for them
+    size_t frames = (s->analyzed + s->frame_len - 1) / s->frame_len;
+    while (s->known < frames) {
+	assert(!s->gain_in);
+	drain_filters(s);
+	push_pending(s);
+    }
+
+    // the coefficients past the end of the input are lasta
+    if (s->q) {
+	float lasta = qadrc_lasta(s->q);
+	while (s->qready < s->analyzed) {
+	    s->qring[s->qready % s->qsize] = lasta;
+	    s->qready++;
+	}
+    }
+}
+
+// The streaming interface keeps the lookahead frames in its own ring,
+// plus the frame being filled, the frame just analyzed, and up to two frames
+// being output (at most frame_len samples are left to output between calls).
+static int alloc_blocks(mydrc *s)
+{
+    s->nblocks = mydrc_lookahead(s) + 4;
+    s->blocks = malloc(s->nblocks * s->frame_len * s->nbufs * s->width);
+    return s->blocks ? 0 : -1;
+}
+
+static void block_ptrs(mydrc *s, size_t blk, float **ptrs)
+{
+    size_t size = s->frame_len * s->width;
+    char *base = (char *) s->blocks + blk * s->nbufs * size;
+    for (unsigned k = 0; k < s->nbufs; k++)
+	ptrs[k] = (float *) (base + k * size);
+}
+
+static size_t next_blk(mydrc *s, size_t blk)
+{
+    return blk + 1 == s->nblocks ? 0 : blk + 1;
+}
+
+// amplify the oldest frame and make it ready for output
+static void amplify_block(mydrc *s, size_t len)
+{
+    float **ptrs = s->out_ptrs;
+    block_ptrs(s, s->amp_blk, ptrs);
+    mydrc_amplify(s, ptrs, 0, len);
+    s->amp_blk = next_blk(s, s->amp_blk);
+}
+
+// copy out the ready samples, up to n
+static size_t output_blocks(mydrc *s, float *const *data, size_t out, size_t n)
+{
+    float **ptrs = s->out_ptrs;
+    while (out < n && s->out_blk != s->amp_blk) {
+	size_t len = s->frame_len;
+	if (s->eof && next_blk(s, s->out_blk) == s->in_blk)
+	    len = s->last_len;
+	size_t m = MIN(len - s->out_pos, n - out);
+	block_ptrs(s, s->out_blk, ptrs);
+	for (unsigned k = 0; k < s->nbufs; k++)
+	    memcpy((char *) data[k] + out * s->width,
+		    (char *) ptrs[k] + s->out_pos * s->width, m * s->width);
+	out += m;
+	s->out_pos += m;
+	if (s->out_pos == len) {
+	    s->out_blk = next_blk(s, s->out_blk);
+	    s->out_pos = 0;
+	}
+    }
+    return out;
+}
+
+size_t mydrc_process(mydrc *s, float *const *data, size_t n)
+{
+    if (!s->blocks && alloc_blocks(s) < 0)
+	return 0;
+
+    float **ptrs = s->in_ptrs;
+    size_t out = 0;
+    for (size_t i = 0; i < n; ) {
+	size_t m = MIN(n - i, s->frame_len - s->in_pos);
+	block_ptrs(s, s->in_blk, ptrs);
+	for (unsigned k = 0; k < s->nbufs; k++)
+	    memcpy((char *) ptrs[k] + s->in_pos * s->width,
+		    (char *) data[k] + i * s->width, m * s->width);
+	i += m;
+	s->in_pos += m;
+	if (s->in_pos == (size_t) s->frame_len) {
+	    mydrc_analyze(s, ptrs, 0, s->frame_len);
+	    s->in_blk = next_blk(s, s->in_blk);
+	    s->in_pos = 0;
+	    while (mydrc_ready(s) >= (size_t) s->frame_len)
+		amplify_block(s, s->frame_len);
+	}
+	// the input has been copied, and so the output can take its place
+	out = output_blocks(s, data, out, i);
+    }
+    return out;
+}
+
+size_t mydrc_flush(mydrc *s, float *const *data, size_t n)
+{
+    if (!s->blocks)
+	return 0;
+
+    if (!s->eof) {
+	s->eof = true;
+	s->last_len = s->frame_len;
+	if (s->in_pos) {
+	    // the last small frame
+	    float **ptrs = s->in_ptrs;
+	    block_ptrs(s, s->in_blk, ptrs);
+	    mydrc_analyze(s, ptrs, 0, s->in_pos);
+	    s->last_len = s->in_pos;
+	    s->in_blk = next_blk(s, s->in_blk);
+	    s->in_pos = 0;
+	}
+	mydrc_finish(s);
+    }
+
+    size_t out = output_blocks(s, data, 0, n);
+    while (out < n && s->amp_blk != s->in_blk) {
+	bool last = next_blk(s, s->amp_blk) == s->in_blk;
+	amplify_block(s, last ? s->last_len : (size_t) s->frame_len);
+	out = output_blocks(s, data, out, n);
+    }
+    return out;
+}
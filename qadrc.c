@@ -0,0 +1,945 @@
+/*
+ * qadrc - classic dynamic range compressor
+ *
+ * Written by Alexey Tourbin.
+ * Based on qaac compressor by nu774.
+ * This file is distributed as Public Domain.
+ *
+ * This implementation is based on "Digital Dynamic Range Compressor Design -
+ * A Tutorial and Analysis", JAES2012.  It adds the delay (lookahead) parameter.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <stdatomic.h>
+#include "libqadrc.h"
+#include "qadrc_simd.h"
+
+struct qadrc {
+    double thresh;
+    double slope;
+    double Tlo;
+    double Thi;
+    double knee_factor;
+
+    double alphaA;
+    double alphaR;
+
+    double yR;
+    double yA;
+
+    /* the detector, with the same parameters as above; qadrc_update()
+     * stages another one, and bumps seq, which is odd while it writes */
+    struct qadrc_detector det;
+    struct qadrc_detector staged;
+    atomic_uint seq;
+    unsigned seen;
+    double rate;
+
+    /* unlinked channels: the smoothers per channel, a buffer for
+     * the planar layout, CHUNK samples of each channel */
+    bool unlinked;
+    double *yRc;
+    double *yAc;
+    float *ubuf;
+
+    /* smoothing as parallel scans: CHUNK-sized buffers, alphaA^k, alphaR^k */
+    bool scan;
+    double *sbuf;
+    double *apow;
+
+    /* decimated envelope: the block size, the alphas for a block */
+    size_t step;
+    double alphaA_step;
+    double alphaR_step;
+
+    int fmt;
+    unsigned nc;
+    /* the coefficients per sample, 1 or nc if unlinked */
+    unsigned width;
+    float *lasta;
+
+    int prec;
+    int isa;
+    struct qadrc_kernels k;
+
+    /* the jobs of qadrc_apply(), one if threads <= 1 */
+    qadrc_execute_fn execute;
+    void *exec_arg;
+    unsigned threads;
+
+    /* streaming interface: the delay line, in the same layout as the input */
+    size_t delay_samples;
+    size_t total_samples;
+    size_t flushed;
+    size_t rpos;
+    float *ring;
+    float *abuf;
+
+    FILE *wf_fp;
+};
+
+#ifndef QADRC_WF
+#define QADRC_WF 0
+#endif
+
+/* the reference build: libm instead of the approximations, whatever
+ * the precision parameter says */
+#ifndef QADRC_EXACT
+#define QADRC_EXACT 0
+#endif
+
+/* streaming interface works in chunks of this many samples */
+#define CHUNK 1024
+
+/* the least number of samples worth a job of its own */
+#define JOB_MIN 512
+
+#include "simd_math_prims.h"
+
+/* prec is a constant in each of the kernels, the switch is folded */
+static inline float dB_to_scale(float dB, int prec)
+{
+    switch (prec) {
+    case QADRC_PRECISION_FAST:
+	return expapprox_fast(2.302585093f*0.05f*dB);
+    case QADRC_PRECISION_EXACT:
+	return pow(10, 0.05 * dB);
+    default:
+	return expapprox(2.302585093f*0.05f*dB);
+    }
+}
+
+static inline float scale_to_dB(float x, int prec)
+{
+    switch (prec) {
+    case QADRC_PRECISION_FAST:
+	if (x < 1e-6f)
+	    return -120;
+	return 20.0f*0.4342944819f*logapprox_fast(x);
+    case QADRC_PRECISION_EXACT:
+	return 20 * log10(x);
+    default:
+	if (x < 1e-6f)
+	    return -120;
+	return 20.0f*0.4342944819f*logapprox(x);
+    }
+}
+
+/*
+ * gain computer, works on log domain
+ */
+static double computeGain(qadrc *s, double x)
+{
+    if (x < s->Tlo)
+	return 0.0;
+    else if (x > s->Thi)
+	return s->slope * (x - s->thresh);
+    else {
+	double delta = x - s->Tlo;
+	return delta * delta * s->knee_factor;
+    }
+}
+
+/*
+ * smooth, level corrected decoupled peak detector
+ * works on log domain
+ */
+static double smoothAverage(qadrc *s, double x)
+{
+    const double eps = 1e-120;
+    s->yR = fmin(x, s->alphaR * s->yR + (1.0 - s->alphaR) * x + eps - eps);
+    s->yA = s->alphaA * s->yA + (1.0 - s->alphaA) * s->yR + eps - eps;
+    return s->yA;
+}
+
+/*
+ * Smoothing as parallel scans.  The attack stage of smoothAverage() is
+ * a linear recurrence, yA[i] = alphaA * yA[i-1] + (1 - alphaA) * yR[i].
+ * The release stage is not linear, but its steps, y -> min(x, a*y + b*x),
+ * compose into functions of the same kind, y -> min(C, A*y + D), so it is
+ * a scan, too.  The block is split into SCAN_LANES runs, which are scanned
+ * all at once, as if each started with y0 = 0 (attack) or +inf (release);
+ * then the true y0 of each run is found from the ends of the runs, and
+ * the runs are corrected: the attack by alphaA^(t+1)*y0, and the release
+ * by taking min(C, alphaR^(t+1)*y0 + D), where D is the linear part of
+ * the release stage scanned from 0.  The runs are kept transposed, so that
+ * the lanes are contiguous.
+ */
+#define SCAN_LANES 8
+#define SCAN_RUN (CHUNK / SCAN_LANES)
+
+static void chew_scan1(qadrc *s, float *a, size_t n)
+{
+    const double eps = 1e-120;
+    const double aA = s->alphaA, bA = 1.0 - s->alphaA;
+    const double aR = s->alphaR, bR = 1.0 - s->alphaR;
+    const double *powA = s->apow, *powR = s->apow + SCAN_RUN + 1;
+    double *C = s->sbuf, *D = C + CHUNK;
+
+    size_t L = n / SCAN_LANES;
+    double c[SCAN_LANES], v[SCAN_LANES], y0[SCAN_LANES];
+    if (L > 0) {
+	/* the gain computer, branchless; release, the runs */
+	const double thresh = s->thresh, slope = s->slope;
+	const double Tlo = s->Tlo, Thi = s->Thi, knee_factor = s->knee_factor;
+	for (size_t j = 0; j < SCAN_LANES; j++)
+	    c[j] = HUGE_VAL, v[j] = 0;
+	for (size_t t = 0; t < L; t++) {
+	    for (size_t j = 0; j < SCAN_LANES; j++) {
+		double xG = a[j*L+t], delta = xG - Tlo;
+		double yG = xG > Thi ? slope * (xG - thresh) : delta * delta * knee_factor;
+		double x = xG < Tlo ? 0.0 : yG;
+		c[j] = fmin(x, aR * c[j] + bR * x + eps - eps);
+		v[j] = aR * v[j] + bR * x + eps - eps;
+	    }
+	    for (size_t j = 0; j < SCAN_LANES; j++)
+		C[t*SCAN_LANES+j] = c[j], D[t*SCAN_LANES+j] = v[j];
+	}
+	y0[0] = s->yR;
+	for (size_t j = 1; j < SCAN_LANES; j++)
+	    y0[j] = fmin(c[j-1], powR[L] * y0[j-1] + v[j-1]);
+	s->yR = fmin(c[SCAN_LANES-1], powR[L] * y0[SCAN_LANES-1] + v[SCAN_LANES-1]);
+
+	/* release, corrected; attack, the runs */
+	for (size_t j = 0; j < SCAN_LANES; j++)
+	    v[j] = 0;
+	for (size_t t = 0; t < L; t++)
+	    for (size_t j = 0; j < SCAN_LANES; j++) {
+		size_t k = t * SCAN_LANES + j;
+		double yR = fmin(C[k], powR[t+1] * y0[j] + D[k]);
+		v[j] = aA * v[j] + bA * yR + eps - eps;
+		C[k] = v[j];
+	    }
+	y0[0] = s->yA;
+	for (size_t j = 1; j < SCAN_LANES; j++)
+	    y0[j] = v[j-1] + powA[L] * y0[j-1];
+	s->yA = v[SCAN_LANES-1] + powA[L] * y0[SCAN_LANES-1];
+
+	/* attack, corrected */
+	for (size_t t = 0; t < L; t++)
+	    for (size_t j = 0; j < SCAN_LANES; j++)
+		a[j*L+t] = C[t*SCAN_LANES+j] + powA[t+1] * y0[j];
+    }
+
+    for (size_t i = L * SCAN_LANES; i < n; i++)
+	a[i] = smoothAverage(s, computeGain(s, a[i]));
+}
+
+/* computeGain() and smoothAverage(), none of it a serial loop */
+static void chew_scan(qadrc *s, float *a, size_t nsamples)
+{
+    for (size_t i = 0; i < nsamples; i += CHUNK)
+	chew_scan1(s, a + i, nsamples - i < CHUNK ? nsamples - i : CHUNK);
+}
+
+/*
+ * Decimated envelope: the smoothing runs once per block of step samples,
+ * with the alphas raised to the power of the block size, so that the attack
+ * and release times stay the same.  The peak level and the gain computer
+ * still run by the sample, which vectorizes; the block passes on the least
+ * gain (that of its peak, so transients are not missed) and the mean gain.
+ * The release pulls towards the mean gain, as it does by the sample; if
+ * the least gain is below it, the release drops to it, somewhere within
+ * the block, and the attack takes the mean of the release before and after.
+ * Within the block, the coefficients are interpolated between the values
+ * at the end of the previous block and at the end of this one.  The blocks
+ * do not span the calls, the last block can be shorter.
+ */
+static void chew_step(qadrc *s, float *const *data, size_t off, size_t nsamples, float *a)
+{
+    const double eps = 1e-120;
+    /* the gain computer in floats, for twice the lanes */
+    const float thresh = s->thresh, slope = s->slope;
+    const float Tlo = s->Tlo, Thi = s->Thi, knee_factor = s->knee_factor;
+    /* a[] is not to be aliased with the state */
+    double yA = s->yA, yR = s->yR;
+    s->k.peak(data, off, nsamples, s->nc, s->fmt, a);
+    for (size_t i = 0; i < nsamples; i += s->step) {
+	size_t n = nsamples - i < s->step ? nsamples - i : s->step;
+	double alphaA = s->alphaA_step, alphaR = s->alphaR_step;
+	if (n < s->step) {
+	    alphaA = pow(s->alphaA, n);
+	    alphaR = pow(s->alphaR, n);
+	}
+	/* the gain computer, branchless */
+	float min = 0, sum = 0;
+	for (size_t t = 0; t < n; t++) {
+	    float xG = a[i+t], delta = xG - Tlo;
+	    float yG = xG > Thi ? slope * (xG - thresh) : delta * delta * knee_factor;
+	    yG = xG < Tlo ? 0.0f : yG;
+	    min = fminf(min, yG);
+	    sum += yG;
+	}
+	float y0 = yA;
+	double yR0 = yR;
+	yR = alphaR * yR + (1.0 - alphaR) * sum / n + eps - eps;
+	double xA = yR;
+	if (min < yR) {
+	    xA = 0.5 * (yR0 + min);
+	    yR = min;
+	}
+	yA = alphaA * yA + (1.0 - alphaA) * xA + eps - eps;
+	float dy = (yA - y0) / n;
+	for (int t = 0; t < (int) n; t++)
+	    a[i+t] = y0 + dy * (t + 1);
+    }
+    s->yA = yA;
+    s->yR = yR;
+}
+
+/*
+ * Unlinked channels: a gain computer and a smoother per channel.  The dB
+ * levels and coefficients are interleaved, a[i*nc+c], so that each step of
+ * the recurrence advances a group of channels at once, in vector lanes;
+ * a 5.1 or 7.1 stream then takes about as many steps as mono.  The gain
+ * computer is branchless for the same reason.  This is the C version of
+ * the kernel, in groups of up to 8 channels.
+ */
+#define LANES 8
+
+void qadrc_smooth_c(const struct qadrc_detector *d,
+	double *yR, double *yA, const float *x, float *a, size_t n,
+	unsigned nc, unsigned stride)
+{
+    const double eps = 1e-120;
+    const double aA = d->alphaA, bA = 1.0 - d->alphaA;
+    const double aR = d->alphaR, bR = 1.0 - d->alphaR;
+    const double thresh = d->thresh, slope = d->slope;
+    const double Tlo = d->Tlo, Thi = d->Thi, knee_factor = d->knee_factor;
+    for (unsigned c0 = 0; c0 < nc; c0 += LANES) {
+	const unsigned w = nc - c0 < LANES ? nc - c0 : LANES;
+	double R[LANES], A[LANES];
+	for (unsigned c = 0; c < w; c++)
+	    R[c] = yR[c0+c], A[c] = yA[c0+c];
+	for (size_t i = 0; i < n; i++) {
+	    size_t k = i * stride + c0;
+	    for (unsigned c = 0; c < w; c++) {
+		double xG = x[k+c], delta = xG - Tlo;
+		double yG = xG > Thi ? slope * (xG - thresh) : delta * delta * knee_factor;
+		yG = xG < Tlo ? 0.0 : yG;
+		R[c] = fmin(yG, aR * R[c] + bR * yG + eps - eps);
+		A[c] = aA * A[c] + bA * R[c] + eps - eps;
+		a[k+c] = A[c];
+	    }
+	}
+	for (unsigned c = 0; c < w; c++)
+	    yR[c0+c] = R[c], yA[c0+c] = A[c];
+    }
+}
+
+/* x[i*nc+c] = data[c][off+i]; the channels in the outer loop are faster */
+static inline __attribute__((always_inline))
+void interleave(const unsigned nc, float *const *data, size_t off, size_t n, float *x)
+{
+    for (unsigned c = 0; c < nc; c++) {
+	const float *y = data[c] + off;
+	for (size_t i = 0; i < n; i++)
+	    x[i*nc+c] = y[i];
+    }
+}
+
+/* y[c*UBUF_STRIDE+i] = x[i*nc+c]; the stride is not a multiple of 4K,
+ * which would make the channels of y[] contend for the same cache sets */
+#define UBUF_STRIDE (CHUNK + 16)
+
+static inline __attribute__((always_inline))
+void deinterleave(const unsigned nc, const float *x, size_t n, float *y)
+{
+    for (unsigned c = 0; c < nc; c++)
+	for (size_t i = 0; i < n; i++)
+	    y[c*UBUF_STRIDE+i] = x[i*nc+c];
+}
+
+/* The kernels see interleaved samples as one long mono channel.  The levels
+ * go to ubuf, the planar samples are interleaved there first, and the peak
+ * kernel works in place; the coefficients are deinterleaved into ubuf for
+ * the gain kernel. */
+static void chew_unlinked(qadrc *s, float *const *data, size_t off, size_t n, float *a)
+{
+    const unsigned nc = s->nc;
+    float *x = s->ubuf;
+    if (s->fmt == QADRC_FLT)
+	s->k.peak(data, off * nc, n * nc, 1, QADRC_FLT, x);
+    else {
+	QADRC_NC(interleave, nc, data, off, n, x);
+	s->k.peak(&x, 0, n * nc, 1, QADRC_FLT, x);
+    }
+    s->k.smooth(&s->det, s->yRc, s->yAc, x, a, n, nc, nc);
+}
+
+static void apply_unlinked(qadrc *s, float *const *data, size_t off, float *a, size_t n)
+{
+    const unsigned nc = s->nc;
+    if (s->fmt == QADRC_FLT)
+	s->k.gain(data, off * nc, n * nc, 1, QADRC_FLT, a);
+    else {
+	QADRC_NC(deinterleave, nc, a, n, s->ubuf);
+	for (unsigned c = 0; c < nc; c++)
+	    s->k.gain(data + c, off, n, 1, QADRC_FLTP, s->ubuf + c * UBUF_STRIDE);
+    }
+}
+
+/* the gain computer and the smoother for the parameters */
+static void detector(struct qadrc_detector *d, const struct qadrc_params *p, double Fs)
+{
+    d->thresh = p->thresh;
+    d->slope = (1.0 - p->ratio) / p->ratio;
+    d->Tlo = p->thresh - p->knee / 2.0;
+    d->Thi = p->thresh + p->knee / 2.0;
+    d->knee_factor = d->slope / (p->knee * 2.0);
+
+    const double attack = p->attack / 1000.0;
+    const double release = p->release / 1000.0;
+    d->alphaA = attack > 0.0 ? exp(-1.0 / (attack * Fs)) : 0.0;
+    d->alphaR = release > 0.0 ? exp(-1.0 / (release * Fs)) : 0.0;
+}
+
+/* switch to the detector, along with everything derived from it;
+ * the smoothers keep their state */
+static void set_detector(qadrc *s, const struct qadrc_detector *d)
+{
+    s->det = *d;
+    s->thresh = d->thresh;
+    s->slope = d->slope;
+    s->Tlo = d->Tlo;
+    s->Thi = d->Thi;
+    s->knee_factor = d->knee_factor;
+    s->alphaA = d->alphaA;
+    s->alphaR = d->alphaR;
+
+    if (s->step > 1) {
+	s->alphaA_step = pow(s->alphaA, s->step);
+	s->alphaR_step = pow(s->alphaR, s->step);
+    }
+    if (s->scan) {
+	double *powR = s->apow + SCAN_RUN + 1;
+	s->apow[0] = powR[0] = 1;
+	for (size_t k = 1; k <= SCAN_RUN; k++) {
+	    s->apow[k] = s->apow[k-1] * s->alphaA;
+	    powR[k] = powR[k-1] * s->alphaR;
+	}
+    }
+}
+
+qadrc *qadrc_create(const struct qadrc_params *p, unsigned sample_rate,
+	unsigned nc, int fmt)
+{
+    assert(fmt == QADRC_FLT || fmt == QADRC_FLTP);
+    assert(nc > 0);
+
+    qadrc *s = calloc(1, sizeof *s);
+    if (!s)
+	return NULL;
+
+    s->yR = p->gain0;
+    s->yA = p->gain0;
+
+    const double Fs = sample_rate;
+    s->rate = Fs;
+    detector(&s->det, p, Fs);
+    atomic_init(&s->seq, 0);
+
+    s->fmt = fmt;
+    s->nc = nc;
+    s->unlinked = p->unlinked && nc > 1;
+    s->width = s->unlinked ? nc : 1;
+    s->delay_samples = p->delay * Fs / 1000;
+
+    s->prec = QADRC_EXACT ? QADRC_PRECISION_EXACT : p->precision;
+    s->scan = QADRC_EXACT ? false : p->scan;
+    s->step = QADRC_EXACT ? 1 : p->envelope_step;
+
+    /* the best kernels this CPU can run, down to C */
+    for (int isa = QADRC_ISA_AVX512; !qadrc_set_isa(s, isa); isa--)
+	assert(isa > QADRC_ISA_C);
+
+    /* the buffers for the streaming interface */
+    s->ring = calloc(s->delay_samples * nc + 1, sizeof(float));
+    s->abuf = malloc(CHUNK * s->width * sizeof(float));
+    s->lasta = malloc(s->width * sizeof(float));
+    if (!s->ring || !s->abuf || !s->lasta) {
+	qadrc_destroy(s);
+	return NULL;
+    }
+    for (unsigned c = 0; c < s->width; c++)
+	s->lasta[c] = p->gain0;
+
+    if (s->unlinked) {
+	s->yRc = malloc(nc * sizeof(double));
+	s->yAc = malloc(nc * sizeof(double));
+	s->ubuf = malloc(UBUF_STRIDE * nc * sizeof(float));
+	if (!s->yRc || !s->yAc || !s->ubuf) {
+	    qadrc_destroy(s);
+	    return NULL;
+	}
+	for (unsigned c = 0; c < nc; c++)
+	    s->yRc[c] = s->yAc[c] = p->gain0;
+    }
+
+    if (s->scan) {
+	/* 2 buffers, and the powers of alphaA, then of alphaR */
+	s->sbuf = malloc(2 * CHUNK * sizeof(double));
+	s->apow = malloc(2 * (SCAN_RUN + 1) * sizeof(double));
+	if (!s->sbuf || !s->apow) {
+	    qadrc_destroy(s);
+	    return NULL;
+	}
+    }
+
+    set_detector(s, &s->det);
+    return s;
+}
+
+/* A seqlock with one writer: the reader never waits, and if it sees
+ * the staged detector being written, it tries again on the next call. */
+void qadrc_update(qadrc *s, const struct qadrc_params *p)
+{
+    unsigned seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    detector(&s->staged, p, s->rate);
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+}
+
+static void pick_update(qadrc *s)
+{
+    unsigned seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+    if (seq == s->seen || seq & 1)
+	return;
+    struct qadrc_detector d = s->staged;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&s->seq, memory_order_relaxed) != seq)
+	return;
+    s->seen = seq;
+    set_detector(s, &d);
+}
+
+void qadrc_destroy(qadrc *s)
+{
+    if (!s)
+	return;
+    free(s->ring);
+    free(s->abuf);
+    free(s->lasta);
+    free(s->yRc);
+    free(s->yAc);
+    free(s->ubuf);
+    free(s->sbuf);
+    free(s->apow);
+    free(s);
+}
+
+size_t qadrc_latency(const qadrc *s)
+{
+    return s->delay_samples;
+}
+
+float qadrc_lasta(const qadrc *s)
+{
+    return s->lasta[0];
+}
+
+void qadrc_fill_lasta(const qadrc *s, float *a, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+	for (unsigned c = 0; c < s->width; c++)
+	    a[i*s->width+c] = s->lasta[c];
+}
+
+unsigned qadrc_width(const qadrc *s)
+{
+    return s->width;
+}
+
+void qadrc_waveform(qadrc *s, FILE *fp)
+{
+    s->wf_fp = fp;
+}
+
+/* The C kernels: peak level among channels in dB, and the gain.  They are
+ * the fallback for qadrc_simd.c, and are vectorized by the compiler for mono
+ * and planar stereo.  Unless the whole loop is vectorizable, the xL -> xG
+ * and cG -> cL conversions are executed in separate passes.  Each kernel
+ * is instantiated for each precision. */
+static inline __attribute__((always_inline))
+void peak_c(float *const *data, size_t off, size_t nsamples,
+	unsigned nc, int fmt, float *a, const int prec)
+{
+    fmt |= nc <= 2 ? nc << 8 : 0;
+    switch (fmt) {
+    case QADRC_FLT  | 1 << 8:
+    case QADRC_FLTP | 1 << 8:
+	for (size_t i = 0; i < nsamples; i++) {
+	    float xL = fabsf(data[0][off+i]);
+	    float xG = scale_to_dB(xL, prec);
+	    a[i] = xG;
+	}
+	break;
+    case QADRC_FLTP | 2 << 8:
+	for (size_t i = 0; i < nsamples; i++) {
+	    float xL = fabsf(data[0][off+i]);
+	    float xM = fabsf(data[1][off+i]);
+	    if (xM > xL)
+		xL = xM;
+	    float xG = scale_to_dB(xL, prec);
+	    a[i] = xG;
+	}
+	break;
+    case QADRC_FLTP:
+	QADRC_NC(qadrc_peak_planar, nc, data, off, nsamples, a);
+	break;
+    case QADRC_FLT | 2 << 8:
+	off *= 2;
+	for (size_t j = 0; j < 2 * nsamples; j += 2) {
+	    float xL = fabsf(data[0][off+j+0]);
+	    float xM = fabsf(data[0][off+j+1]);
+	    if (xM > xL)
+		xL = xM;
+	    a[j/2] = xL;
+	}
+	break;
+    default:
+	assert(fmt == QADRC_FLT);
+	QADRC_NC(qadrc_peak_packed, nc, data[0] + off * nc, nsamples, a);
+    }
+
+    switch (fmt) {
+    case QADRC_FLT  | 1 << 8:
+    case QADRC_FLTP | 1 << 8:
+    case QADRC_FLTP | 2 << 8:
+	break;
+    default:
+	for (size_t i = 0; i < nsamples; i++) {
+	    float xL = a[i];
+	    float xG = scale_to_dB(xL, prec);
+	    a[i] = xG;
+	}
+    }
+}
+
+static inline __attribute__((always_inline))
+void gain_c(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a, const int prec)
+{
+    fmt |= nc <= 2 ? nc << 8 : 0;
+    switch (fmt) {
+    case QADRC_FLT  | 1 << 8:
+    case QADRC_FLTP | 1 << 8:
+	for (size_t i = 0; i < n; i++) {
+	    float cG = a[i];
+	    float cL = dB_to_scale(cG, prec);
+	    data[0][off+i] *= cL;
+	}
+	break;
+    case QADRC_FLTP | 2 << 8:
+	for (size_t i = 0; i < n; i++) {
+	    float cG = a[i];
+	    float cL = dB_to_scale(cG, prec);
+	    data[0][off+i] *= cL;
+	    data[1][off+i] *= cL;
+	}
+	break;
+    default:
+	for (size_t i = 0; i < n; i++) {
+	    float cG = a[i];
+	    float cL = dB_to_scale(cG, prec);
+	    a[i] = cL;
+	}
+    }
+
+    switch (fmt) {
+    case QADRC_FLT  | 1 << 8:
+    case QADRC_FLTP | 1 << 8:
+    case QADRC_FLTP | 2 << 8:
+	break;
+    case QADRC_FLTP:
+	QADRC_NC(qadrc_gain_planar, nc, data, off, n, a);
+	break;
+    case QADRC_FLT | 2 << 8:
+	off *= 2;
+	for (size_t j = 0; j < 2 * n; j += 2) {
+	    float cL = a[j/2];
+	    data[0][off+j+0] *= cL;
+	    data[0][off+j+1] *= cL;
+	}
+	break;
+    default:
+	assert(fmt == QADRC_FLT);
+	QADRC_NC(qadrc_gain_packed, nc, data[0] + off * nc, n, a);
+    }
+}
+
+#define KERNELS_C(suffix, prec) \
+void qadrc_peak##suffix##_c(float *const *data, size_t off, size_t n, \
+	unsigned nc, int fmt, float *a) \
+{ \
+    peak_c(data, off, n, nc, fmt, a, prec); \
+} \
+void qadrc_gain##suffix##_c(float *const *data, size_t off, size_t n, \
+	unsigned nc, int fmt, float *a) \
+{ \
+    gain_c(data, off, n, nc, fmt, a, prec); \
+}
+
+KERNELS_C(, QADRC_PRECISION_BALANCED)
+KERNELS_C(_fast, QADRC_PRECISION_FAST)
+KERNELS_C(_exact, QADRC_PRECISION_EXACT)
+
+bool qadrc_set_isa(qadrc *s, int isa)
+{
+    if (!qadrc_simd_kernels(isa, s->prec, &s->k))
+	return false;
+    s->isa = isa;
+    return true;
+}
+
+int qadrc_get_isa(const qadrc *s)
+{
+    return s->isa;
+}
+
+void qadrc_set_threads(qadrc *s, qadrc_execute_fn execute, void *arg,
+	unsigned nb_threads)
+{
+    s->execute = execute;
+    s->exec_arg = arg;
+    s->threads = execute ? nb_threads : 1;
+}
+
+/* process input samples and fill a[] coefficients */
+void qadrc_chew(qadrc *s, float *const *data, size_t off, size_t nsamples, float *a)
+{
+    pick_update(s);
+
+    if (s->unlinked)
+	for (size_t i = 0; i < nsamples; i += CHUNK) {
+	    size_t n = nsamples - i < CHUNK ? nsamples - i : CHUNK;
+	    chew_unlinked(s, data, off + i, n, a + i * s->nc);
+	}
+    else if (s->step > 1)
+	chew_step(s, data, off, nsamples, a);
+    else {
+	/* We need to calculate peak level (xL, max among channels) and turn
+	 * it into dB (xG). */
+	s->k.peak(data, off, nsamples, s->nc, s->fmt, a);
+
+	/* As we apply downward compression to xG and smooth the result,
+	 * we get cG, a coefficient (though in dB just yet) which will be
+	 * applied to an earlier sample, because of the delay.  This part
+	 * is not vectorizable, unless the smoothing is done as scans. */
+	if (s->scan)
+	    chew_scan(s, a, nsamples);
+	else
+	    for (size_t i = 0; i < nsamples; ++i) {
+		double xG = a[i];
+		double yG = computeGain(s, xG);
+		double cG = smoothAverage(s, yG);
+		a[i] = cG;
+	    }
+    }
+
+    if (nsamples)
+	memcpy(s->lasta, a + (nsamples - 1) * s->width, s->width * sizeof(float));
+}
+
+/* apply a[] coefficients to samples */
+/* 10^(-2.5e-7/20) is within half an ulp below 1.0f */
+#define UNITY_DB 2.5e-7f
+
+bool qadrc_unity(const qadrc *s, const float *a, size_t n)
+{
+#if QADRC_WF
+    /* the waveform needs every coefficient */
+    if (s->wf_fp)
+	return false;
+#endif
+    float lo = 0, hi = 0;
+    for (size_t i = 0; i < n * s->width; i++) {
+	lo = fminf(lo, a[i]);
+	hi = fmaxf(hi, a[i]);
+    }
+    return lo >= -UNITY_DB && hi <= UNITY_DB;
+}
+
+void qadrc_scale(const qadrc *s, float *a, size_t n)
+{
+    n *= s->width;
+    switch (s->prec) {
+    case QADRC_PRECISION_FAST:
+	for (size_t i = 0; i < n; i++)
+	    a[i] = dB_to_scale(a[i], QADRC_PRECISION_FAST);
+	break;
+    case QADRC_PRECISION_EXACT:
+	for (size_t i = 0; i < n; i++)
+	    a[i] = dB_to_scale(a[i], QADRC_PRECISION_EXACT);
+	break;
+    default:
+	for (size_t i = 0; i < n; i++)
+	    a[i] = dB_to_scale(a[i], QADRC_PRECISION_BALANCED);
+    }
+}
+
+/* the linked gain, split by the sample: each job gets its share
+ * of the samples, of all channels, and of the coefficients */
+struct apply_job {
+    qadrc *s;
+    float *const *data;
+    size_t off;
+    float *a;
+    size_t n;
+};
+
+static void apply_job(void *arg, unsigned jobnr, unsigned nb_jobs)
+{
+    struct apply_job *j = arg;
+    qadrc *s = j->s;
+    size_t i = j->n * jobnr / nb_jobs;
+    size_t end = j->n * (jobnr + 1) / nb_jobs;
+    s->k.gain(j->data, j->off + i, end - i, s->nc, s->fmt, j->a + i);
+}
+
+void qadrc_apply(qadrc *s, float *const *data, size_t off, float *a, size_t n)
+{
+#if QADRC_WF
+    if (s->wf_fp) {
+	static int cnt;
+	static double sum;
+	for (size_t i = 0; i < n * s->width; i++) {
+	    sum += dB_to_scale(a[i], s->prec);
+	    if (++cnt == 480 * s->width) {
+		unsigned char c = sum / cnt * 255 + 0.5;
+		putc_unlocked(c, s->wf_fp);
+		sum = 0;
+		cnt = 0;
+	    }
+	}
+    }
+#endif
+    /* We now have dB coefficients which we need to convert to linear domain,
+     * cG -> cL, and apply to the data. */
+    if (s->unlinked)
+	for (size_t i = 0; i < n; i += CHUNK) {
+	    size_t m = n - i < CHUNK ? n - i : CHUNK;
+	    apply_unlinked(s, data, off + i, a + i * s->nc, m);
+	}
+    else if (s->threads > 1 && n >= 2 * JOB_MIN) {
+	size_t jobs = n / JOB_MIN;
+	if (jobs > s->threads)
+	    jobs = s->threads;
+	struct apply_job j = { s, data, off, a, n };
+	s->execute(s->exec_arg, apply_job, &j, jobs);
+    }
+    else
+	s->k.gain(data, off, n, s->nc, s->fmt, a);
+}
+
+/* The delay line holds the last delay_samples input samples, per channel
+ * if the layout is planar, or interleaved if the layout is packed. */
+#define RING_BUFS(s) ((s)->fmt == QADRC_FLTP ? (s)->nc : 1)
+#define RING_WIDTH(s) ((s)->fmt == QADRC_FLTP ? 1 : (s)->nc)
+
+/* exchange n samples at offset off with the oldest samples in the ring */
+static void swap_delay(qadrc *s, float *const *data, size_t off, size_t n)
+{
+    size_t D = s->delay_samples;
+    unsigned w = RING_WIDTH(s);
+    for (unsigned b = 0; b < RING_BUFS(s); b++) {
+	float *ring = s->ring + b * D * w;
+	float *x = data[b] + off * w;
+	size_t rpos = s->rpos;
+	size_t left = n;
+	while (left) {
+	    size_t len = D - rpos;
+	    if (len > left)
+		len = left;
+	    float *r = ring + rpos * w;
+	    for (size_t i = 0; i < len * w; i++) {
+		float t = r[i];
+		r[i] = x[i];
+		x[i] = t;
+	    }
+	    x += len * w;
+	    left -= len;
+	    rpos += len;
+	    if (rpos == D)
+		rpos = 0;
+	}
+    }
+    s->rpos = (s->rpos + n) % D;
+}
+
+/* move n samples within the buffers, from offset from to offset to */
+static void move_samples(qadrc *s, float *const *data, size_t to, size_t from, size_t n)
+{
+    unsigned w = RING_WIDTH(s);
+    for (unsigned b = 0; b < RING_BUFS(s); b++)
+	memmove(data[b] + to * w, data[b] + from * w, n * w * sizeof(float));
+}
+
+size_t qadrc_process(qadrc *s, float *const *data, size_t n)
+{
+    size_t D = s->delay_samples;
+    size_t out = 0;
+    for (size_t i = 0; i < n; i += CHUNK) {
+	size_t m = n - i < CHUNK ? n - i : CHUNK;
+	float *a = s->abuf;
+	qadrc_chew(s, data, i, m, a);
+	if (D == 0) {
+	    if (!qadrc_unity(s, a, m))
+		qadrc_apply(s, data, i, a, m);
+	    out += m;
+	    continue;
+	}
+	swap_delay(s, data, i, m);
+	/* When we apply a[] coefficients, we look backwards.  Therefore,
+	 * we should throw away the initial segment of a[], the one that
+	 * applies to "pre-input". */
+	size_t skip = 0;
+	if (s->total_samples < D)
+	    skip = D - s->total_samples < m ? D - s->total_samples : m;
+	s->total_samples += m;
+	if (skip == m)
+	    continue;
+	if (out < i + skip)
+	    move_samples(s, data, out, i + skip, m - skip);
+	a += skip * s->width;
+	if (!qadrc_unity(s, a, m - skip))
+	    qadrc_apply(s, data, out, a, m - skip);
+	out += m - skip;
+    }
+    return out;
+}
+
+size_t qadrc_flush(qadrc *s, float *const *data, size_t n)
+{
+    size_t D = s->delay_samples;
+    size_t held = s->total_samples < D ? s->total_samples : D;
+    if (s->flushed >= held)
+	return 0;
+    if (n > held - s->flushed)
+	n = held - s->flushed;
+
+    /* The oldest sample is at rpos, but when the input was shorter than
+     * the delay, the ring starts with "pre-input" samples. */
+    size_t rpos = (s->rpos + D - held + s->flushed) % D;
+    unsigned w = RING_WIDTH(s);
+    for (unsigned b = 0; b < RING_BUFS(s); b++) {
+	float *ring = s->ring + b * D * w;
+	size_t len = D - rpos < n ? D - rpos : n;
+	memcpy(data[b], ring + rpos * w, len * w * sizeof(float));
+	memcpy(data[b] + len * w, ring, (n - len) * w * sizeof(float));
+    }
+    s->flushed += n;
+
+    if (qadrc_unity(s, s->lasta, 1))
+	return n;
+    for (size_t i = 0; i < n; i += CHUNK) {
+	size_t m = n - i < CHUNK ? n - i : CHUNK;
+	qadrc_fill_lasta(s, s->abuf, m);
+	qadrc_apply(s, data, i, s->abuf, m);
+    }
+    return n;
+}
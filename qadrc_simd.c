@@ -0,0 +1,260 @@
+/*
+ * qadrc_simd.c - vector kernels for qadrc, with runtime CPU dispatch
+ *
+ * Written by Alexey Tourbin.
+ * This file is distributed as Public Domain.
+ *
+ * The loops in qadrc_chew() and qadrc_apply() are vectorized by the compiler
+ * only for mono and planar stereo; with more channels, or with interleaved
+ * stereo, they take two scalar-ish passes.  Here the same steps (peak level
+ * among channels, logapprox, expapprox, gain multiply) are written with
+ * SSE2, AVX2 and AVX-512 intrinsics.  Each instruction set gets its own copy
+ * of qadrc_simd_tmpl.h, compiled with the target attribute, so the file needs
+ * no special CFLAGS; the copy is picked at runtime with __builtin_cpu_supports.
+ */
+
+#include <math.h>
+#include "libqadrc.h"
+#include "qadrc_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+ * SSE2, 4 floats
+ */
+#define ISA sse2
+#define TARGET __attribute__((target("sse2")))
+#define W 4
+#define VF __m128
+#define VI __m128i
+#define LOAD _mm_loadu_ps
+#define STORE _mm_storeu_ps
+#define SET1 _mm_set1_ps
+#define SET1I _mm_set1_epi32
+#define ADD _mm_add_ps
+#define MUL _mm_mul_ps
+#define MIN _mm_min_ps
+#define MAX _mm_max_ps
+#define ANDI _mm_and_si128
+#define ORI _mm_or_si128
+#define SRAI _mm_srai_epi32
+#define F2I _mm_cvttps_epi32
+#define I2F _mm_cvtepi32_ps
+#define ASI _mm_castps_si128
+#define ASF _mm_castsi128_ps
+#define ABS(x) ASF(ANDI(ASI(x), SET1I(0x7FFFFFFF)))
+#define SELECT_LT(x, y, a, b) select_lt_sse2(_mm_cmplt_ps(x, y), a, b)
+#define MAX_PAIRS max_pairs_sse2
+#define DUP_PAIRS(c, c0, c1) (c0 = _mm_unpacklo_ps(c, c), c1 = _mm_unpackhi_ps(c, c))
+#define DW 2
+#define VD __m128d
+#define LOADD _mm_loadu_pd
+#define STORED _mm_storeu_pd
+#define LOADD_PS(p) _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *) (p))))
+#define STORED_PS(p, x) _mm_storel_epi64((__m128i *) (p), _mm_castps_si128(_mm_cvtpd_ps(x)))
+#define SET1D _mm_set1_pd
+#define ADDD _mm_add_pd
+#define SUBD _mm_sub_pd
+#define MULD _mm_mul_pd
+#define MULADDD(a, b, c) _mm_add_pd(_mm_mul_pd(a, b), c)
+#define MIND _mm_min_pd
+#define SELECT_LT_D(x, y, a, b) select_lt_pd_sse2(_mm_cmplt_pd(x, y), a, b)
+#define SMOOTH_NARROW qadrc_smooth_c
+
+TARGET static inline __m128 select_lt_sse2(__m128 m, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+}
+
+TARGET static inline __m128d select_lt_pd_sse2(__m128d m, __m128d a, __m128d b)
+{
+    return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b));
+}
+
+/* max(L, R) of interleaved stereo samples, in order */
+TARGET static inline __m128 max_pairs_sse2(__m128 x0, __m128 x1)
+{
+    __m128 L = _mm_shuffle_ps(x0, x1, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 R = _mm_shuffle_ps(x0, x1, _MM_SHUFFLE(3, 1, 3, 1));
+    return _mm_max_ps(L, R);
+}
+
+#include "qadrc_simd_tmpl.h"
+
+/*
+ * AVX2 with FMA, 8 floats
+ */
+#define ISA avx2
+#define TARGET __attribute__((target("avx2,fma")))
+#define W 8
+#define VF __m256
+#define VI __m256i
+#define LOAD _mm256_loadu_ps
+#define STORE _mm256_storeu_ps
+#define SET1 _mm256_set1_ps
+#define SET1I _mm256_set1_epi32
+#define ADD _mm256_add_ps
+#define MUL _mm256_mul_ps
+#define MIN _mm256_min_ps
+#define MAX _mm256_max_ps
+#define ANDI _mm256_and_si256
+#define ORI _mm256_or_si256
+#define SRAI _mm256_srai_epi32
+#define F2I _mm256_cvttps_epi32
+#define I2F _mm256_cvtepi32_ps
+#define ASI _mm256_castps_si256
+#define ASF _mm256_castsi256_ps
+#define ABS(x) ASF(ANDI(ASI(x), SET1I(0x7FFFFFFF)))
+#define SELECT_LT(x, y, a, b) _mm256_blendv_ps(b, a, _mm256_cmp_ps(x, y, _CMP_LT_OQ))
+#define MAX_PAIRS max_pairs_avx2
+#define DUP_PAIRS(c, c0, c1) dup_pairs_avx2(c, &c0, &c1)
+#define DW 4
+#define VD __m256d
+#define LOADD _mm256_loadu_pd
+#define STORED _mm256_storeu_pd
+#define LOADD_PS(p) _mm256_cvtps_pd(_mm_loadu_ps(p))
+#define STORED_PS(p, x) _mm_storeu_ps(p, _mm256_cvtpd_ps(x))
+#define SET1D _mm256_set1_pd
+#define ADDD _mm256_add_pd
+#define SUBD _mm256_sub_pd
+#define MULD _mm256_mul_pd
+#define MULADDD _mm256_fmadd_pd
+#define MIND _mm256_min_pd
+#define SELECT_LT_D(x, y, a, b) _mm256_blendv_pd(b, a, _mm256_cmp_pd(x, y, _CMP_LT_OQ))
+#define SMOOTH_NARROW qadrc_smooth_sse2
+
+/* the shuffles work within 128-bit lanes, hence the extra permutes */
+TARGET static inline __m256 max_pairs_avx2(__m256 x0, __m256 x1)
+{
+    __m256 L = _mm256_shuffle_ps(x0, x1, _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 R = _mm256_shuffle_ps(x0, x1, _MM_SHUFFLE(3, 1, 3, 1));
+    __m256d m = _mm256_castps_pd(_mm256_max_ps(L, R));
+    return _mm256_castpd_ps(_mm256_permute4x64_pd(m, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+TARGET static inline void dup_pairs_avx2(__m256 c, __m256 *c0, __m256 *c1)
+{
+    __m256 lo = _mm256_unpacklo_ps(c, c);
+    __m256 hi = _mm256_unpackhi_ps(c, c);
+    *c0 = _mm256_permute2f128_ps(lo, hi, 0x20);
+    *c1 = _mm256_permute2f128_ps(lo, hi, 0x31);
+}
+
+#include "qadrc_simd_tmpl.h"
+
+/*
+ * AVX-512F, 16 floats; every CPU with AVX-512 has FMA, too
+ */
+#define ISA avx512
+#define TARGET __attribute__((target("avx512f,fma")))
+#define W 16
+#define VF __m512
+#define VI __m512i
+#define LOAD _mm512_loadu_ps
+#define STORE _mm512_storeu_ps
+#define SET1 _mm512_set1_ps
+#define SET1I _mm512_set1_epi32
+#define ADD _mm512_add_ps
+#define MUL _mm512_mul_ps
+#define MIN _mm512_min_ps
+#define MAX _mm512_max_ps
+#define ANDI _mm512_and_si512
+#define ORI _mm512_or_si512
+#define SRAI _mm512_srai_epi32
+#define F2I _mm512_cvttps_epi32
+#define I2F _mm512_cvtepi32_ps
+#define ASI _mm512_castps_si512
+#define ASF _mm512_castsi512_ps
+#define ABS _mm512_abs_ps
+#define SELECT_LT(x, y, a, b) _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x, y, _CMP_LT_OQ), b, a)
+#define MAX_PAIRS max_pairs_avx512
+#define DUP_PAIRS(c, c0, c1) dup_pairs_avx512(c, &c0, &c1)
+/* 8 doubles would leave 5.1 to the C loop; 4 of them take two groups */
+#define DW 4
+#define VD __m256d
+#define LOADD _mm256_loadu_pd
+#define STORED _mm256_storeu_pd
+#define LOADD_PS(p) _mm256_cvtps_pd(_mm_loadu_ps(p))
+#define STORED_PS(p, x) _mm_storeu_ps(p, _mm256_cvtpd_ps(x))
+#define SET1D _mm256_set1_pd
+#define ADDD _mm256_add_pd
+#define SUBD _mm256_sub_pd
+#define MULD _mm256_mul_pd
+#define MULADDD _mm256_fmadd_pd
+#define MIND _mm256_min_pd
+#define SELECT_LT_D(x, y, a, b) _mm256_blendv_pd(b, a, _mm256_cmp_pd(x, y, _CMP_LT_OQ))
+#define SMOOTH_NARROW qadrc_smooth_sse2
+
+TARGET static inline __m512 max_pairs_avx512(__m512 x0, __m512 x1)
+{
+    const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14,
+	    16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i odd = _mm512_add_epi32(even, _mm512_set1_epi32(1));
+    __m512 L = _mm512_permutex2var_ps(x0, even, x1);
+    __m512 R = _mm512_permutex2var_ps(x0, odd, x1);
+    return _mm512_max_ps(L, R);
+}
+
+TARGET static inline void dup_pairs_avx512(__m512 c, __m512 *c0, __m512 *c1)
+{
+    const __m512i lo = _mm512_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3,
+	    4, 4, 5, 5, 6, 6, 7, 7);
+    const __m512i hi = _mm512_add_epi32(lo, _mm512_set1_epi32(8));
+    *c0 = _mm512_permutexvar_ps(lo, c);
+    *c1 = _mm512_permutexvar_ps(hi, c);
+}
+
+#include "qadrc_simd_tmpl.h"
+
+#endif
+
+#define SET_KERNELS(k, prec, isa) \
+    ((k)->peak = qadrc_peak##prec##_##isa, (k)->gain = qadrc_gain##prec##_##isa, \
+     (k)->smooth = qadrc_smooth_##isa)
+
+bool qadrc_simd_kernels(int isa, int prec, struct qadrc_kernels *k)
+{
+    if (isa == QADRC_ISA_C) {
+	switch (prec) {
+	case QADRC_PRECISION_FAST: SET_KERNELS(k, _fast, c); break;
+	case QADRC_PRECISION_EXACT: SET_KERNELS(k, _exact, c); break;
+	default: SET_KERNELS(k, , c);
+	}
+	return true;
+    }
+    if (prec == QADRC_PRECISION_EXACT)
+	return false;
+    bool fast = prec == QADRC_PRECISION_FAST;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    switch (isa) {
+    case QADRC_ISA_SSE2:
+	if (!__builtin_cpu_supports("sse2"))
+	    return false;
+	if (fast)
+	    SET_KERNELS(k, _fast, sse2);
+	else
+	    SET_KERNELS(k, , sse2);
+	return true;
+    case QADRC_ISA_AVX2:
+	if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma"))
+	    return false;
+	if (fast)
+	    SET_KERNELS(k, _fast, avx2);
+	else
+	    SET_KERNELS(k, , avx2);
+	return true;
+    case QADRC_ISA_AVX512:
+	if (!__builtin_cpu_supports("avx512f") || !__builtin_cpu_supports("fma"))
+	    return false;
+	if (fast)
+	    SET_KERNELS(k, _fast, avx512);
+	else
+	    SET_KERNELS(k, , avx512);
+	return true;
+    }
+#endif
+    (void) fast;
+    return false;
+}
@@ -0,0 +1,128 @@
+/*
+ * qadrc_simd.h - the kernels behind qadrc_chew() and qadrc_apply()
+ *
+ * Written by Alexey Tourbin.
+ * This file is distributed as Public Domain.
+ *
+ * This header is internal to libqadrc.
+ */
+
+#ifndef QADRC_SIMD_H
+#define QADRC_SIMD_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <math.h>
+
+/* peak level among channels, in dB: a[i] = scale_to_dB(max |x[c][off+i]|) */
+typedef void (*qadrc_peak_fn)(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a);
+
+/* gain, in dB, converted to linear and applied to all channels;
+ * a[] is clobbered */
+typedef void (*qadrc_gain_fn)(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a);
+
+/* the gain computer and the smoothing, for the unlinked channels */
+struct qadrc_detector {
+    double thresh;
+    double slope;
+    double Tlo;
+    double Thi;
+    double knee_factor;
+    double alphaA;
+    double alphaR;
+};
+
+/* the levels x[i*stride+c], c < nc, in dB, through the gain computer and
+ * the smoothing of channel c, yR[c] and yA[c], into a[i*stride+c]; x and a
+ * do not overlap */
+typedef void (*qadrc_smooth_fn)(const struct qadrc_detector *d,
+	double *yR, double *yA, const float *x, float *a, size_t n,
+	unsigned nc, unsigned stride);
+
+struct qadrc_kernels {
+    qadrc_peak_fn peak;
+    qadrc_gain_fn gain;
+    qadrc_smooth_fn smooth;
+};
+
+/* the C kernels, in qadrc.c, one pair per QADRC_PRECISION_*, and the
+ * smoothing; the vector kernels use them for the tails */
+void qadrc_peak_c(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a);
+void qadrc_gain_c(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a);
+void qadrc_peak_fast_c(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a);
+void qadrc_gain_fast_c(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a);
+void qadrc_peak_exact_c(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a);
+void qadrc_gain_exact_c(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a);
+void qadrc_smooth_c(const struct qadrc_detector *d,
+	double *yR, double *yA, const float *x, float *a, size_t n,
+	unsigned nc, unsigned stride);
+
+/*
+ * The channel loops for more than two channels (planar ones run over the
+ * channels in the outer loop, so that the inner loop is a plain vector one), the peak level max |x| into
+ * a[], and the multiplication by the linear gain in a[].  They are written
+ * once, for any nc, and instantiated by QADRC_NC() with nc = 6 and nc = 8
+ * (5.1 and 7.1) as constants: the channel loop is then fully unrolled and
+ * the compiler vectorizes across the samples.  Both qadrc.c and the vector
+ * kernels use them, the latter with their own target instruction set.
+ */
+#define QADRC_NC(f, nc, ...) \
+    ((nc) == 6 ? f(6, __VA_ARGS__) : (nc) == 8 ? f(8, __VA_ARGS__) : f(nc, __VA_ARGS__))
+
+static inline __attribute__((always_inline))
+void qadrc_peak_packed(const unsigned nc, const float *x, size_t n, float *a)
+{
+    for (size_t i = 0; i < n; i++, x += nc) {
+	float xL = fabsf(x[0]);
+	for (unsigned k = 1; k < nc; k++)
+	    xL = fmaxf(xL, fabsf(x[k]));
+	a[i] = xL;
+    }
+}
+
+static inline __attribute__((always_inline))
+void qadrc_peak_planar(const unsigned nc, float *const *data, size_t off,
+	size_t n, float *a)
+{
+    const float *x = data[0] + off;
+    for (size_t i = 0; i < n; i++)
+	a[i] = fabsf(x[i]);
+    for (unsigned j = 1; j < nc; j++) {
+	x = data[j] + off;
+	for (size_t i = 0; i < n; i++)
+	    a[i] = fmaxf(a[i], fabsf(x[i]));
+    }
+}
+
+static inline __attribute__((always_inline))
+void qadrc_gain_packed(const unsigned nc, float *x, size_t n, const float *a)
+{
+    for (size_t i = 0; i < n; i++, x += nc)
+	for (unsigned k = 0; k < nc; k++)
+	    x[k] *= a[i];
+}
+
+static inline __attribute__((always_inline))
+void qadrc_gain_planar(const unsigned nc, float *const *data, size_t off,
+	size_t n, const float *a)
+{
+    for (unsigned j = 0; j < nc; j++) {
+	float *x = data[j] + off;
+	for (size_t i = 0; i < n; i++)
+	    x[i] *= a[i];
+    }
+}
+
+/* the kernels for QADRC_ISA_* and QADRC_PRECISION_*, returns false if
+ * the CPU cannot run them; the vector kernels have no exact precision */
+bool qadrc_simd_kernels(int isa, int prec, struct qadrc_kernels *k);
+
+#endif
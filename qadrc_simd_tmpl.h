@@ -0,0 +1,252 @@
+/*
+ * qadrc_simd_tmpl.h - vector kernels, instantiated once per instruction set
+ *
+ * Written by Alexey Tourbin.
+ * This file is distributed as Public Domain.
+ *
+ * Included from qadrc_simd.c with ISA, TARGET, W (floats per vector),
+ * the VF/VI vector types and the operations below defined, and likewise
+ * DW and VD, for the vectors of doubles.  The math
+ * follows expapprox() and logapprox() from simd_math_prims.h, and their
+ * _fast versions, so that the vector kernels agree with the C ones up
+ * to rounding.
+ */
+
+#define CAT_(a, b) a##_##b
+#define CAT(a, b) CAT_(a, b)
+#define FN(name) CAT(name, ISA)
+
+/* logapprox() for positive inputs */
+TARGET static inline VF FN(logv)(VF val, const bool fast)
+{
+    VI i = ASI(val);
+    VF exp = I2F(SRAI(i, 23));
+    VF x = ASF(ORI(ANDI(i, SET1I(0x7FFFFF)), SET1I(0x3F800000)));
+    VF p;
+    if (fast) {
+	p = ADD(SET1(-0.73456005542f), MUL(x, SET1(0.11036302814f)));
+	p = ADD(SET1(2.1242861498f), MUL(x, p));
+	return ADD(MUL(x, p), ADD(SET1(-89.529781054f), MUL(SET1(0.6931471805f), exp)));
+    }
+    p = ADD(SET1(-0.288739945f), MUL(x, SET1(3.110401639e-2f)));
+    p = ADD(SET1(1.130626167f), MUL(x, p));
+    p = ADD(SET1(-2.461222105f), MUL(x, p));
+    p = ADD(SET1(3.529304993f), MUL(x, p));
+    return ADD(MUL(x, p), ADD(SET1(-89.970756366f), MUL(SET1(0.6931471805f), exp)));
+}
+
+TARGET static inline VF FN(expv)(VF val, const bool fast)
+{
+    VF val2 = ADD(MUL(SET1(12102203.1615614f), val), SET1(1065353216.f));
+    VF val4 = MAX(MIN(val2, SET1(2139095040.f)), SET1(0.f));
+    VI i = F2I(val4);
+    VF xu = ASF(ANDI(i, SET1I(0x7F800000)));
+    VF b = ASF(ORI(ANDI(i, SET1I(0x7FFFFF)), SET1I(0x3F800000)));
+    VF p;
+    if (fast) {
+	p = ADD(SET1(-8.4962283058e-3f), MUL(b, SET1(7.8267970193e-2f)));
+	p = ADD(SET1(0.47761289356f), MUL(b, p));
+	p = ADD(SET1(0.45261536455f), MUL(b, p));
+	return MUL(xu, p);
+    }
+    p = ADD(SET1(-2.190619930e-3f), MUL(b, SET1(1.3555747234e-2f)));
+    p = ADD(SET1(0.166617139f), MUL(b, p));
+    p = ADD(SET1(0.312146713f), MUL(b, p));
+    p = ADD(SET1(0.509871020f), MUL(b, p));
+    return MUL(xu, p);
+}
+
+TARGET static inline VF FN(to_dB)(VF x, const bool fast)
+{
+    VF dB = MUL(SET1(20.0f*0.4342944819f), FN(logv)(x, fast));
+    return SELECT_LT(x, SET1(1e-6f), SET1(-120.f), dB);
+}
+
+TARGET static inline VF FN(to_scale)(VF dB, const bool fast)
+{
+    return FN(expv)(MUL(SET1(2.302585093f*0.05f), dB), fast);
+}
+
+/* the kernels are instantiated below for the balanced and fast precision */
+TARGET static inline __attribute__((always_inline))
+void FN(peak)(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a, const bool fast)
+{
+    size_t i = 0;
+    if (fmt == QADRC_FLTP || nc == 1) {
+	for (; i + W <= n; i += W) {
+	    VF xL = ABS(LOAD(data[0] + off + i));
+	    for (unsigned j = 1; j < nc; j++)
+		xL = MAX(xL, ABS(LOAD(data[j] + off + i)));
+	    STORE(a + i, FN(to_dB)(xL, fast));
+	}
+    }
+    else if (nc == 2) {
+	const float *x = data[0] + 2 * off;
+	for (; i + W <= n; i += W) {
+	    VF x0 = ABS(LOAD(x + 2 * i));
+	    VF x1 = ABS(LOAD(x + 2 * i + W));
+	    STORE(a + i, FN(to_dB)(MAX_PAIRS(x0, x1), fast));
+	}
+    }
+    else {
+	/* Interleaved samples of more than two channels do not map onto
+	 * vector lanes, the peak level is found in a separate pass. */
+	size_t nv = n / W * W;
+	QADRC_NC(qadrc_peak_packed, nc, data[0] + nc * off, nv, a);
+	for (; i < nv; i += W)
+	    STORE(a + i, FN(to_dB)(LOAD(a + i), fast));
+    }
+    if (i < n)
+	(fast ? qadrc_peak_fast_c : qadrc_peak_c)(data, off + i, n - i, nc, fmt, a + i);
+}
+
+TARGET static inline __attribute__((always_inline))
+void FN(gain)(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a, const bool fast)
+{
+    size_t i = 0;
+    if (fmt == QADRC_FLTP || nc == 1) {
+	for (; i + W <= n; i += W) {
+	    VF cL = FN(to_scale)(LOAD(a + i), fast);
+	    for (unsigned j = 0; j < nc; j++) {
+		float *x = data[j] + off + i;
+		STORE(x, MUL(LOAD(x), cL));
+	    }
+	}
+    }
+    else if (nc == 2) {
+	float *x = data[0] + 2 * off;
+	for (; i + W <= n; i += W) {
+	    VF c0, c1;
+	    DUP_PAIRS(FN(to_scale)(LOAD(a + i), fast), c0, c1);
+	    STORE(x + 2 * i, MUL(LOAD(x + 2 * i), c0));
+	    STORE(x + 2 * i + W, MUL(LOAD(x + 2 * i + W), c1));
+	}
+    }
+    else {
+	size_t nv = n / W * W;
+	for (; i < nv; i += W)
+	    STORE(a + i, FN(to_scale)(LOAD(a + i), fast));
+	QADRC_NC(qadrc_gain_packed, nc, data[0] + nc * off, nv, a);
+    }
+    if (i < n)
+	(fast ? qadrc_gain_fast_c : qadrc_gain_c)(data, off + i, n - i, nc, fmt, a + i);
+}
+
+/*
+ * The unlinked smoothing, DW channels in a vector of doubles.  The channels
+ * are taken in groups of DW, two groups at a time, as two chains which
+ * overlap in the pipeline.  In the last pair, the second group is moved back
+ * to end at nc, and may overlap the first one, which then gets the same
+ * values twice; fewer than DW channels left go to the narrower kernel.
+ */
+TARGET static inline __attribute__((always_inline))
+VD FN(smooth1)(const struct qadrc_detector *d, VD xG, VD *yR, VD *yA)
+{
+    const VD eps = SET1D(1e-120);
+    VD delta = ADDD(xG, SET1D(-d->Tlo));
+    VD yG = SELECT_LT_D(SET1D(d->Thi), xG,
+	    MULD(SET1D(d->slope), ADDD(xG, SET1D(-d->thresh))),
+	    MULD(MULD(delta, delta), SET1D(d->knee_factor)));
+    yG = SELECT_LT_D(xG, SET1D(d->Tlo), SET1D(0.0), yG);
+    /* one multiply-add on the loop-carried path of each stage */
+    VD r = MULADDD(SET1D(d->alphaR), *yR, MULD(SET1D(1.0 - d->alphaR), yG));
+    *yR = MIND(yG, SUBD(ADDD(r, eps), eps));
+    VD t = MULADDD(SET1D(d->alphaA), *yA, MULD(SET1D(1.0 - d->alphaA), *yR));
+    *yA = SUBD(ADDD(t, eps), eps);
+    return *yA;
+}
+
+TARGET void FN(qadrc_smooth)(const struct qadrc_detector *d,
+	double *yR, double *yA, const float *x, float *a, size_t n,
+	unsigned nc, unsigned stride)
+{
+    /* a copy, which the stores to a[] cannot alias */
+    const struct qadrc_detector dc = *d;
+    for (unsigned c = 0; c < nc; c += 2 * DW) {
+	if (nc - c < DW) {
+	    SMOOTH_NARROW(d, yR + c, yA + c, x + c, a + c, n, nc - c, stride);
+	    break;
+	}
+	unsigned c0 = c;
+	unsigned c1 = c + 2 * DW <= nc ? c + DW : nc - DW;
+	VD yR0 = LOADD(yR + c0), yA0 = LOADD(yA + c0);
+	VD yR1 = LOADD(yR + c1), yA1 = LOADD(yA + c1);
+	for (size_t i = 0; i < n; i++) {
+	    size_t k = i * stride;
+	    VD y0 = FN(smooth1)(&dc, LOADD_PS(x + k + c0), &yR0, &yA0);
+	    VD y1 = FN(smooth1)(&dc, LOADD_PS(x + k + c1), &yR1, &yA1);
+	    STORED_PS(a + k + c0, y0);
+	    STORED_PS(a + k + c1, y1);
+	}
+	STORED(yR + c0, yR0), STORED(yA + c0, yA0);
+	STORED(yR + c1, yR1), STORED(yA + c1, yA1);
+    }
+}
+
+TARGET void FN(qadrc_peak)(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a)
+{
+    FN(peak)(data, off, n, nc, fmt, a, false);
+}
+
+TARGET void FN(qadrc_gain)(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a)
+{
+    FN(gain)(data, off, n, nc, fmt, a, false);
+}
+
+TARGET void FN(qadrc_peak_fast)(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a)
+{
+    FN(peak)(data, off, n, nc, fmt, a, true);
+}
+
+TARGET void FN(qadrc_gain_fast)(float *const *data, size_t off, size_t n,
+	unsigned nc, int fmt, float *a)
+{
+    FN(gain)(data, off, n, nc, fmt, a, true);
+}
+
+#undef CAT_
+#undef CAT
+#undef FN
+#undef ISA
+#undef TARGET
+#undef W
+#undef VF
+#undef VI
+#undef LOAD
+#undef STORE
+#undef SET1
+#undef SET1I
+#undef ADD
+#undef MUL
+#undef MIN
+#undef MAX
+#undef ANDI
+#undef ORI
+#undef SRAI
+#undef F2I
+#undef I2F
+#undef ASI
+#undef ASF
+#undef ABS
+#undef SELECT_LT
+#undef MAX_PAIRS
+#undef DUP_PAIRS
+#undef DW
+#undef VD
+#undef LOADD
+#undef STORED
+#undef LOADD_PS
+#undef STORED_PS
+#undef SET1D
+#undef ADDD
+#undef SUBD
+#undef MULD
+#undef MULADDD
+#undef MIND
+#undef SELECT_LT_D
+#undef SMOOTH_NARROW
@@ -0,0 +1,524 @@
+/*
+ * qalimiter - stray spike limiter
+ *
+ * Written by Alexey Tourbin.
+ * Based on qaac limiter by nu774.
+ * This file is distributed as Public Domain.
+ *
+ * Description by nu774:
+ * When limiter is on, qaac will apply smart limiter that only affects
+ * portions surrounding peaks beyond (near) 0dBFS. It will search peaks,
+ * then applies non-linear filter to half cycle (zero-crossing point
+ * to next zero-crossing point) surrounding each peak. The result falls
+ * within 0dBFS range and still is smoothly connected to other parts,
+ * and has much less audible distortions than simple dumb hard clip.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <sys/types.h>
+#include "libqadrc.h"
+
+#define m_thresh 0.8912509f /* -1 dBFS */
+
+/* the searches look at this many samples at a time */
+#define RUN 16
+
+/* a block of samples, e.g. an AVFrame; hot if any of its samples is
+ * beyond the threshold, the peaks are only searched for in such blocks;
+ * start is the position of its first sample in the input */
+struct block {
+    float *const *data;
+    size_t nb_samples;
+    size_t start;
+    void *opaque;
+    bool writable;
+    bool hot;
+};
+
+struct qalimiter {
+    unsigned nc;
+    int fmt;
+    /* the buffers per block, and the bytes per sample in each */
+    unsigned nbufs;
+    size_t width;
+    void (*fix_spikes)(qalimiter *s, int ch,
+	    int fi1, size_t f1_pos, int fi2, size_t f2_end);
+    size_t (*find_channel_end)(struct block *frame, unsigned nc, int ch);
+    bool (*any_peak)(qalimiter *s, unsigned nc, int ch,
+	    int fi1, size_t f1_pos, int fi2, size_t f2_end);
+    bool (*block_hot)(float *const *data, size_t n, unsigned nc);
+    bool (*gain_hot)(float *const *data, size_t n, unsigned nc, double gain);
+    void (*quantize)(uint32_t *seed, void *const *out, bool opacked,
+	    int bits, float *const *in, size_t n, unsigned nc);
+    /* the gain applied on push, and the dither state */
+    double gain;
+    uint32_t seed;
+    qalimiter_writable_fn writable;
+    void *arg;
+    /* the queue, a ring of nalloc (a power of two) blocks from head;
+     * it only grows if there is no limit on the blocks */
+    struct block *frames;
+    size_t head;
+    size_t nframes;
+    size_t nalloc;
+    /* the samples pushed so far, and the latency limits (0 if none):
+     * a channel which lags behind by more than max_samples, or any
+     * channel once the queue holds max_blocks, is cut at the end of the
+     * last block, as if it crossed zero there */
+    size_t total;
+    size_t max_samples;
+    size_t max_blocks;
+    int *fi; /* frame index, per channel */
+    size_t *fpos; /* position in the frame up to which the input has been processed */
+    /* the jobs, one if threads <= 1; for each channel, the end up to which
+     * it is processed in the last frame (0 if not at all), and whether
+     * there are spikes up to there */
+    qadrc_execute_fn execute;
+    void *exec_arg;
+    unsigned threads;
+    size_t *ends;
+    bool *peaks;
+    /* streaming interface: the leading block is being output */
+    size_t out_pos;
+};
+
+/* the i-th queued block */
+#define FRAME(s, i) (&(s)->frames[((s)->head + (i)) & ((s)->nalloc - 1)])
+
+/* make sure the block can be modified */
+static int writable(qalimiter *s, struct block *frame)
+{
+    if (frame->writable)
+	return 0;
+    if (s->writable) {
+	float *const *data = s->writable(s->arg, &frame->opaque);
+	if (!data)
+	    return -1;
+	frame->data = data;
+    }
+    frame->writable = true;
+    return 0;
+}
+
+/* the spike search and fix for each layout */
+#define FMT flt
+#define T float
+#define PACKED 1
+#include "qalimiter_tmpl.h"
+#define FMT fltp
+#define T float
+#define PACKED 0
+#include "qalimiter_tmpl.h"
+#define FMT dbl
+#define T double
+#define PACKED 1
+#include "qalimiter_tmpl.h"
+#define FMT dblp
+#define T double
+#define PACKED 0
+#include "qalimiter_tmpl.h"
+
+qalimiter *qalimiter_create(unsigned nc, int fmt,
+	qalimiter_writable_fn writable, void *arg)
+{
+    qalimiter *s = calloc(1, sizeof *s);
+    if (!s)
+	return NULL;
+    s->nc = nc;
+    s->fmt = fmt;
+    bool packed = fmt == QADRC_FLT || fmt == QADRC_DBL;
+    size_t size = fmt == QADRC_DBL || fmt == QADRC_DBLP ? sizeof(double) : sizeof(float);
+    s->nbufs = packed ? 1 : nc;
+    s->width = packed ? nc * size : size;
+    switch (fmt) {
+    case QADRC_FLT:
+	s->fix_spikes = fix_spikes_flt;
+	s->find_channel_end = find_channel_end_flt;
+	s->any_peak = any_peak_flt;
+	s->block_hot = block_hot_flt;
+	s->gain_hot = gain_hot_flt;
+	s->quantize = quantize_flt;
+	break;
+    case QADRC_FLTP:
+	s->fix_spikes = fix_spikes_fltp;
+	s->find_channel_end = find_channel_end_fltp;
+	s->any_peak = any_peak_fltp;
+	s->block_hot = block_hot_fltp;
+	s->gain_hot = gain_hot_fltp;
+	s->quantize = quantize_fltp;
+	break;
+    case QADRC_DBL:
+	s->fix_spikes = fix_spikes_dbl;
+	s->find_channel_end = find_channel_end_dbl;
+	s->any_peak = any_peak_dbl;
+	s->block_hot = block_hot_dbl;
+	s->gain_hot = gain_hot_dbl;
+	s->quantize = quantize_dbl;
+	break;
+    case QADRC_DBLP:
+	s->fix_spikes = fix_spikes_dblp;
+	s->find_channel_end = find_channel_end_dblp;
+	s->any_peak = any_peak_dblp;
+	s->block_hot = block_hot_dblp;
+	s->gain_hot = gain_hot_dblp;
+	s->quantize = quantize_dblp;
+	break;
+    default:
+	free(s);
+	return NULL;
+    }
+    s->writable = writable;
+    s->arg = arg;
+    s->gain = 1;
+    s->seed = 1;
+    s->fi = calloc(nc, sizeof *s->fi);
+    s->fpos = calloc(nc, sizeof *s->fpos);
+    s->ends = calloc(nc, sizeof *s->ends);
+    s->peaks = calloc(nc, sizeof *s->peaks);
+    if (!s->fi || !s->fpos || !s->ends || !s->peaks) {
+	qalimiter_destroy(s);
+	return NULL;
+    }
+    return s;
+}
+
+/* the blocks owned by the streaming interface */
+static bool owned(struct block *frame)
+{
+    return frame->opaque == frame->data;
+}
+
+void qalimiter_destroy(qalimiter *s)
+{
+    if (!s)
+	return;
+    for (size_t i = 0; i < s->nframes; i++)
+	if (owned(FRAME(s, i)))
+	    free(FRAME(s, i)->opaque);
+    free(s->frames);
+    free(s->fi);
+    free(s->fpos);
+    free(s->ends);
+    free(s->peaks);
+    free(s);
+}
+
+/* the number of leading frames which are done, across all channels */
+static int frames_done(qalimiter *s)
+{
+    int fiend = s->fi[0];
+    for (unsigned ch = 1; ch < s->nc; ch++)
+	if (s->fi[ch] < fiend)
+	    fiend = s->fi[ch];
+    return fiend;
+}
+
+void qalimiter_set_threads(qalimiter *s, qadrc_execute_fn execute, void *arg,
+	unsigned nb_threads)
+{
+    s->execute = execute;
+    s->exec_arg = arg;
+    s->threads = execute ? nb_threads : 1;
+}
+
+bool qalimiter_set_max_latency(qalimiter *s, size_t samples, size_t blocks)
+{
+    assert(s->nframes == 0);
+    s->max_samples = samples;
+    s->max_blocks = blocks;
+    if (blocks == 0)
+	return true;
+    size_t nalloc = 1;
+    while (nalloc < blocks)
+	nalloc *= 2;
+    struct block *frames = malloc(nalloc * sizeof *frames);
+    if (!frames)
+	return false;
+    free(s->frames);
+    s->frames = frames;
+    s->head = 0;
+    s->nalloc = nalloc;
+    return true;
+}
+
+/* whether channel ch, done up to end in the last frame (or where it is,
+ * if end is 0), lags behind beyond the limits */
+static bool too_late(qalimiter *s, unsigned ch, size_t end)
+{
+    if (s->max_blocks && s->nframes >= s->max_blocks)
+	return true;
+    if (s->max_samples == 0)
+	return false;
+    size_t pos;
+    if (end)
+	pos = FRAME(s, s->nframes-1)->start + end;
+    else if (s->fi[ch] == (int) s->nframes)
+	pos = s->total;
+    else
+	pos = FRAME(s, s->fi[ch])->start + s->fpos[ch];
+    return s->total - pos > s->max_samples;
+}
+
+/* the end of channel ch in the last frame, up to its last zero crossing,
+ * or all of it at the end of the input or past the latency limits;
+ * 0 if there is nothing to do */
+static size_t channel_end(qalimiter *s, unsigned ch, bool eof)
+{
+    struct block *last = FRAME(s, s->nframes-1);
+    size_t end = eof ? 0 : s->find_channel_end(last, s->nc, ch);
+    if (eof || too_late(s, ch, end))
+	return s->fi[ch] == (int) s->nframes ? 0 : last->nb_samples;
+    return end;
+}
+
+/* the channel is done up to end in the last frame */
+static void advance(qalimiter *s, unsigned ch, size_t end)
+{
+    if (end == FRAME(s, s->nframes-1)->nb_samples) {
+	s->fi[ch] = s->nframes;
+	s->fpos[ch] = 0;
+    }
+    else {
+	s->fi[ch] = s->nframes - 1;
+	s->fpos[ch] = end;
+    }
+}
+
+/* The channels are independent, each job gets its share of them.
+ * The search for the peaks only reads the samples; the frames are then
+ * made writable in one go, and the spikes are fixed. */
+struct channel_job {
+    qalimiter *s;
+    bool eof;
+};
+
+static void search_job(void *arg, unsigned jobnr, unsigned nb_jobs)
+{
+    struct channel_job *j = arg;
+    qalimiter *s = j->s;
+    unsigned end = s->nc * (jobnr + 1) / nb_jobs;
+    for (unsigned ch = s->nc * jobnr / nb_jobs; ch < end; ch++) {
+	size_t e = s->ends[ch] = channel_end(s, ch, j->eof);
+	s->peaks[ch] = e && s->any_peak(s, s->nc, ch,
+		s->fi[ch], s->fpos[ch], s->nframes - 1, e);
+    }
+}
+
+static void fix_job(void *arg, unsigned jobnr, unsigned nb_jobs)
+{
+    struct channel_job *j = arg;
+    qalimiter *s = j->s;
+    unsigned end = s->nc * (jobnr + 1) / nb_jobs;
+    for (unsigned ch = s->nc * jobnr / nb_jobs; ch < end; ch++) {
+	if (s->ends[ch] == 0) // no intersection with the x-axis
+	    continue;
+	if (s->peaks[ch])
+	    s->fix_spikes(s, ch,
+		    s->fi[ch], s->fpos[ch], s->nframes - 1, s->ends[ch]);
+	advance(s, ch, s->ends[ch]);
+    }
+}
+
+/* fix the spikes of all channels up to their ends in the last frame */
+static int fix_channels(qalimiter *s, bool eof)
+{
+    unsigned nch = s->nc;
+
+    /* with no hot blocks, the channels only move on to their ends */
+    int hot = frames_done(s);
+    while (hot < (int) s->nframes && !FRAME(s, hot)->hot)
+	hot++;
+    if (hot == (int) s->nframes) {
+	for (unsigned ch = 0; ch < nch; ch++) {
+	    size_t end = channel_end(s, ch, eof);
+	    if (end)
+		advance(s, ch, end);
+	}
+	return frames_done(s);
+    }
+
+    if (s->threads <= 1 || nch == 1) {
+	for (unsigned ch = 0; ch < nch; ch++) {
+	    size_t end = channel_end(s, ch, eof);
+	    if (end == 0) // no intersection with the x-axis
+		continue;
+	    s->fix_spikes(s, ch,
+		    s->fi[ch], s->fpos[ch], s->nframes - 1, end);
+	    advance(s, ch, end);
+	}
+	return frames_done(s);
+    }
+
+    struct channel_job j = { s, eof };
+    unsigned jobs = nch < s->threads ? nch : s->threads;
+    s->execute(s->exec_arg, search_job, &j, jobs);
+
+    int fi1 = s->nframes;
+    for (unsigned ch = 0; ch < nch; ch++)
+	if (s->peaks[ch] && s->fi[ch] < fi1)
+	    fi1 = s->fi[ch];
+    if (fi1 == (int) s->nframes) {
+	/* no spikes */
+	for (unsigned ch = 0; ch < nch; ch++)
+	    if (s->ends[ch])
+		advance(s, ch, s->ends[ch]);
+	return frames_done(s);
+    }
+    for (int fi = fi1; fi < (int) s->nframes; fi++)
+	if (writable(s, FRAME(s, fi)) < 0) {
+	    /* the callback is then left to the serial loop */
+	    jobs = 1;
+	    break;
+	}
+    if (jobs > 1)
+	s->execute(s->exec_arg, fix_job, &j, jobs);
+    else
+	fix_job(&j, 0, 1);
+    return frames_done(s);
+}
+
+int qalimiter_push(qalimiter *s, float *const *data, size_t n, void *opaque)
+{
+    if (s->nframes == s->nalloc) {
+	if (s->max_blocks)
+	    return -1;
+	/* the ring is unrolled into the new one */
+	size_t nalloc = s->nalloc ? 2 * s->nalloc : 16;
+	struct block *frames = malloc(nalloc * sizeof *frames);
+	if (!frames)
+	    return -1;
+	for (size_t i = 0; i < s->nframes; i++)
+	    frames[i] = *FRAME(s, i);
+	free(s->frames);
+	s->frames = frames;
+	s->head = 0;
+	s->nalloc = nalloc;
+    }
+    s->nframes++;
+    struct block *frame = FRAME(s, s->nframes-1);
+    *frame = (struct block) { data, n, s->total, opaque, false, false };
+    if (s->gain != 1) {
+	if (writable(s, frame) < 0) {
+	    s->nframes--;
+	    return -1;
+	}
+	frame->hot = s->gain_hot(frame->data, n, s->nc, s->gain);
+    }
+    else
+	frame->hot = s->block_hot(data, n, s->nc);
+    s->total += n;
+
+    return fix_channels(s, false);
+}
+
+int qalimiter_finish(qalimiter *s)
+{
+    if (s->nframes == 0)
+	return 0;
+    return fix_channels(s, true);
+}
+
+void qalimiter_set_gain(qalimiter *s, double gain)
+{
+    s->gain = gain;
+}
+
+bool qalimiter_quantize(qalimiter *s, void *const *out, int ofmt,
+	float *const *in, size_t n)
+{
+    switch (ofmt) {
+    case QADRC_S16:
+    case QADRC_S16P:
+    case QADRC_S32:
+    case QADRC_S32P:
+	break;
+    default:
+	return false;
+    }
+    bool opacked = ofmt == QADRC_S16 || ofmt == QADRC_S32;
+    int bits = ofmt == QADRC_S16 || ofmt == QADRC_S16P ? 16 : 32;
+    s->quantize(&s->seed, out, opacked, bits, in, n, s->nc);
+    return true;
+}
+
+size_t qalimiter_queued(const qalimiter *s)
+{
+    return s->nframes;
+}
+
+void *qalimiter_opaque(const qalimiter *s, size_t i)
+{
+    assert(i < s->nframes);
+    return FRAME(s, i)->opaque;
+}
+
+void qalimiter_release(qalimiter *s, size_t n)
+{
+    assert((int) n <= frames_done(s));
+    s->nframes -= n;
+    s->head = (s->head + n) & (s->nalloc - 1);
+    for (unsigned ch = 0; ch < s->nc; ch++)
+	s->fi[ch] -= n;
+}
+
+/* copy out the samples of the blocks which are done, up to n */
+static size_t output_frames(qalimiter *s, float *const *data, size_t n, int done)
+{
+    size_t out = 0;
+    int fi = 0;
+    while (out < n && fi < done) {
+	struct block *frame = FRAME(s, fi);
+	size_t m = frame->nb_samples - s->out_pos;
+	if (m > n - out)
+	    m = n - out;
+	for (unsigned k = 0; k < s->nbufs; k++)
+	    memcpy((char *) data[k] + out * s->width,
+		    (char *) frame->data[k] + s->out_pos * s->width, m * s->width);
+	out += m;
+	s->out_pos += m;
+	if (s->out_pos == frame->nb_samples) {
+	    assert(owned(frame));
+	    free(frame->opaque);
+	    s->out_pos = 0;
+	    fi++;
+	}
+    }
+    if (fi)
+	qalimiter_release(s, fi);
+    return out;
+}
+
+size_t qalimiter_process(qalimiter *s, float *const *data, size_t n)
+{
+    if (n == 0)
+	return 0;
+
+    /* the block is allocated along with its data pointers */
+    unsigned nbufs = s->nbufs;
+    float **copy = malloc(nbufs * sizeof(float *) + nbufs * n * s->width);
+    if (!copy)
+	return 0;
+    for (unsigned k = 0; k < nbufs; k++) {
+	copy[k] = (float *) ((char *) (copy + nbufs) + k * n * s->width);
+	memcpy(copy[k], data[k], n * s->width);
+    }
+
+    int done = qalimiter_push(s, copy, n, copy);
+    if (done < 0) {
+	free(copy);
+	return 0;
+    }
+    return output_frames(s, data, n, done);
+}
+
+size_t qalimiter_flush(qalimiter *s, float *const *data, size_t n)
+{
+    if (s->nframes == 0)
+	return 0;
+    int done = qalimiter_finish(s);
+    return output_frames(s, data, n, done);
+}
@@ -0,0 +1,389 @@
+/*
+ * qalimiter_tmpl.h - the spike search and fix, instantiated once per layout
+ *
+ * Written by Alexey Tourbin.
+ * Based on qaac limiter by nu774.
+ * This file is distributed as Public Domain.
+ *
+ * Included from qalimiter.c with FMT (the name suffix), T (float or double)
+ * and PACKED defined.  The samples of channel ch are CHAN(frame, ch)[i*STRIDE]:
+ * interleaved ones are nc apart, planar ones are adjacent.
+ */
+
+#define CAT_(a, b) a##_##b
+#define CAT(a, b) CAT_(a, b)
+#define FN(name) CAT(name, FMT)
+
+#if PACKED
+#define CHAN(frame, ch) ((T *) (frame)->data[0] + (ch))
+#define STRIDE nc
+#else
+#define CHAN(frame, ch) ((T *) (frame)->data[ch])
+#define STRIDE 1
+#endif
+#define X(i) x[(i) * STRIDE]
+
+/* whether any sample of the block, of any channel, is beyond the threshold;
+ * one pass over the buffers, with no early exit, so that it vectorizes */
+static bool FN(block_hot)(float *const *data, size_t n, unsigned nc)
+{
+#if PACKED
+    const unsigned nbufs = 1;
+    n *= nc;
+#else
+    const unsigned nbufs = nc;
+#endif
+    int hot = 0;
+    for (unsigned k = 0; k < nbufs; k++) {
+	const T *x = (const T *) data[k];
+	for (size_t i = 0; i < n; i++)
+	    hot |= (x[i] > m_thresh) | (x[i] < -m_thresh);
+    }
+    return hot;
+}
+
+/* the same, the samples being scaled by gain on the way */
+static bool FN(gain_hot)(float *const *data, size_t n, unsigned nc, double gain)
+{
+#if PACKED
+    const unsigned nbufs = 1;
+    n *= nc;
+#else
+    const unsigned nbufs = nc;
+#endif
+    const T g = gain;
+    int hot = 0;
+    for (unsigned k = 0; k < nbufs; k++) {
+	T *x = (T *) data[k];
+	for (size_t i = 0; i < n; i++) {
+	    T y = x[i] *= g;
+	    hot |= (y > m_thresh) | (y < -m_thresh);
+	}
+    }
+    return hot;
+}
+
+/* one channel to bits-bit integers, ostride apart; the sum of two uniform
+ * values in [0, 1), less one, is the dither, triangular in (-1, 1) LSB */
+static inline __attribute__((always_inline))
+void FN(quantize1)(const T *x, unsigned nc, void *out, size_t ostride,
+	const int bits, size_t n, uint32_t *seed)
+{
+    const double scale = bits == 16 ? 32768.0 : 2147483648.0;
+    const double max = scale - 1;
+    uint32_t r = *seed;
+    for (size_t i = 0; i < n; i++) {
+	uint32_t r1 = r = r * 1103515245 + 12345;
+	uint32_t r2 = r = r * 1103515245 + 12345;
+	double d = ((r1 >> 8) + (r2 >> 8)) * (1.0 / (1 << 24)) - 1;
+	double v = X(i) * scale + d;
+	v = v < -scale ? -scale : v > max ? max : v;
+	if (bits == 16)
+	    ((int16_t *) out)[i * ostride] = lrint(v);
+	else
+	    ((int32_t *) out)[i * ostride] = lrint(v);
+    }
+    *seed = r;
+}
+
+static void FN(quantize)(uint32_t *seed, void *const *out, bool opacked,
+	int bits, float *const *in, size_t n, unsigned nc)
+{
+    size_t size = bits / 8;
+    for (unsigned ch = 0; ch < nc; ch++) {
+#if PACKED
+	const T *x = (const T *) in[0] + ch;
+#else
+	const T *x = (const T *) in[ch];
+#endif
+	void *o = opacked ? (char *) out[0] + ch * size : out[ch];
+	size_t ostride = opacked ? nc : 1;
+	if (bits == 16)
+	    FN(quantize1)(x, nc, o, ostride, 16, n, seed);
+	else
+	    FN(quantize1)(x, nc, o, ostride, 32, n, seed);
+    }
+}
+
+/* The zero crossings, and the peaks, are searched for RUN samples at a time:
+ * a run which is all on one side of the x-axis, or all below the threshold,
+ * is skipped as a whole, and the sample is then found within the run.  Most
+ * half-cycles are short, though, and so the first RUN samples are looked at
+ * one by one.  The functions are inlined, with neg a constant. */
+#define SAME(y) (neg ? (y) < 0 : (y) > 0)
+
+/* the first i in [pos, end) which is not below (neg) or above the x-axis,
+ * or end; the min (neg) or max of the samples before it goes to *peak */
+static inline __attribute__((always_inline))
+size_t FN(scan_fwd)(const T *x, unsigned nc, size_t pos, size_t end,
+	const bool neg, T *peak)
+{
+    T p = *peak;
+    for (; pos < end && SAME(X(pos)); pos++)
+	if (neg ? X(pos) < p : X(pos) > p)
+	    p = X(pos);
+    *peak = p;
+    return pos;
+}
+
+static inline __attribute__((always_inline))
+size_t FN(run_fwd)(const T *x, unsigned nc, size_t pos, size_t end,
+	const bool neg, T *peak)
+{
+    size_t stop = end - pos > RUN ? pos + RUN : end;
+    pos = FN(scan_fwd)(x, nc, pos, stop, neg, peak);
+    if (pos < stop || pos == end)
+	return pos;
+    T p = *peak;
+    while (pos + RUN <= end) {
+	int out = 0;
+	T q = p;
+	for (unsigned j = 0; j < RUN; j++) {
+	    T y = X(pos + j);
+	    out |= !SAME(y);
+	    q = neg ? (y < q ? y : q) : (y > q ? y : q);
+	}
+	if (out)
+	    break;
+	p = q;
+	pos += RUN;
+    }
+    *peak = p;
+    return FN(scan_fwd)(x, nc, pos, end, neg, peak);
+}
+
+/* the last i < pos which is not below (neg) or above the x-axis, or -1 */
+static inline __attribute__((always_inline))
+ssize_t FN(run_back)(const T *x, unsigned nc, ssize_t pos, const bool neg)
+{
+    ssize_t stop = pos > RUN ? pos - RUN : 0;
+    for (; pos > stop; pos--)
+	if (!SAME(X(pos - 1)))
+	    return pos - 1;
+    while (pos >= RUN) {
+	int out = 0;
+	for (unsigned j = 1; j <= RUN; j++)
+	    out |= !SAME(X(pos - j));
+	if (out)
+	    break;
+	pos -= RUN;
+    }
+    for (; pos > 0; pos--)
+	if (!SAME(X(pos - 1)))
+	    break;
+    return pos - 1;
+}
+
+#undef SAME
+
+/* fix a single spike between frame fi1 at f1_pos and frame fi2 at f2_end */
+static void FN(fix_spike1)(qalimiter *s, unsigned nc,
+	int ch, int fi1, size_t f1_pos, int fi2, size_t f2_end, T peak)
+{
+    T xpeak = peak;
+    peak = fabs(peak);
+
+    for (int fi = fi1; fi <= fi2; fi++) {
+	struct block *frame = FRAME(s, fi);
+	if (writable(s, frame) < 0)
+	    continue;
+
+	size_t begin = (fi == fi1) ? f1_pos : 0;
+	size_t end = (fi == fi2) ? f2_end : frame->nb_samples;
+	T *x = CHAN(frame, ch);
+
+	if (peak < m_thresh * 2.0) {
+	    T a = (peak - m_thresh) / (peak * peak);
+	    if (xpeak > 0) a = -a;
+	    for (size_t i = begin; i < end; ++i)
+		X(i) = X(i) + a * X(i) * X(i);
+	}
+	else {
+	    T u = peak, v = m_thresh;
+	    T a = (u - 2 * v) / (u * u * u);
+	    T b = (3 * v - 2 * u) / (u * u);
+	    if (xpeak < 0) b = -b;
+	    for (size_t i = begin; i < end; ++i)
+		X(i) = X(i) + b * X(i) * X(i) + a * X(i) * X(i) * X(i);
+	}
+    }
+}
+
+/* search for a peak (any value above the threshold) */
+static void FN(find_peak)(qalimiter *s, unsigned nc, int ch,
+	int fi1, size_t f1_pos, int fi2, size_t f2_end,
+	int *peak_fi, size_t *peak_pos, T *peak_val)
+{
+    for (int fi = fi1; fi <= fi2; fi++) {
+	struct block *frame = FRAME(s, fi);
+	if (!frame->hot)
+	    continue;
+
+	size_t begin = (fi == fi1) ? f1_pos : 0;
+	size_t end = (fi == fi2) ? f2_end : frame->nb_samples;
+	const T *x = CHAN(frame, ch);
+
+	size_t i = begin;
+	size_t stop = end - i > RUN ? i + RUN : end;
+	for (; i < stop; i++)
+	    if (X(i) > m_thresh || X(i) < -m_thresh)
+		break;
+	if (i == stop)
+	    while (i + RUN <= end) {
+		int hot = 0;
+		for (unsigned j = 0; j < RUN; j++)
+		    hot |= (X(i + j) > m_thresh) | (X(i + j) < -m_thresh);
+		if (hot)
+		    break;
+		i += RUN;
+	    }
+	for (; i < end; i++)
+	    if (X(i) > m_thresh || X(i) < -m_thresh)
+		break;
+	if (i == end)
+	    continue;
+
+	/* found a peak */
+	*peak_fi = fi;
+	*peak_pos = i;
+	*peak_val = X(i);
+	return;
+    }
+}
+
+/* whether there is a peak at all, before the spikes are fixed */
+static bool FN(any_peak)(qalimiter *s, unsigned nc, int ch,
+	int fi1, size_t f1_pos, int fi2, size_t f2_end)
+{
+    int peak_fi;
+    size_t peak_pos;
+    T peak_val = 0;
+    FN(find_peak)(s, nc, ch, fi1, f1_pos, fi2, f2_end,
+	    &peak_fi, &peak_pos, &peak_val);
+    return peak_val != 0;
+}
+
+/* when a peak is found, search backwards where the spike starts, no further
+ * than frame fi1 at f1_pos: what lies before has been output, or cut off */
+static void FN(find_spike_start)(qalimiter *s, unsigned nc, int ch,
+	int fi1, size_t f1_pos, int peak_fi, size_t peak_pos,
+	int *start_fi, size_t *start_pos,
+	T peak_val)
+{
+    for (int fi = peak_fi; fi >= fi1; fi--) {
+	struct block *frame = FRAME(s, fi);
+
+	ssize_t pos = (fi == peak_fi) ? peak_pos : frame->nb_samples;
+	size_t lo = (fi == fi1) ? f1_pos : 0;
+	const T *x = CHAN(frame, ch) + lo * STRIDE;
+
+	pos = peak_val < 0 ? FN(run_back)(x, nc, pos - lo, true)
+			   : FN(run_back)(x, nc, pos - lo, false);
+	if (pos < 0)
+	    continue;
+	/* found an intersection with the x-axis */
+	pos += lo + 1;
+	if (pos < frame->nb_samples) {
+	    *start_fi = fi;
+	    *start_pos = pos;
+	}
+	else {
+	    assert(pos == frame->nb_samples);
+	    assert(fi < peak_fi);
+	    *start_fi = fi + 1;
+	    *start_pos = 0;
+	}
+	return;
+    }
+    /* assume the leftmost */
+    *start_fi = fi1;
+    *start_pos = f1_pos;
+}
+
+/* search for the end of the spike and update the peak value */
+static void FN(find_spike_end)(qalimiter *s, unsigned nc, int ch,
+	int peak_fi, size_t peak_pos, int fi2,
+	int *end_fi, size_t *end_end,
+	T *peak_val)
+{
+    for (int fi = peak_fi; fi <= fi2; fi++) {
+	struct block *frame = FRAME(s, fi);
+
+	size_t pos = (fi == peak_fi) ? peak_pos + 1 : 0;
+	size_t end = frame->nb_samples;
+	const T *x = CHAN(frame, ch);
+
+	/* the spike is below or above the x-axis */
+	pos = *peak_val < 0 ? FN(run_fwd)(x, nc, pos, end, true, peak_val)
+			    : FN(run_fwd)(x, nc, pos, end, false, peak_val);
+
+	if (pos == end)
+	    continue;
+	/* found an intersection with the x-axis */
+	*end_fi = fi;
+	*end_end = pos;
+	return;
+    }
+    /* assume the rightmost */
+    *end_fi = fi2;
+    *end_end = FRAME(s, fi2)->nb_samples;
+}
+
+static void FN(fix_spikes)(qalimiter *s, int ch,
+	int fi1, size_t f1_pos, int fi2, size_t f2_end)
+{
+    const unsigned nc = s->nc;
+    while (1) {
+	/* find a peak */
+	int peak_fi;
+	size_t peak_pos;
+	T peak_val = 0;
+	FN(find_peak)(s, nc, ch, fi1, f1_pos, fi2, f2_end,
+		&peak_fi, &peak_pos, &peak_val);
+	if (peak_val == 0)
+	    return;
+
+	/* find the start of the spike */
+	int start_fi;
+	size_t start_pos;
+	FN(find_spike_start)(s, nc, ch, fi1, f1_pos, peak_fi, peak_pos,
+		&start_fi, &start_pos, peak_val);
+	assert(start_fi > fi1 || (start_fi == fi1 && start_pos >= f1_pos));
+
+	/* find the end of the spike and uptdate the peak value */
+	int end_fi;
+	size_t end_end;
+	FN(find_spike_end)(s, nc, ch, peak_fi, peak_pos, fi2,
+		&end_fi, &end_end, &peak_val);
+	assert(end_fi < fi2 || (end_fi == fi2 && end_end <= f2_end));
+
+	/* fix the spike */
+	FN(fix_spike1)(s, nc, ch,
+		start_fi, start_pos, end_fi, end_end, peak_val);
+
+	if (end_fi == fi2 && end_end == f2_end)
+	    break;
+	fi1 = end_fi;
+	f1_pos = end_end;
+    }
+}
+
+/* find the end limit up to which the buffer can be processed;
+ * that is, up to the last intersection with the x-axis */
+static size_t FN(find_channel_end)(struct block *frame, unsigned nc, int ch)
+{
+    const T *x = CHAN(frame, ch);
+    ssize_t pos = frame->nb_samples - 1;
+    if (X(pos) < 0)
+	pos = FN(run_back)(x, nc, pos, true);
+    else if (X(pos) > 0)
+	pos = FN(run_back)(x, nc, pos, false);
+    return pos + 1;
+}
+
+#undef FMT
+#undef T
+#undef PACKED
+#undef CHAN
+#undef STRIDE
+#undef X
@@ -30,15 +30,16 @@ SOFTWARE.
 #include <math.h>
 #include <stdint.h>
 
-/* Workaround a lack of optimization in gcc */
-float exp_cst1_f = 2139095040.f;
-float exp_cst2_f = 0.f;
-
 /* Relative error bounded by 1e-5 for normalized outputs
    Returns invalid outputs for nan inputs
    Continuous error */
 static inline float expapprox(float val)
 {
+  /* These used to be non-static globals, as a workaround for a lack of
+     optimization in gcc, which made the header unusable from more than
+     one translation unit.  Current gcc emits min/max for either. */
+  const float exp_cst1_f = 2139095040.f;
+  const float exp_cst2_f = 0.f;
   union { int32_t i; float f; } xu, xu2;
   float val2, val3, val4, b;
   int32_t val4i;
@@ -90,4 +91,46 @@ static inline float logapprox(float val)
     + (addcst + 0.6931471805f*exp);
 }
 
+
+/* Lower-order versions of the above, for when the gain only needs to be
+   within 0.007 dB: relative error of expapprox_fast() is bounded by 1.2e-4
+   (0.001 dB), absolute error of logapprox_fast() by 6.3e-4 (0.0055 dB),
+   same domains, as measured over all the floats with and without FMA.
+   The error of the level goes into the gain scaled by the slope of the
+   gain computer, which is less than 1.
+   The minimax polynomials are fitted in the same bases, x and (x-1)*log(2)
+   plus (x-1)*(x-2)*{1,x}, so they are exact at 1 and 2, and the error is
+   still continuous. */
+static inline float expapprox_fast(float val)
+{
+  union { int32_t i; float f; } xu, xu2;
+  float val2, val3, val4, b;
+  int32_t val4i;
+  val2 = 12102203.1615614f*val+1065353216.f;
+  val3 = val2 < 2139095040.f ? val2 : 2139095040.f;
+  val4 = val3 > 0.f ? val3 : 0.f;
+  val4i = (int32_t) val4;
+  xu.i = val4i & 0x7F800000;
+  xu2.i = (val4i & 0x7FFFFF) | 0x3F800000;
+  b = xu2.f;
+  return
+    xu.f * (0.45261536455f + b * (0.47761289356f + b *
+              (-8.4962283058e-3f + b * 7.8267970193e-2f)));
+}
+
+static inline float logapprox_fast(float val)
+{
+  union { float f; int32_t i; } valu;
+  float exp, addcst, x;
+  valu.f = val;
+  exp = valu.i >> 23;
+  /* -89.529781054f = -127 * log(2) + constant term of polynomial below. */
+  addcst = val > 0 ? -89.529781054f : -(float)INFINITY;
+  valu.i = (valu.i & 0x7FFFFF) | 0x3F800000;
+  x = valu.f;
+  return
+    x * (2.1242861498f + x * (-0.73456005542f + x * 0.11036302814f))
+    + (addcst + 0.6931471805f*exp);
+}
+
 #endif